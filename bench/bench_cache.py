@@ -0,0 +1,46 @@
+"""Benchmark of changing keys with many cached neighbor queries.
+
+With cache_size > 0, adding or removing a key only records the key in a log
+per key length. Cached queries are checked against the log when they are
+next looked up, so the cost of a change does not grow with the number of
+cached queries. The same keys are inserted into tries caching few and many
+queries of another part of the key space.
+
+Usage: python bench/bench_cache.py [num_cached [num_inserts [keylen]]]
+"""
+from __future__ import print_function
+import sys
+import time
+from itertools import islice, product
+
+from vtrie import Trie
+
+def insert_time(num_cached, num_inserts, keylen, repeat=3):
+    """Best time of inserting num_inserts keys with num_cached queries."""
+    best = None
+    for _ in range(repeat):
+        t = Trie(cache_size=num_cached)
+        cached = ["".join(key).encode() for key in islice(product("AC",
+            repeat=keylen), num_cached)]
+        for key in cached:
+            t[key] = 0
+        for key in cached:
+            list(t.neighbors(key, 1))
+        assert t.cache_stats()["entries"] == num_cached
+        inserts = ["".join(key).encode() for key in islice(product("GT",
+            repeat=keylen), num_inserts)]
+        start = time.time()
+        for key in inserts:
+            t[key] = 0
+        elapsed = time.time() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+def main(num_cached=16000, num_inserts=2000, keylen=14):
+    print("%d inserts of keys of length %d" % (num_inserts, keylen))
+    for n in (10, num_cached):
+        print("%d cached queries: %.4fs" % (n, insert_time(n, num_inserts,
+            keylen)))
+
+if __name__ == "__main__":
+    main(*map(int, sys.argv[1:]))
@@ -0,0 +1,57 @@
+"""Benchmark of breadth-first against depth-first neighbor searches.
+
+neighbors(engine="frontier") expands all states within maxhd one level at a
+time and prefetches the children of the next level, while engine="trie"
+searches depth-first with a stack. The keys are drawn from a large alphabet,
+so the upper levels of the trie have a high fanout and the frontier grows
+wide. Both engines search the trie as inserted (nodes scattered over the
+heap) and after relayout().
+
+Usage: python bench/bench_frontier.py [num_keys [keylen [alphabet_size]]]
+"""
+from __future__ import print_function
+import random
+import string
+import sys
+import time
+
+from vtrie import Trie
+
+def timed(t, queries, maxhd, engine, repeat=3):
+    """Best time of repeat runs and the number of neighbors found."""
+    best = None
+    for _ in range(repeat):
+        start = time.time()
+        n = 0
+        for query in queries:
+            for _ in t.neighbors(query, maxhd, engine=engine):
+                n += 1
+        elapsed = time.time() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best, n
+
+def main(num_keys=200000, keylen=8, alphabet_size=32, num_queries=200):
+    rng = random.Random(98)
+    alphabet = (string.ascii_letters + string.digits)[:alphabet_size]
+    keys = list(set("".join(rng.choice(alphabet) for _ in range(keylen))
+        .encode() for _ in range(num_keys)))
+    t = Trie()
+    for i, key in enumerate(keys):
+        t[key] = i
+    queries = rng.sample(keys, min(num_queries, len(keys)))
+
+    print("%d keys of length %d over %d characters, %d queries" % (
+        len(keys), keylen, alphabet_size, len(queries)))
+    for layout in ("inserted", "relayout"):
+        if layout == "relayout":
+            t.relayout()
+        for maxhd in (1, 2, 3):
+            dfs, n = timed(t, queries, maxhd, "trie")
+            bfs, m = timed(t, queries, maxhd, "frontier")
+            assert n == m
+            print("%s maxhd=%d: %d neighbors, depth-first %.3fs, "
+                    "breadth-first %.3fs (%.2fx)" % (layout, maxhd, n, dfs,
+                        bfs, dfs / bfs))
+
+if __name__ == "__main__":
+    main(*map(int, sys.argv[1:]))
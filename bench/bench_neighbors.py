@@ -0,0 +1,52 @@
+"""Benchmark of neighbor searches with maxhd 1.
+
+Without equiv, neighbors() with maxhd 1 uses a kernel that follows the path
+of the query and descends directly after each mismatch. Passing an empty
+equiv dict forces the generic search, which also looks characters up in the
+(empty) character classes, so part of the difference is due to that lookup.
+
+Usage: python bench/bench_neighbors.py [num_keys [keylen [num_queries]]]
+"""
+from __future__ import print_function
+import random
+import sys
+import time
+
+from vtrie import Trie
+
+def random_keys(n, keylen, rng):
+    return set("".join(rng.choice("ACGT") for _ in range(keylen)).encode()
+            for _ in range(n))
+
+def timed(t, queries, maxhd, equiv, repeat=3):
+    """Best time of repeat runs and the number of neighbors found."""
+    best = None
+    for _ in range(repeat):
+        start = time.time()
+        n = 0
+        for query in queries:
+            for _ in t.neighbors(query, maxhd, equiv=equiv):
+                n += 1
+        elapsed = time.time() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best, n
+
+def main(num_keys=200000, keylen=15, num_queries=20000):
+    rng = random.Random(95)
+    keys = list(random_keys(num_keys, keylen, rng))
+    t = Trie()
+    for i, key in enumerate(keys):
+        t[key] = i
+    t.relayout()
+    queries = rng.sample(keys, min(num_queries, len(keys)))
+
+    print("%d keys of length %d, %d queries" % (len(keys), keylen,
+        len(queries)))
+    generic, n = timed(t, queries, 1, {})
+    direct, m = timed(t, queries, 1, None)
+    assert n == m
+    print("%d neighbors, generic %.3fs, direct %.3fs (%.1fx)" % (n, generic,
+        direct, generic / direct))
+
+if __name__ == "__main__":
+    main(*map(int, sys.argv[1:]))
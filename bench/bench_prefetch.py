@@ -0,0 +1,102 @@
+"""Benchmark of software prefetching in the trie iterators.
+
+The neighbors(), suffixes() and pairs() searches of the trie prefetch the
+next sibling and the first child of every state they push (see
+TRIE_PREFETCH in trie_internal.h). The gain shows on tries that do not fit
+in the last level cache, where every step from a node to another is likely a
+cache miss, so the default trie here takes a few hundred MB. The module is
+built twice in a temporary directory, with VTRIE_PREFETCH=0 and with the
+default or given setting, and the same searches are timed with each, on the
+trie as inserted (nodes scattered over the heap) and after relayout().
+
+Usage: python bench/bench_prefetch.py [num_keys [keylen [prefetch]]]
+"""
+from __future__ import print_function
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+def build(prefetch, tmp):
+    """Builds the module into a directory of tmp and returns its path."""
+    lib = os.path.join(tmp, "lib%s" % prefetch)
+    env = dict(os.environ)
+    if prefetch:
+        env["VTRIE_PREFETCH"] = prefetch
+    with open(os.devnull, "w") as devnull:
+        subprocess.check_call([sys.executable, "setup.py", "-q", "build_ext",
+            "-b", lib, "-t", os.path.join(tmp, "build%s" % prefetch)],
+            cwd=os.path.dirname(here), env=env, stdout=devnull,
+            stderr=devnull)
+    return lib
+
+def timed(f, repeat=3):
+    """Best time of repeat calls of f and its result."""
+    best = None
+    for _ in range(repeat):
+        start = time.time()
+        n = f()
+        elapsed = time.time() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best, n
+
+def run(num_keys, keylen):
+    """Times the searches with the module on the path, one line each."""
+    from vtrie import Trie
+    rng = random.Random(100)
+    keys = sorted(set("".join(rng.choice("ACGT") for _ in range(keylen))
+        .encode() for _ in range(num_keys)))
+    t = Trie()
+    for i, key in enumerate(keys):
+        t[key] = i
+    queries = rng.sample(keys, 1000)
+    prefixes = [key[:keylen // 2] for key in queries]
+
+    searches = [
+        ("neighbors", lambda: sum(1 for q in queries
+            for _ in t.neighbors(q, 3, engine="trie"))),
+        ("suffixes", lambda: sum(1 for p in prefixes
+            for _ in t.suffixes(p))),
+        ("pairs", lambda: sum(1 for _ in t.pairs(keylen, 1,
+            engine="trie"))),
+        ]
+    for layout in ("inserted", "relayout"):
+        if layout == "relayout":
+            t.relayout()
+        for name, f in searches:
+            elapsed, n = timed(f)
+            print("%s %s %d %.4f" % (layout, name, n, elapsed))
+            sys.stdout.flush()
+
+def main(num_keys=500000, keylen=14, prefetch=""):
+    tmp = tempfile.mkdtemp()
+    try:
+        results = {}
+        for setting in ("0", prefetch):
+            env = dict(os.environ, PYTHONPATH=build(setting, tmp))
+            out = subprocess.check_output([sys.executable, __file__,
+                "--run", str(num_keys), str(keylen)], env=env)
+            for line in out.decode().splitlines():
+                layout, name, n, elapsed = line.split()
+                results.setdefault((layout, name), []).append(
+                        (int(n), float(elapsed)))
+    finally:
+        shutil.rmtree(tmp)
+
+    print("%d keys of length %d, prefetch %s" % (num_keys, keylen,
+        prefetch or "default"))
+    for (layout, name), ((n, off), (m, on)) in sorted(results.items()):
+        assert n == m
+        print("%s %s: %d results, without prefetch %.3fs, with %.3fs "
+                "(%.2fx)" % (layout, name, n, off, on, off / on))
+
+if __name__ == "__main__":
+    if sys.argv[1:2] == ["--run"]:
+        run(*map(int, sys.argv[2:4]))
+    else:
+        main(*(list(map(int, sys.argv[1:3])) + sys.argv[3:4]))
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ALPHABET_H
+#define ALPHABET_H
+
+/*
+ * Alphabet mapping unicode code points to trie characters.
+ *
+ * Each distinct code point of a set of strings is given its own character,
+ * in order of appearance, so strings of code points can be stored in a trie
+ * with one node per code point. Hamming distances between encoded strings
+ * therefore count code points, not bytes of some multi-byte encoding.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "trie.h"
+
+/* Maximum number of distinct code points in an alphabet */
+#define ALPHABET_MAX_SIZE 255
+
+/* Character that no code point is mapped to. Code points that are not in the
+ * alphabet are encoded as this character when looking up strings, so strings
+ * containing such code points are never found in the trie. */
+#define ALPHABET_UNKNOWN ((TRIECHAR)0xff)
+
+typedef struct TrieAlphabet TrieAlphabet;
+
+TrieAlphabet *triealphabet_new(void);
+void triealphabet_free(TrieAlphabet *alphabet);
+size_t triealphabet_size(const TrieAlphabet *alphabet);
+size_t triealphabet_mem_usage(const TrieAlphabet *alphabet);
+/* 0 means success, -1 that the alphabet is full */
+int triealphabet_encode(TrieAlphabet *alphabet, const uint32_t *code_points,
+        size_t n, TRIECHAR *s, bool add);
+void triealphabet_decode(const TrieAlphabet *alphabet, const TRIECHAR *s,
+        size_t n, uint32_t *code_points);
+
+#endif /* defined ALPHABET_H */
@@ -27,6 +27,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef enum {
     E_SUCCESS = 0,
@@ -37,6 +38,9 @@ typedef enum {
 typedef char TRIECHAR;
 typedef void TRIEVALUE;
 
+/* Keys are arbitrary sequences of bytes, given as a pointer and a length, so
+ * they may contain NUL characters. Keys stored in the trie are NUL-terminated
+ * all the same, for the convenience of users storing text. */
 struct TrieItem {
     TRIECHAR *key;
     TRIEVALUE *value;   /* user provided value to associate with string */
@@ -52,6 +56,7 @@ struct TrieSearchResult {
 };
 
 typedef struct TrieRoot TrieRoot;
+typedef struct TrieCharClasses TrieCharClasses; /* Character equivalences */
 typedef struct TrieIter TrieIter; /* Iterator for traversing a trie */
 typedef struct TrieItem TrieItem;
 typedef struct TrieSearchResult TrieSearchResult;
@@ -61,6 +66,16 @@ typedef struct TrieSearchResult TrieSearchResult;
  * `free` function. */
 typedef void (*DeallocHandler) (void*);
 
+/* Predicate used to select items, returns 1 for true, 0 for false, and -1 on
+ * error. */
+typedef int (*TrieItemPredicate) (const TrieItem *, void *);
+
+/* Handler called for every occurrence of a key found by trie_scan and
+ * trie_scan_approx. pos is the start of the occurrence in the text and hd its
+ * Hamming distance to the key. Returning non-zero stops the scan. */
+typedef int (*TrieScanHandler) (size_t pos, int hd, const TrieItem *item,
+        void *arg);
+
 /* Creating and destroying a trie */
 
 TrieRoot *trie_new(void);
@@ -72,24 +87,163 @@ size_t trie_num_nodes(const TrieRoot *root);
 size_t trie_num_items(const TrieRoot *root);
 size_t trie_mem_usage(const TrieRoot *root);
 
+/* Compiling a trie into a faster, read-only form. The compiled form is
+ * dropped as soon as keys are added to or removed from the trie. */
+
+int trie_compile(TrieRoot *root);
+bool trie_is_compiled(const TrieRoot *root);
+
+/* Maintaining a mirror of the trie with all keys reversed, for queries
+ * anchored at the end of keys. 0 means success, -1 error */
+
+int trie_enable_reverse(TrieRoot *root);
+bool trie_has_reverse(const TrieRoot *root);
+
+/* Tracking the keys added since a checkpoint, 0 means success, -1 error */
+
+int trie_checkpoint(TrieRoot *root);
+
+/* Caching the results of trieiter_neighbors. Entries are only dropped when
+ * keys within their maxhd are added or removed. */
+
+struct TrieCacheStats {
+    size_t capacity;        /* maximum number of cached queries */
+    size_t num_entries;
+    size_t hits;
+    size_t misses;
+    size_t memsize;         /* bytes used by the cache */
+};
+typedef struct TrieCacheStats TrieCacheStats;
+
+/* A capacity of 0 disables the cache, 0 means success, -1 error */
+int trie_set_cache_size(TrieRoot *root, size_t capacity);
+void trie_cache_stats(const TrieRoot *root, TrieCacheStats *stats);
+
+/* Engines for finding neighbors and pairs of keys */
+
+typedef enum {
+    TRIE_ENGINE_TRIE = 0,       /* search the trie */
+    TRIE_ENGINE_SCAN,           /* compare with every key of the length */
+    TRIE_ENGINE_MASKED,         /* masked key index, pairs at maxhd 1 only */
+    TRIE_ENGINE_FRONTIER,       /* breadth-first search, neighbors only */
+    TRIE_ENGINE_SPLIT,          /* search the halves of the keys apart */
+    TRIE_NUM_ENGINES,
+    TRIE_ENGINE_AUTO = TRIE_NUM_ENGINES /* engine with the lowest cost */
+} TrieEngine;
+
+struct TriePlan {
+    TrieEngine engine;          /* applicable engine with the lowest cost */
+    double cost[TRIE_NUM_ENGINES]; /* estimates, negative if not applicable */
+    size_t num_keys;            /* keys of the length searched */
+    int alphabet;               /* distinct characters in the keys */
+};
+typedef struct TriePlan TriePlan;
+
+/* Estimating the cost of each engine, 0 means success, -1 error */
+int trie_plan_neighbors(TrieRoot *root, size_t keylen, int maxhd,
+        const TrieCharClasses *classes, TriePlan *plan);
+int trie_plan_pairs(TrieRoot *root, size_t keylen, int maxhd,
+        const TrieCharClasses *classes, TriePlan *plan);
+
+/* Reorganizing the nodes of a trie in memory */
+
+int trie_relayout(TrieRoot *root);
+/* Returns the number of bytes reclaimed */
+size_t trie_compact(TrieRoot *root);
+
 /* Getting, setting, and deleting items (i.e. key-value pairs) */
 
-const TrieItem *trie_get_item(const TrieRoot *root, const TRIECHAR *key);
+const TrieItem *trie_get_item(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen);
 /* 0 means success, -1 error */
-int trie_set_item(TrieRoot *root, const TRIECHAR *key, TRIEVALUE *value,
-        DeallocHandler dealloc);
+int trie_set_item(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        TRIEVALUE *value, DeallocHandler dealloc);
 /* 0 means success, -1 error */
-int trie_del_item(TrieRoot *root, const TRIECHAR *key, DeallocHandler dealloc);
+int trie_del_item(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        DeallocHandler dealloc);
+/* 0 means key was added, 1 that a key within maxhd was found, -1 error */
+int trie_insert_if_isolated(TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, TRIEVALUE *value, int maxhd,
+        const TrieCharClasses *classes, DeallocHandler dealloc,
+        const TrieItem **blocker, int *hd);
+/* Removes all keys starting with key, returns the number of removed items */
+size_t trie_del_prefix(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        DeallocHandler dealloc);
+
+/* Removes all items not satisfying pred, 0 means success, -1 error */
+int trie_retain(TrieRoot *root, TrieItemPredicate pred, void *arg,
+        DeallocHandler dealloc, size_t *num_removed);
+
+/* Character equivalences used when computing Hamming distances. Every
+ * character is associated with a set of characters (by default just itself),
+ * and two characters match if their sets share a character. E.g. to let 'N'
+ * match any nucleotide, associate 'N' with "ACGT". */
+
+TrieCharClasses *triecharclasses_new(void);
+TrieCharClasses *triecharclasses_copy(const TrieCharClasses *classes);
+void triecharclasses_free(TrieCharClasses *classes);
+void triecharclasses_set(TrieCharClasses *classes, TRIECHAR ch,
+        const TRIECHAR *members, size_t num_members);
 
 /* Searching through a trie */
 
-bool trie_has_key(const TrieRoot *root, const TRIECHAR *key);
-bool trie_has_node(const TrieRoot *root, const TRIECHAR *key);
+bool trie_has_key(const TrieRoot *root, const TRIECHAR *key, size_t keylen);
+bool trie_has_node(const TrieRoot *root, const TRIECHAR *key, size_t keylen);
 const TrieItem *trie_longest_prefix(const TrieRoot *root,
-        const TRIECHAR *key);
-TrieIter *trieiter_suffixes(TrieRoot *root, const TRIECHAR *key);
-TrieIter *trieiter_neighbors(TrieRoot *root, const TRIECHAR *key, int maxhd);
-TrieIter *trieiter_hammingpairs(TrieRoot *root, int stringlen, int maxhd);
+        const TRIECHAR *key, size_t keylen);
+/* hd may be NULL, otherwise it is set to the Hamming distance of the match */
+const TrieItem *trie_longest_prefix_approx(const TrieRoot *root,
+        const TRIECHAR *key, size_t keylen, int maxhd,
+        const TrieCharClasses *classes, int *hd);
+/* Neighbors as found by trieiter_neighbors, but key need not be a key */
+bool trie_has_neighbor(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes);
+size_t trie_count_neighbors(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes);
+/* items needs room for keylen + 1 items, returns the number of items found */
+size_t trie_prefixes(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, const TrieItem **items);
+/* 0 means success, -1 error, other values are returned by handler */
+int trie_scan(TrieRoot *root, const TRIECHAR *text, size_t len,
+        TrieScanHandler handler, void *arg);
+int trie_scan_approx(const TrieRoot *root, const TRIECHAR *text, size_t len,
+        int maxhd, const TrieCharClasses *classes, TrieScanHandler handler,
+        void *arg);
+int trie_segment(const TrieRoot *root, const TRIECHAR *text, size_t len,
+        TrieScanHandler handler, void *arg);
+/* The following need the reverse of the trie, see trie_enable_reverse */
+const TrieItem *trie_longest_suffix(const TrieRoot *root,
+        const TRIECHAR *key, size_t keylen);
+/* Keys ending in s with at most maxhd mismatches, pos is where s starts */
+int trie_endswith(const TrieRoot *root, const TRIECHAR *s, size_t len,
+        int maxhd, const TrieCharClasses *classes, TrieScanHandler handler,
+        void *arg);
+/* Keys containing s, pos is the position of s in the key */
+int trie_find_substring(TrieRoot *root, const TRIECHAR *s, size_t len,
+        TrieScanHandler handler, void *arg);
+int trie_substring_neighbors(TrieRoot *root, const TRIECHAR *s, size_t len,
+        int maxhd, TrieScanHandler handler, void *arg);
+TrieIter *trieiter_suffixes(TrieRoot *root, const TRIECHAR *key,
+        size_t keylen);
+/* classes may be NULL, meaning characters only match themselves */
+TrieIter *trieiter_neighbors(TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes);
+TrieIter *trieiter_hammingpairs(TrieRoot *root, int stringlen, int maxhd,
+        const TrieCharClasses *classes);
+/* As above, using the given engine. NULL if the engine does not apply. */
+TrieIter *trieiter_neighbors_engine(TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes,
+        TrieEngine engine);
+TrieIter *trieiter_pairs_engine(TrieRoot *root, int stringlen, int maxhd,
+        const TrieCharClasses *classes, TrieEngine engine);
+/* Same pairs as trieiter_hammingpairs with maxhd 1, using a masked key
+ * index instead of searching the trie */
+TrieIter *trieiter_maskedpairs(TrieRoot *root, int stringlen);
+/* Pairs with at least one key added since the checkpoint, see
+ * trie_checkpoint. Keys of length stringlen are no longer new once all pairs
+ * have been iterated over. */
+TrieIter *trieiter_deltapairs(TrieRoot *root, int stringlen, int maxhd,
+        const TrieCharClasses *classes);
 TrieSearchResult *trieiter_next(TrieIter *it);
 void trieiter_free(TrieIter *it);
 size_t trieiter_len_query(TrieIter *it);
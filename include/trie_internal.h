@@ -0,0 +1,314 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TRIE_INTERNAL_H
+#define TRIE_INTERNAL_H
+
+/*
+ * Internal definitions of the trie structures, shared by the modules that
+ * implement the trie. Users of the trie should only include trie.h.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "trie.h"
+
+/*
+ * Flags used to set the status of nodes/trie.
+ */
+#define TRIE_EXPLORED      0x0001
+#define TRIE_POOLED        0x0002  /* node is part of a pool of nodes */
+
+/* Define the fields of a TrieNode */
+#define TrieNode_FIELDS                                             \
+    struct TrieItem item;                                           \
+    struct TrieNode *parent;                                        \
+    struct TrieNode *sibling;   /* points to next sibling */        \
+    struct TrieNode *child;     /* first in a list of children */   \
+    TRIECHAR ch;                                                    \
+    int flags;
+
+struct ListNode {
+    void *value;
+    struct ListNode *next;
+};
+
+struct TrieNode {
+    TrieNode_FIELDS
+};
+
+struct TrieRoot {
+    TrieNode_FIELDS         /* Root node can hold empty string */
+    size_t num_nodes;       /* Number of nodes in the Trie */
+    size_t num_items;       /* Number of items in the Trie */
+    size_t memsize;         /* Size of trie in memory in bytes */
+    long long state_id;     /* identifier for current state of the Trie */
+    TrieIter *dirty_iter;   /* active dirty iterator, NULL if nothing active */
+    struct DoubleArray *da; /* compiled read-only copy, NULL if not compiled */
+    struct ListNode *pools; /* blocks of nodes allocated at once */
+    struct TrieNode *free_nodes; /* released pool nodes, linked by sibling */
+    size_t num_released;    /* nodes freed one by one since trie_compact */
+    struct SubstringIndex *si; /* suffixes of all keys, NULL if not built */
+    struct TrieRoot *reverse;   /* reversed keys, NULL if not maintained */
+    struct TrieCache *cache;    /* neighbor query results, NULL if disabled */
+    struct TrieRoot *delta;     /* keys added since the checkpoint, NULL if
+                                   no checkpoint was made */
+    struct TrieStats *stats;    /* statistics of the keys, NULL until a
+                                   search is first planned */
+    struct FlatKeys *flat;      /* flat copies of the keys of some lengths */
+    struct SplitIndex *split;   /* half key indexes of some lengths */
+};
+
+/* States at one depth of a breadth-first search, see trie.c */
+struct TrieFrontier {
+    const struct TrieNode **nodes;
+    int *hds;                   /* Hamming distance of each node */
+    size_t len;
+    size_t pos;                 /* next state to expand or return */
+    size_t size;                /* number of states allocated */
+};
+
+/* Keys found by a search of a split index, see splitindex.c */
+struct SplitMatch {
+    size_t index;               /* index of the key in the split index */
+    int hd;
+};
+
+struct SplitMatches {
+    struct SplitMatch *matches;
+    size_t len;
+    size_t size;                /* number of matches allocated */
+};
+
+struct TrieIterState {
+    struct TrieNode *node;  /* current node */
+    struct TrieNode *query; /* node corresponding to current query string */
+    int hd;                 /* Hamming distance between `node` and `query` */
+    int depth;              /* depth of `node` in the trie */
+};
+
+typedef TrieSearchResult * (*TrieIterNextFunc) (TrieIter *);
+
+struct TrieIter {
+    struct TrieRoot *root;
+    struct TrieIterState *head;
+    struct TrieIterState *fill; /* points at new position to be filled */
+    struct TrieIterState *tail;
+    int maxhd;
+    int target_depth;
+    int len_query;
+    bool is_dirty;
+    long long trie_state_id;    /* state_id of Trie at iter creation */
+    int errcode;
+    struct ListNode *stack;
+    TrieIterNextFunc next;
+    TrieCharClasses *classes;   /* NULL if characters only match themselves */
+    struct TrieCacheEntry *entry; /* results being recorded or replayed */
+    size_t pos;                 /* next result of entry to replay */
+    struct MaskIndex *mask;     /* index used by trieiter_maskedpairs */
+    const struct FlatKeys *flat; /* keys compared by a scan, NULL if the
+                                    trie is searched */
+    size_t pos2;                /* second key of the pair being compared */
+    struct TrieFrontier *frontier; /* levels of a breadth-first search */
+    const struct SplitIndex *split; /* half key indexes searched, NULL if
+                                       not searched */
+    struct SplitMatches found;  /* keys found through split */
+};
+
+/*
+ * Software prefetching of nodes about to be visited, which hides part of the
+ * latency of following child and sibling pointers on tries that do not fit
+ * in the caches. TRIE_PREFETCH = 0 disables it, and 1 to 3 set how long the
+ * prefetched node should stay cached, from the last level only (1) to all
+ * levels (3). Set it at build time, e.g. VTRIE_PREFETCH=0 for setup.py.
+ */
+#ifndef TRIE_PREFETCH
+#if defined(__GNUC__)
+#define TRIE_PREFETCH 3
+#else
+#define TRIE_PREFETCH 0
+#endif
+#endif
+
+#if TRIE_PREFETCH > 0
+#define trienode_prefetch(node) __builtin_prefetch((node), 0, TRIE_PREFETCH)
+#else
+#define trienode_prefetch(node) ((void)(node))
+#endif
+
+/* Sets of characters are stored as bitsets over all 256 characters */
+#define TRIE_NUM_CHARS 256
+#define TRIE_BITSET_WORDS (TRIE_NUM_CHARS / 64)
+
+struct TrieCharClasses {
+    uint64_t members[TRIE_NUM_CHARS][TRIE_BITSET_WORDS];
+    /* characters whose set of members intersects that of a character */
+    uint64_t matches[TRIE_NUM_CHARS][TRIE_BITSET_WORDS];
+};
+
+/* True if a and b are considered equal under classes (which may be NULL) */
+static inline bool
+triecharclasses_match(const TrieCharClasses *classes, TRIECHAR a, TRIECHAR b)
+{
+    if (a == b)
+        return true;
+    if (classes == NULL)
+        return false;
+    unsigned char ua = (unsigned char)a;
+    unsigned char ub = (unsigned char)b;
+    return (classes->matches[ua][ub >> 6] >> (ub & 63)) & 1;
+}
+
+typedef struct ListNode ListNode;
+typedef struct TrieIterState TrieIterState;
+typedef struct TrieNode TrieNode;
+typedef struct DoubleArray DoubleArray;
+typedef struct SubstringIndex SubstringIndex;
+typedef struct TrieCache TrieCache;
+typedef struct MaskIndex MaskIndex;
+typedef struct FlatKeys FlatKeys;
+typedef struct TrieStats TrieStats;
+typedef struct TrieFrontier TrieFrontier;
+typedef struct SplitIndex SplitIndex;
+typedef struct SplitMatch SplitMatch;
+typedef struct SplitMatches SplitMatches;
+typedef struct TrieCacheEntry TrieCacheEntry;
+
+/* Double-array (compiled) form of a trie, see datrie.c */
+
+DoubleArray *datrie_new(const TrieRoot *root);
+void datrie_free(DoubleArray *da);
+size_t datrie_mem_usage(const DoubleArray *da);
+const TrieItem *datrie_get_item(const DoubleArray *da, const TRIECHAR *key,
+        size_t keylen);
+bool datrie_has_node(const DoubleArray *da, const TRIECHAR *key,
+        size_t keylen);
+const TrieItem *datrie_longest_prefix(const DoubleArray *da,
+        const TRIECHAR *key, size_t keylen);
+size_t datrie_prefixes(const DoubleArray *da, const TRIECHAR *key,
+        size_t keylen, const TrieItem **items);
+void datrie_build_links(DoubleArray *da, const TrieRoot *root);
+int datrie_scan(const DoubleArray *da, const TRIECHAR *text, size_t len,
+        TrieScanHandler handler, void *arg);
+
+/* Substring index of a trie, see substring.c */
+
+SubstringIndex *substringindex_new(const TrieRoot *root);
+void substringindex_free(SubstringIndex *si);
+size_t substringindex_mem_usage(const SubstringIndex *si);
+int substringindex_find(const SubstringIndex *si, const TRIECHAR *s,
+        size_t n, TrieScanHandler handler, void *arg);
+int substringindex_neighbors(const SubstringIndex *si, const TRIECHAR *s,
+        size_t n, int maxhd, TrieScanHandler handler, void *arg);
+
+/* Cache of neighbor query results, see cache.c */
+
+struct TrieCacheResult {
+    const TrieItem *item;
+    int hd;
+};
+
+struct TrieCacheEntry {
+    TRIECHAR *key;              /* query */
+    size_t keylen;
+    int maxhd;
+    TrieCharClasses *classes;
+    uint64_t hash;
+    uint64_t version;           /* changes to keys of keylen seen so far */
+    struct TrieCacheResult *results;
+    size_t num_results;
+    size_t size;                /* number of results allocated */
+    struct TrieCacheEntry *prev;    /* more recently used entry */
+    struct TrieCacheEntry *next;    /* less recently used entry */
+    struct TrieCacheEntry *chain;   /* next entry in the same bucket */
+};
+
+TrieCacheEntry *triecacheentry_new(const TRIECHAR *key, size_t keylen,
+        int maxhd, const TrieCharClasses *classes);
+void triecacheentry_free(TrieCacheEntry *entry);
+void triecacheentry_add_result(TrieCacheEntry *entry, const TrieItem *item,
+        int hd);
+TrieCache *triecache_new(size_t capacity);
+void triecache_free(TrieCache *cache);
+void triecache_clear(TrieCache *cache);
+const TrieCacheEntry *triecache_get(TrieCache *cache, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes);
+void triecache_put(TrieCache *cache, TrieCacheEntry *entry);
+void triecache_invalidate(TrieCache *cache, const TRIECHAR *key,
+        size_t keylen);
+void triecache_stats(TrieCache *cache, TrieCacheStats *stats);
+size_t triecache_mem_usage(const TrieCache *cache);
+
+/* Masked key index for pairs at Hamming distance 1, see maskindex.c */
+
+MaskIndex *maskindex_new(const TrieRoot *root, size_t keylen);
+void maskindex_free(MaskIndex *mi);
+bool maskindex_next_pair(MaskIndex *mi, const TrieItem **a,
+        const TrieItem **b);
+
+/* Flat copy of the keys of one length for scans, see flatkeys.c */
+
+struct FlatKeys {
+    size_t keylen;
+    size_t stride;              /* characters per key, including padding */
+    size_t num_keys;
+    TRIECHAR *keys;             /* the keys back to back */
+    const TrieItem **items;     /* item of each key */
+    struct FlatKeys *next;      /* copy for another length */
+};
+
+FlatKeys *flatkeys_new(const TrieRoot *root, size_t keylen);
+void flatkeys_free(FlatKeys *fk);
+size_t flatkeys_mem_usage(const FlatKeys *fk);
+size_t flatkeys_find(const FlatKeys *fk, size_t i, const TRIECHAR *key,
+        int maxhd, const TrieCharClasses *classes, int *hd);
+
+/* Indexes of the halves of the keys of one length, see splitindex.c */
+
+struct SplitIndex {
+    size_t keylen;
+    size_t mid;                 /* length of the first half */
+    size_t num_keys;
+    const TrieItem **items;     /* item of each key */
+    struct TrieRoot *halves[2]; /* first and second halves of the keys */
+    size_t *chains[2];          /* per half, 1 + the next key sharing it */
+    struct SplitIndex *next;    /* index for another length */
+};
+
+SplitIndex *splitindex_new(const TrieRoot *root, size_t keylen);
+void splitindex_free(SplitIndex *si);
+size_t splitindex_mem_usage(const SplitIndex *si);
+void splitindex_find(const SplitIndex *si, const TRIECHAR *key, int maxhd,
+        const TrieCharClasses *classes, SplitMatches *found);
+
+/* Statistics of the keys used to plan searches, see planner.c */
+
+struct TrieStats {
+    size_t *num_keys;           /* number of keys of each length */
+    size_t size;                /* number of lengths in num_keys */
+    size_t num_chars[TRIE_NUM_CHARS]; /* occurrences of each character */
+};
+
+TrieStats *triestats_new(const TrieRoot *root);
+void triestats_free(TrieStats *stats);
+size_t triestats_mem_usage(const TrieStats *stats);
+void triestats_add(TrieStats *stats, const TrieItem *item);
+void triestats_remove(TrieStats *stats, const TrieItem *item);
+
+#endif /* defined TRIE_INTERNAL_H */
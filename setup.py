@@ -1,6 +1,6 @@
 from setuptools import setup
 from distutils.extension import Extension
-from os import path
+from os import path, environ
 from glob import glob
 
 here = path.abspath(path.dirname(__file__))
@@ -8,6 +8,12 @@ here = path.abspath(path.dirname(__file__))
 with open(path.join(here, "README.rst")) as f:
     long_description = f.read()
 
+# VTRIE_PREFETCH=0 disables software prefetching of nodes, 1 to 3 set the
+# locality hint of the prefetches (see trie_internal.h)
+define_macros = []
+if environ.get("VTRIE_PREFETCH"):
+    define_macros.append(("TRIE_PREFETCH", environ["VTRIE_PREFETCH"]))
+
 setup(
         name = "vtrie",
         version = "0.0.3",
@@ -40,6 +46,7 @@ setup(
             Extension("vtrie",
                 sources = glob("src/*.c"),
                 include_dirs = ["include"],
+                define_macros = define_macros,
                 language = "c",
                 extra_compile_args = ["-std=c99", "-pedantic", "-Wall", 
                     "-Wextra", "-O3"],
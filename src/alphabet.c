@@ -0,0 +1,114 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include "util.h"
+#include "alphabet.h"
+
+/* Number of slots of the hash table, twice the maximum size of the alphabet
+ * so probe sequences stay short */
+#define NUM_SLOTS 512
+
+struct TrieAlphabet {
+    /* open addressing hash table of code points, 0 marks an empty slot and
+     * other slots hold code point + 1 */
+    uint32_t slots[NUM_SLOTS];
+    TRIECHAR chars[NUM_SLOTS];              /* character of each slot */
+    uint32_t code_points[ALPHABET_MAX_SIZE + 1]; /* code point of chars */
+    size_t size;
+};
+
+TrieAlphabet *
+triealphabet_new(void)
+{
+    return safe_calloc(1, sizeof(TrieAlphabet));
+}
+
+void
+triealphabet_free(TrieAlphabet *alphabet)
+{
+    free(alphabet);
+}
+
+size_t
+triealphabet_size(const TrieAlphabet *alphabet)
+{
+    return alphabet->size;
+}
+
+size_t
+triealphabet_mem_usage(const TrieAlphabet *alphabet)
+{
+    return alphabet == NULL ? 0 : sizeof(*alphabet);
+}
+
+/* Returns the slot of code point cp, or the empty slot where it belongs. */
+static size_t
+triealphabet_slot(const TrieAlphabet *alphabet, uint32_t cp)
+{
+    size_t i = (cp * 2654435761u) % NUM_SLOTS;
+    while (alphabet->slots[i] != 0 && alphabet->slots[i] != cp + 1)
+        i = (i + 1) % NUM_SLOTS;
+    return i;
+}
+
+/*
+ * Encodes n code points into the characters s, which must have room for n
+ * characters.
+ *
+ * add: if true, code points that are not in the alphabet are added to it.
+ * Otherwise they are encoded as ALPHABET_UNKNOWN.
+ *
+ * @return: 0 on success, -1 if a code point could not be added because the
+ * alphabet is full. Code points added before that stay in the alphabet.
+ */
+int
+triealphabet_encode(TrieAlphabet *alphabet, const uint32_t *code_points,
+        size_t n, TRIECHAR *s, bool add)
+{
+    for (size_t i = 0; i < n; i++){
+        uint32_t cp = code_points[i];
+        size_t slot = triealphabet_slot(alphabet, cp);
+        if (alphabet->slots[slot] == 0){
+            if (!add){
+                s[i] = ALPHABET_UNKNOWN;
+                continue;
+            }
+            if (alphabet->size == ALPHABET_MAX_SIZE)
+                return -1;
+            alphabet->slots[slot] = cp + 1;
+            alphabet->chars[slot] = (TRIECHAR)alphabet->size;
+            alphabet->code_points[alphabet->size++] = cp;
+        }
+        s[i] = alphabet->chars[slot];
+    }
+    return 0;
+}
+
+/*
+ * Decodes n characters of s, produced by triealphabet_encode, into
+ * code_points.
+ */
+void
+triealphabet_decode(const TrieAlphabet *alphabet, const TRIECHAR *s,
+        size_t n, uint32_t *code_points)
+{
+    for (size_t i = 0; i < n; i++)
+        code_points[i] = alphabet->code_points[(unsigned char)s[i]];
+}
@@ -0,0 +1,403 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of neighbor query results.
+ *
+ * Results of trieiter_neighbors are kept per (key, maxhd, classes), as
+ * references to the items found, in a hash table with a least recently used
+ * list for eviction. Neighbors always have the same length as the query, so
+ * a key added to or removed from the trie only invalidates entries for
+ * queries of that length which are within maxhd of it; other entries stay
+ * valid.
+ *
+ * Entries are invalidated lazily, so changing the trie costs the same
+ * however many entries there are. For every key length, the cache counts
+ * the changes to keys of that length and logs the last TRIECACHE_LOG_SIZE
+ * changed keys. An entry records the count when it was stored, and when it
+ * is looked up, the keys changed since are compared with its query. If more
+ * keys changed than the log holds, the entry is dropped.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trie.h"
+#include "trie_internal.h"
+
+#define TRIECACHE_LOG_SIZE 32
+
+/* Keys of one length changed since the cache was made */
+struct TrieCacheLog {
+    uint64_t version;           /* number of keys changed */
+    TRIECHAR *keys;             /* the last TRIECACHE_LOG_SIZE of them, the
+                                   i-th change at i % TRIECACHE_LOG_SIZE */
+};
+
+struct TrieCache {
+    size_t capacity;            /* maximum number of entries */
+    size_t num_entries;
+    size_t num_buckets;         /* power of 2 */
+    TrieCacheEntry **buckets;
+    TrieCacheEntry *head;       /* most recently used */
+    TrieCacheEntry *tail;       /* least recently used */
+    struct TrieCacheLog *logs;  /* log of each key length */
+    size_t num_logs;
+    size_t hits;
+    size_t misses;
+    size_t memsize;
+};
+
+static uint64_t
+triecache_hash(const TRIECHAR *key, size_t keylen, int maxhd,
+        const TrieCharClasses *classes)
+{
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < keylen; i++){
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= (uint64_t)maxhd << 1 | (classes != NULL);
+    h *= 1099511628211ULL;
+    return h;
+}
+
+static bool
+triecache_entry_matches(const TrieCacheEntry *entry, uint64_t hash,
+        const TRIECHAR *key, size_t keylen, int maxhd,
+        const TrieCharClasses *classes)
+{
+    if (entry->hash != hash || entry->keylen != keylen ||
+            entry->maxhd != maxhd || memcmp(entry->key, key, keylen) != 0)
+        return false;
+    if (entry->classes == NULL || classes == NULL)
+        return entry->classes == classes;
+    return memcmp(entry->classes, classes, sizeof(*classes)) == 0;
+}
+
+static size_t
+triecache_entry_mem_usage(const TrieCacheEntry *entry)
+{
+    size_t size = sizeof(*entry) + entry->keylen + 1 +
+        entry->size * sizeof(*entry->results);
+    if (entry->classes != NULL)
+        size += sizeof(*entry->classes);
+    return size;
+}
+
+/*
+ * Creates an entry without results for a query, copying key and classes.
+ */
+TrieCacheEntry *
+triecacheentry_new(const TRIECHAR *key, size_t keylen, int maxhd,
+        const TrieCharClasses *classes)
+{
+    TrieCacheEntry *entry = safe_malloc(sizeof(*entry));
+    entry->key = safe_malloc(sizeof(*entry->key) * (keylen + 1));
+    memcpy(entry->key, key, keylen);
+    entry->key[keylen] = '\0';
+    entry->keylen = keylen;
+    entry->maxhd = maxhd;
+    entry->classes = triecharclasses_copy(classes);
+    entry->hash = triecache_hash(key, keylen, maxhd, classes);
+    entry->version = 0;
+    entry->results = NULL;
+    entry->num_results = 0;
+    entry->size = 0;
+    entry->prev = entry->next = entry->chain = NULL;
+    return entry;
+}
+
+void
+triecacheentry_free(TrieCacheEntry *entry)
+{
+    if (entry == NULL)
+        return;
+
+    free(entry->key);
+    triecharclasses_free(entry->classes);
+    free(entry->results);
+    free(entry);
+}
+
+void
+triecacheentry_add_result(TrieCacheEntry *entry, const TrieItem *item,
+        int hd)
+{
+    if (entry->num_results == entry->size){
+        entry->size = entry->size > 0 ? 2 * entry->size : 8;
+        entry->results = safe_realloc(entry->results,
+                entry->size * sizeof(*entry->results));
+    }
+    entry->results[entry->num_results].item = item;
+    entry->results[entry->num_results++].hd = hd;
+}
+
+TrieCache *
+triecache_new(size_t capacity)
+{
+    if (capacity == 0)
+        return NULL;
+
+    TrieCache *cache = safe_calloc(1, sizeof(*cache));
+    cache->capacity = capacity;
+    cache->num_buckets = 16;
+    while (cache->num_buckets < 2 * capacity)
+        cache->num_buckets *= 2;
+    cache->buckets = safe_calloc(cache->num_buckets,
+            sizeof(*cache->buckets));
+    cache->memsize = sizeof(*cache) +
+        cache->num_buckets * sizeof(*cache->buckets);
+    return cache;
+}
+
+/* Unlinks entry from its bucket and the LRU list, and frees it */
+static void
+triecache_remove(TrieCache *cache, TrieCacheEntry *entry)
+{
+    TrieCacheEntry **link = &cache->buckets[entry->hash &
+        (cache->num_buckets - 1)];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+
+    cache->num_entries--;
+    cache->memsize -= triecache_entry_mem_usage(entry);
+    triecacheentry_free(entry);
+}
+
+/* Moves entry to the front of the LRU list */
+static void
+triecache_use(TrieCache *cache, TrieCacheEntry *entry)
+{
+    if (cache->head == entry)
+        return;
+
+    entry->prev->next = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = cache->head;
+    cache->head->prev = entry;
+    cache->head = entry;
+}
+
+void
+triecache_clear(TrieCache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    while (cache->head != NULL)
+        triecache_remove(cache, cache->head);
+}
+
+void
+triecache_free(TrieCache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    triecache_clear(cache);
+    for (size_t i = 0; i < cache->num_logs; i++)
+        free(cache->logs[i].keys);
+    free(cache->logs);
+    free(cache->buckets);
+    free(cache);
+}
+
+/* Number of changes to keys of length keylen */
+static uint64_t
+triecache_version(const TrieCache *cache, size_t keylen)
+{
+    return keylen < cache->num_logs ? cache->logs[keylen].version : 0;
+}
+
+/*
+ * Checks that none of the keys changed since entry was stored is within
+ * maxhd of its query, and if so, marks the entry as up to date.
+ */
+static bool
+triecache_is_valid(const TrieCache *cache, TrieCacheEntry *entry)
+{
+    uint64_t version = triecache_version(cache, entry->keylen);
+    if (entry->version == version)
+        return true;
+    if (version - entry->version > TRIECACHE_LOG_SIZE || entry->keylen == 0)
+        return false;
+
+    const struct TrieCacheLog *log = &cache->logs[entry->keylen];
+    for (uint64_t v = entry->version; v < version; v++){
+        const TRIECHAR *key = log->keys + v % TRIECACHE_LOG_SIZE
+            * entry->keylen;
+        int hd = 0;
+        for (size_t i = 0; i < entry->keylen && hd <= entry->maxhd; i++)
+            hd += !triecharclasses_match(entry->classes, entry->key[i],
+                    key[i]);
+        if (hd <= entry->maxhd)
+            return false;
+    }
+    entry->version = version;
+    return true;
+}
+
+/*
+ * Looks up the results of a query, counting a hit or a miss.
+ *
+ * @return: the entry of the query, or NULL if it is not in the cache. The
+ * entry is owned by the cache and only valid until the cache is next
+ * modified.
+ */
+const TrieCacheEntry *
+triecache_get(TrieCache *cache, const TRIECHAR *key, size_t keylen,
+        int maxhd, const TrieCharClasses *classes)
+{
+    uint64_t hash = triecache_hash(key, keylen, maxhd, classes);
+    TrieCacheEntry *entry = cache->buckets[hash & (cache->num_buckets - 1)];
+    for (; entry != NULL; entry = entry->chain){
+        if (triecache_entry_matches(entry, hash, key, keylen, maxhd,
+                    classes)){
+            if (!triecache_is_valid(cache, entry)){
+                triecache_remove(cache, entry);
+                break;
+            }
+            cache->hits++;
+            triecache_use(cache, entry);
+            return entry;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+/*
+ * Adds entry to the cache, which takes ownership of it. An entry for the
+ * same query is replaced, and the least recently used entry is evicted if
+ * the cache is full.
+ */
+void
+triecache_put(TrieCache *cache, TrieCacheEntry *entry)
+{
+    TrieCacheEntry **bucket = &cache->buckets[entry->hash &
+        (cache->num_buckets - 1)];
+    for (TrieCacheEntry *old = *bucket; old != NULL; old = old->chain){
+        if (triecache_entry_matches(old, entry->hash, entry->key,
+                    entry->keylen, entry->maxhd, entry->classes)){
+            triecache_remove(cache, old);
+            break;
+        }
+    }
+    if (cache->num_entries == cache->capacity)
+        triecache_remove(cache, cache->tail);
+
+    /* the results were found without changes to the trie in between */
+    entry->version = triecache_version(cache, entry->keylen);
+    entry->chain = *bucket;
+    *bucket = entry;
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+    cache->head = entry;
+    cache->num_entries++;
+    cache->memsize += triecache_entry_mem_usage(entry);
+}
+
+/*
+ * Records that key was added to or removed from the trie, which invalidates
+ * the entries of queries of the same length that are within maxhd of key.
+ * The entries are checked when they are next looked up.
+ */
+void
+triecache_invalidate(TrieCache *cache, const TRIECHAR *key, size_t keylen)
+{
+    if (cache == NULL)
+        return;
+
+    if (keylen >= cache->num_logs){
+        size_t num_logs = 2 * keylen + 1;
+        cache->logs = safe_realloc(cache->logs,
+                sizeof(*cache->logs) * num_logs);
+        memset(cache->logs + cache->num_logs, 0,
+                sizeof(*cache->logs) * (num_logs - cache->num_logs));
+        cache->memsize += sizeof(*cache->logs)
+            * (num_logs - cache->num_logs);
+        cache->num_logs = num_logs;
+    }
+    struct TrieCacheLog *log = &cache->logs[keylen];
+    /* the empty key is within maxhd of any query of length 0, so only the
+     * version is counted for it */
+    if (keylen > 0){
+        if (log->keys == NULL){
+            log->keys = safe_malloc(sizeof(*log->keys) * TRIECACHE_LOG_SIZE
+                    * keylen);
+            cache->memsize += sizeof(*log->keys) * TRIECACHE_LOG_SIZE
+                * keylen;
+        }
+        memcpy(log->keys + log->version % TRIECACHE_LOG_SIZE * keylen, key,
+                keylen);
+    }
+    log->version++;
+}
+
+/*
+ * Fills in the statistics of the cache, first dropping the entries that
+ * were invalidated, so that they are not counted.
+ */
+void
+triecache_stats(TrieCache *cache, TrieCacheStats *stats)
+{
+    if (cache == NULL){
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    TrieCacheEntry *entry = cache->head;
+    while (entry != NULL){
+        TrieCacheEntry *next = entry->next;
+        if (!triecache_is_valid(cache, entry))
+            triecache_remove(cache, entry);
+        entry = next;
+    }
+    stats->capacity = cache->capacity;
+    stats->num_entries = cache->num_entries;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->memsize = cache->memsize;
+}
+
+size_t
+triecache_mem_usage(const TrieCache *cache)
+{
+    return cache == NULL ? 0 : cache->memsize;
+}
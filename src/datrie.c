@@ -0,0 +1,485 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Double-array representation of a trie.
+ *
+ * Every node of the trie is a state s in the arrays. The child of s reached by
+ * character ch is state t = base[s] + CODE(ch), which is valid only if
+ * check[t] == s. So each transition costs two array accesses instead of a
+ * scan through the list of siblings.
+ *
+ * The double-array is a read-only copy of a trie. It refers to the items of
+ * the trie, so it has to be discarded as soon as nodes are added to or
+ * removed from the trie.
+ *
+ * For scanning texts, the double-array can be extended with the failure and
+ * output links of an Aho-Corasick automaton.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trie.h"
+#include "trie_internal.h"
+
+/* Codes start at 1, so the root (state 0) can never be a child */
+#define CODE(ch) ((int32_t)(unsigned char)(ch) + 1)
+#define NUM_CODES 257
+
+#define STATE_FREE -1
+#define STATE_ROOT -2
+
+struct DoubleArray {
+    int32_t *base;
+    int32_t *check;
+    const TrieItem **items; /* item of each state, NULL if it has none */
+    size_t size;            /* number of allocated states */
+    size_t num_states;      /* highest used state + 1 */
+    /* Aho-Corasick links, NULL until built by datrie_build_links */
+    int32_t *fail;          /* state of the longest proper suffix in trie */
+    int32_t *output;        /* nearest state along fail links having an item,
+                               -1 if there is none */
+};
+
+/* Pair of a trie node and its state in the double-array */
+struct DoubleArrayTask {
+    const TrieNode *node;
+    int32_t state;
+};
+
+/* Number of failed attempts after which a free state is no longer used as a
+ * candidate for nodes with multiple children */
+#define MAX_TRIES 4
+
+/* Doubly linked list of states */
+struct StateList {
+    int32_t *next;
+    int32_t *prev;
+    int32_t first;          /* -1 if the list is empty */
+    int32_t last;
+};
+
+/*
+ * State of a double-array while it is being built. Free states are kept in
+ * linked lists, so searching for a base only visits free states.
+ */
+struct DoubleArrayBuilder {
+    DoubleArray *da;
+    struct StateList free;          /* all free states */
+    struct StateList candidates;    /* free states with less than MAX_TRIES */
+    unsigned char *tries;   /* failed attempts to fit codes at a free state */
+};
+
+static void
+statelist_resize(struct StateList *l, size_t size)
+{
+    l->next = safe_realloc(l->next, sizeof(*l->next) * size);
+    l->prev = safe_realloc(l->prev, sizeof(*l->prev) * size);
+}
+
+static void
+statelist_append(struct StateList *l, int32_t state)
+{
+    l->next[state] = -1;
+    l->prev[state] = l->last;
+    if (l->last < 0)
+        l->first = state;
+    else
+        l->next[l->last] = state;
+    l->last = state;
+}
+
+static void
+statelist_remove(struct StateList *l, int32_t state)
+{
+    int32_t next = l->next[state];
+    int32_t prev = l->prev[state];
+    if (prev < 0)
+        l->first = next;
+    else
+        l->next[prev] = next;
+    if (next < 0)
+        l->last = prev;
+    else
+        l->prev[next] = prev;
+}
+
+static void
+statelist_free(struct StateList *l)
+{
+    free(l->next);
+    free(l->prev);
+}
+
+static void
+datrie_builder_resize(struct DoubleArrayBuilder *b, size_t size)
+{
+    DoubleArray *da = b->da;
+    if (size <= da->size)
+        return;
+
+    size_t old_size = da->size;
+    size_t new_size = old_size > 0 ? old_size : 1;
+    while (new_size < size)
+        new_size *= 2;
+
+    da->base = safe_realloc(da->base, sizeof(*da->base) * new_size);
+    da->check = safe_realloc(da->check, sizeof(*da->check) * new_size);
+    da->items = safe_realloc(da->items, sizeof(*da->items) * new_size);
+    b->tries = safe_realloc(b->tries, sizeof(*b->tries) * new_size);
+    statelist_resize(&b->free, new_size);
+    statelist_resize(&b->candidates, new_size);
+
+    for (size_t i = old_size; i < new_size; i++){
+        da->base[i] = 0;
+        da->check[i] = STATE_FREE;
+        da->items[i] = NULL;
+        b->tries[i] = 0;
+        statelist_append(&b->free, (int32_t)i);
+        statelist_append(&b->candidates, (int32_t)i);
+    }
+    da->size = new_size;
+}
+
+/* Marks a free state as used, making it a child of parent. */
+static void
+datrie_builder_use(struct DoubleArrayBuilder *b, int32_t state,
+        int32_t parent)
+{
+    statelist_remove(&b->free, state);
+    if (b->tries[state] < MAX_TRIES)
+        statelist_remove(&b->candidates, state);
+
+    b->da->check[state] = parent;
+    if ((size_t)state + 1 > b->da->num_states)
+        b->da->num_states = state + 1;
+}
+
+/*
+ * Finds a base such that base + code is a free state for every code in
+ * codes, which must be sorted in ascending order.
+ *
+ * A single code fits at any free state. For multiple codes, free states that
+ * repeatedly failed to fit are dropped from the candidates, so the search
+ * does not keep scanning the densely packed start of the arrays.
+ */
+static int32_t
+datrie_find_base(struct DoubleArrayBuilder *b, const int32_t *codes,
+        int num_codes)
+{
+    struct StateList *l = num_codes > 1 ? &b->candidates : &b->free;
+    int32_t pos = l->first;
+    for (;;){
+        if (pos < 0){
+            /* none of the free states fit, so add more states */
+            pos = (int32_t)b->da->size;
+            datrie_builder_resize(b, b->da->size + 1);
+        }
+        int32_t next = l->next[pos];
+        if (pos >= codes[0]){
+            size_t base = pos - codes[0];
+            datrie_builder_resize(b, base + codes[num_codes - 1] + 1);
+            int i;
+            for (i = 1; i < num_codes; i++)
+                if (b->da->check[base + codes[i]] != STATE_FREE)
+                    break;
+            if (i == num_codes)
+                return (int32_t)base;
+        }
+        if (num_codes > 1 && ++b->tries[pos] == MAX_TRIES)
+            statelist_remove(&b->candidates, pos);
+        pos = next;
+    }
+}
+
+static int
+compare_codes(const void *a, const void *b)
+{
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+/*
+ * Creates a double-array containing all nodes of the trie.
+ */
+DoubleArray *
+datrie_new(const TrieRoot *root)
+{
+    if (root == NULL)
+        return NULL;
+
+    DoubleArray *da = safe_malloc(sizeof(*da));
+    da->base = NULL;
+    da->check = NULL;
+    da->items = NULL;
+    da->size = 0;
+    da->num_states = 1;
+    da->fail = NULL;
+    da->output = NULL;
+
+    struct DoubleArrayBuilder b = {da, {NULL, NULL, -1, -1},
+        {NULL, NULL, -1, -1}, NULL};
+    datrie_builder_resize(&b, root->num_nodes + 1);
+
+    /* Nodes are placed breadth-first. The queue never holds more than all
+     * nodes of the trie. */
+    struct DoubleArrayTask *queue = safe_malloc(
+            sizeof(*queue) * (root->num_nodes + 1));
+    size_t head = 0, tail = 0;
+    int32_t codes[NUM_CODES];
+
+    datrie_builder_use(&b, 0, STATE_ROOT);
+    queue[tail].node = (const TrieNode *)root;
+    queue[tail++].state = 0;
+
+    while (head < tail){
+        const TrieNode *node = queue[head].node;
+        int32_t state = queue[head++].state;
+
+        if (node->item.key != NULL)
+            da->items[state] = &node->item;
+
+        if (node->child == NULL)
+            continue;
+
+        int num_codes = 0;
+        for (const TrieNode *child = node->child; child != NULL;
+                child = child->sibling)
+            codes[num_codes++] = CODE(child->ch);
+        qsort(codes, num_codes, sizeof(*codes), compare_codes);
+
+        int32_t base = datrie_find_base(&b, codes, num_codes);
+        da->base[state] = base;
+
+        for (const TrieNode *child = node->child; child != NULL;
+                child = child->sibling){
+            int32_t t = base + CODE(child->ch);
+            datrie_builder_use(&b, t, state);
+            queue[tail].node = child;
+            queue[tail++].state = t;
+        }
+    }
+    free(queue);
+    statelist_free(&b.free);
+    statelist_free(&b.candidates);
+    free(b.tries);
+
+    /* Release the unused tail of the arrays */
+    da->size = da->num_states;
+    da->base = safe_realloc(da->base, sizeof(*da->base) * da->size);
+    da->check = safe_realloc(da->check, sizeof(*da->check) * da->size);
+    da->items = safe_realloc(da->items, sizeof(*da->items) * da->size);
+    return da;
+}
+
+void
+datrie_free(DoubleArray *da)
+{
+    if (da == NULL)
+        return;
+
+    free(da->base);
+    free(da->check);
+    free(da->items);
+    free(da->fail);
+    free(da->output);
+    free(da);
+}
+
+size_t
+datrie_mem_usage(const DoubleArray *da)
+{
+    if (da == NULL)
+        return 0;
+
+    size_t size = sizeof(*da) + da->size *
+        (sizeof(*da->base) + sizeof(*da->check) + sizeof(*da->items));
+    if (da->fail != NULL)
+        size += da->size * (sizeof(*da->fail) + sizeof(*da->output));
+    return size;
+}
+
+/* Returns the state reached by following ch from state, or -1 if none. */
+static inline int32_t
+datrie_next_state(const DoubleArray *da, int32_t state, TRIECHAR ch)
+{
+    size_t t = (size_t)da->base[state] + CODE(ch);
+    if (t >= da->size || da->check[t] != state)
+        return -1;
+    return (int32_t)t;
+}
+
+/* Returns the state corresponding to key, or -1 if there is none. */
+static int32_t
+datrie_get_state(const DoubleArray *da, const TRIECHAR *key, size_t keylen)
+{
+    int32_t state = 0;
+    for (size_t i = 0; state >= 0 && i < keylen; i++)
+        state = datrie_next_state(da, state, key[i]);
+    return state;
+}
+
+const TrieItem *
+datrie_get_item(const DoubleArray *da, const TRIECHAR *key, size_t keylen)
+{
+    int32_t state = datrie_get_state(da, key, keylen);
+    return state < 0 ? NULL : da->items[state];
+}
+
+bool
+datrie_has_node(const DoubleArray *da, const TRIECHAR *key, size_t keylen)
+{
+    return datrie_get_state(da, key, keylen) >= 0;
+}
+
+const TrieItem *
+datrie_longest_prefix(const DoubleArray *da, const TRIECHAR *key,
+        size_t keylen)
+{
+    int32_t state = 0;
+    const TrieItem *res = da->items[0];
+
+    for (size_t i = 0; i < keylen; i++){
+        state = datrie_next_state(da, state, key[i]);
+        if (state < 0)
+            break;
+        if (da->items[state] != NULL)
+            res = da->items[state];
+    }
+
+    return res;
+}
+
+size_t
+datrie_prefixes(const DoubleArray *da, const TRIECHAR *key, size_t keylen,
+        const TrieItem **items)
+{
+    int32_t state = 0;
+    size_t n = 0;
+    if (da->items[0] != NULL)
+        items[n++] = da->items[0];
+
+    for (size_t i = 0; i < keylen; i++){
+        state = datrie_next_state(da, state, key[i]);
+        if (state < 0)
+            break;
+        if (da->items[state] != NULL)
+            items[n++] = da->items[state];
+    }
+
+    return n;
+}
+
+/*
+ * Adds the failure and output links of an Aho-Corasick automaton to the
+ * double-array of the trie of root. The links are computed breadth-first, so
+ * the links of all shallower states are known when a state is visited.
+ * Building links of a double-array that already has them does nothing.
+ */
+void
+datrie_build_links(DoubleArray *da, const TrieRoot *root)
+{
+    if (da->fail != NULL)
+        return;
+
+    da->fail = safe_malloc(sizeof(*da->fail) * da->size);
+    da->output = safe_malloc(sizeof(*da->output) * da->size);
+
+    struct DoubleArrayTask *queue = safe_malloc(
+            sizeof(*queue) * (root->num_nodes + 1));
+    size_t head = 0, tail = 0;
+
+    da->fail[0] = 0;
+    da->output[0] = -1;
+    queue[tail].node = (const TrieNode *)root;
+    queue[tail++].state = 0;
+
+    while (head < tail){
+        const TrieNode *node = queue[head].node;
+        int32_t state = queue[head++].state;
+
+        for (const TrieNode *child = node->child; child != NULL;
+                child = child->sibling){
+            int32_t t = datrie_next_state(da, state, child->ch);
+            int32_t f = 0;
+            if (state != 0){
+                /* longest proper suffix of the parent that can be extended
+                 * by ch */
+                f = da->fail[state];
+                int32_t next;
+                while ((next = datrie_next_state(da, f, child->ch)) < 0 &&
+                        f != 0)
+                    f = da->fail[f];
+                f = next < 0 ? 0 : next;
+            }
+            da->fail[t] = f;
+            da->output[t] = f != 0 && da->items[f] != NULL ? f :
+                da->output[f];
+            queue[tail].node = child;
+            queue[tail++].state = t;
+        }
+    }
+    free(queue);
+}
+
+/*
+ * Scans text for occurrences of keys, calling handler for each of them in
+ * order of their end position (longest key first for equal end positions).
+ * The empty key occurs at every position from 0 to len. The links have to
+ * be built with datrie_build_links first.
+ *
+ * @return: 0 on success, or the first non-zero value returned by handler,
+ * which stops the scan.
+ */
+int
+datrie_scan(const DoubleArray *da, const TRIECHAR *text, size_t len,
+        TrieScanHandler handler, void *arg)
+{
+    const TrieItem *empty = da->items[0];
+    if (empty != NULL){
+        int retval = handler(0, 0, empty, arg);
+        if (retval != 0)
+            return retval;
+    }
+
+    int32_t state = 0;
+    for (size_t i = 0; i < len; i++){
+        int32_t next;
+        while ((next = datrie_next_state(da, state, text[i])) < 0 &&
+                state != 0)
+            state = da->fail[state];
+        state = next < 0 ? 0 : next;
+
+        int32_t match = da->items[state] != NULL ? state :
+            da->output[state];
+        for (; match > 0; match = da->output[match]){
+            const TrieItem *item = da->items[match];
+            int retval = handler(i + 1 - item->keylen, 0, item, arg);
+            if (retval != 0)
+                return retval;
+        }
+        if (empty != NULL){
+            int retval = handler(i + 1, 0, empty, arg);
+            if (retval != 0)
+                return retval;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Flat copy of all keys of one length, for brute-force scans.
+ *
+ * The keys are stored back to back in a single array, so comparing a query
+ * with every key runs through contiguous memory instead of chasing node
+ * pointers. Each key is padded with NUL characters to a multiple of
+ * FLATKEYS_BLOCK characters. Mismatches are counted a whole block at a time
+ * without branches, 8 characters at a time in 64-bit words, and the
+ * comparison with a key stops after the first block exceeding maxhd.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trie.h"
+#include "trie_internal.h"
+
+/* Number of characters compared between checks against maxhd */
+#define FLATKEYS_BLOCK 16
+
+static void
+flatkeys_add(FlatKeys *fk, const TrieNode *node, size_t depth,
+        size_t *num_keys)
+{
+    if (depth == 0){
+        if (node->item.key != NULL){
+            if (fk->keys != NULL){
+                memcpy(fk->keys + *num_keys * fk->stride, node->item.key,
+                        fk->keylen);
+                fk->items[*num_keys] = &node->item;
+            }
+            (*num_keys)++;
+        }
+        return;
+    }
+    for (node = node->child; node != NULL; node = node->sibling)
+        flatkeys_add(fk, node, depth - 1, num_keys);
+}
+
+/*
+ * Copies the keys of length keylen in the trie, in the order of a depth-first
+ * traversal of the trie.
+ */
+FlatKeys *
+flatkeys_new(const TrieRoot *root, size_t keylen)
+{
+    FlatKeys *fk = safe_malloc(sizeof(*fk));
+    fk->keylen = keylen;
+    fk->stride = (keylen + FLATKEYS_BLOCK - 1) / FLATKEYS_BLOCK
+        * FLATKEYS_BLOCK;
+    fk->keys = NULL;
+    fk->items = NULL;
+    fk->next = NULL;
+
+    /* count the keys first, then copy them */
+    size_t n = 0;
+    flatkeys_add(fk, (const TrieNode *)root, keylen, &n);
+    fk->num_keys = n;
+    fk->keys = safe_calloc(n * fk->stride + 1, sizeof(*fk->keys));
+    fk->items = safe_malloc(sizeof(*fk->items) * (n > 0 ? n : 1));
+    n = 0;
+    flatkeys_add(fk, (const TrieNode *)root, keylen, &n);
+    return fk;
+}
+
+/*
+ * Frees fk and the copies for other lengths linked to it.
+ */
+void
+flatkeys_free(FlatKeys *fk)
+{
+    while (fk != NULL){
+        FlatKeys *next = fk->next;
+        free(fk->keys);
+        free(fk->items);
+        free(fk);
+        fk = next;
+    }
+}
+
+/* Size of fk alone in memory in bytes */
+size_t
+flatkeys_mem_usage(const FlatKeys *fk)
+{
+    if (fk == NULL)
+        return 0;
+
+    return sizeof(*fk) + sizeof(*fk->keys) * (fk->num_keys * fk->stride + 1)
+        + sizeof(*fk->items) * (fk->num_keys > 0 ? fk->num_keys : 1);
+}
+
+#define BYTES_LOW_BITS 0x0101010101010101ULL
+
+/* Number of mismatches between two blocks */
+static inline int
+flatkeys_block_distance(const TRIECHAR *a, const TRIECHAR *b)
+{
+    int hd = 0;
+    for (int k = 0; k < FLATKEYS_BLOCK; k += 8){
+        uint64_t x, y;
+        memcpy(&x, a + k, 8);
+        memcpy(&y, b + k, 8);
+        /* fold the bits of each byte into its lowest bit, then add up the
+         * lowest bits of all bytes in the top byte */
+        x ^= y;
+        x |= x >> 4;
+        x |= x >> 2;
+        x |= x >> 1;
+        x &= BYTES_LOW_BITS;
+        hd += (x * BYTES_LOW_BITS) >> 56;
+    }
+    return hd;
+}
+
+/* Scan with character equivalences, which does not use blocks */
+static size_t
+flatkeys_find_classes(const FlatKeys *fk, size_t i, const TRIECHAR *key,
+        int maxhd, const TrieCharClasses *classes, int *hd)
+{
+    for (; i < fk->num_keys; i++){
+        const TRIECHAR *other = fk->keys + i * fk->stride;
+        int d = 0;
+        for (size_t j = 0; j < fk->keylen && d <= maxhd; j++)
+            d += !triecharclasses_match(classes, key[j], other[j]);
+        if (d <= maxhd){
+            *hd = d;
+            return i;
+        }
+    }
+    return fk->num_keys;
+}
+
+/*
+ * Finds the first key from the i-th key on within maxhd of key, which has
+ * the length of the keys of fk, and sets hd to its Hamming distance.
+ *
+ * @return: the index of the key found, or the number of keys if there is
+ * none.
+ */
+size_t
+flatkeys_find(const FlatKeys *fk, size_t i, const TRIECHAR *key, int maxhd,
+        const TrieCharClasses *classes, int *hd)
+{
+    if (classes != NULL)
+        return flatkeys_find_classes(fk, i, key, maxhd, classes, hd);
+
+    /* pad the last block of the query as the keys are */
+    size_t full = fk->keylen / FLATKEYS_BLOCK * FLATKEYS_BLOCK;
+    TRIECHAR tail[FLATKEYS_BLOCK] = {0};
+    memcpy(tail, key + full, fk->keylen - full);
+
+    for (; i < fk->num_keys; i++){
+        const TRIECHAR *other = fk->keys + i * fk->stride;
+        int d = 0;
+        size_t j = 0;
+        for (; j < full && d <= maxhd; j += FLATKEYS_BLOCK)
+            d += flatkeys_block_distance(key + j, other + j);
+        if (j < fk->stride && d <= maxhd)
+            d += flatkeys_block_distance(tail, other + j);
+        if (d <= maxhd){
+            *hd = d;
+            return i;
+        }
+    }
+    return fk->num_keys;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Masked key index for finding all pairs of keys at Hamming distance 1.
+ *
+ * Two keys of equal length are at distance 1 if they are equal once the
+ * single position where they differ is masked. So for every position, the
+ * keys are hashed with that position masked and sorted by that hash, after
+ * which the pairs at distance 1 differing at the position are found within
+ * groups of equal hashes. Each pair is found exactly once, for the position
+ * where its keys differ.
+ *
+ * The hash of a key is the sum of key[i] * B^i, so the hash with position p
+ * masked is the hash of the key minus key[p] * B^p, and each pass costs a
+ * subtraction per key plus the sort.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trie.h"
+#include "trie_internal.h"
+
+#define MASK_HASH_BASE 1099511628211ULL
+
+struct MaskEntry {
+    uint64_t masked;        /* hash of the key with pos masked */
+    uint64_t hash;          /* hash of the whole key */
+    const TrieItem *item;
+};
+
+struct MaskIndex {
+    struct MaskEntry *entries;
+    size_t num_entries;
+    size_t keylen;
+    uint64_t *powers;       /* B^i for every position i */
+    size_t pos;             /* masked position of the current pass */
+    size_t end;             /* end of the current group of equal hashes */
+    size_t i;               /* current pair is (i, j) within the group */
+    size_t j;
+};
+
+static size_t
+maskindex_count(const TrieNode *node, size_t depth)
+{
+    if (depth == 0)
+        return node->item.key != NULL;
+
+    size_t n = 0;
+    for (node = node->child; node != NULL; node = node->sibling)
+        n += maskindex_count(node, depth - 1);
+    return n;
+}
+
+static void
+maskindex_add(MaskIndex *mi, const TrieNode *node, size_t depth)
+{
+    if (depth == 0){
+        if (node->item.key != NULL){
+            uint64_t hash = 0;
+            for (size_t i = 0; i < mi->keylen; i++)
+                hash += (unsigned char)node->item.key[i] * mi->powers[i];
+            mi->entries[mi->num_entries].hash = hash;
+            mi->entries[mi->num_entries++].item = &node->item;
+        }
+        return;
+    }
+    for (node = node->child; node != NULL; node = node->sibling)
+        maskindex_add(mi, node, depth - 1);
+}
+
+static int
+compare_masked(const void *a, const void *b)
+{
+    uint64_t ha = ((const struct MaskEntry *)a)->masked;
+    uint64_t hb = ((const struct MaskEntry *)b)->masked;
+    return ha < hb ? -1 : ha > hb;
+}
+
+/* Starts the pass for the current position */
+static void
+maskindex_prepare(MaskIndex *mi)
+{
+    uint64_t power = mi->powers[mi->pos];
+    for (size_t k = 0; k < mi->num_entries; k++){
+        struct MaskEntry *e = &mi->entries[k];
+        e->masked = e->hash - (unsigned char)e->item->key[mi->pos] * power;
+    }
+    qsort(mi->entries, mi->num_entries, sizeof(*mi->entries),
+            compare_masked);
+    mi->end = mi->i = mi->j = 0;
+}
+
+/*
+ * Creates an index of the keys of length keylen in the trie.
+ */
+MaskIndex *
+maskindex_new(const TrieRoot *root, size_t keylen)
+{
+    MaskIndex *mi = safe_malloc(sizeof(*mi));
+    mi->keylen = keylen;
+    mi->powers = safe_malloc(sizeof(*mi->powers) * (keylen + 1));
+    mi->powers[0] = 1;
+    for (size_t i = 1; i <= keylen; i++)
+        mi->powers[i] = mi->powers[i - 1] * MASK_HASH_BASE;
+
+    size_t n = maskindex_count((const TrieNode *)root, keylen);
+    mi->entries = safe_malloc(sizeof(*mi->entries) * (n > 0 ? n : 1));
+    mi->num_entries = 0;
+    maskindex_add(mi, (const TrieNode *)root, keylen);
+
+    mi->pos = 0;
+    if (keylen > 0)
+        maskindex_prepare(mi);
+    return mi;
+}
+
+void
+maskindex_free(MaskIndex *mi)
+{
+    if (mi == NULL)
+        return;
+
+    free(mi->entries);
+    free(mi->powers);
+    free(mi);
+}
+
+/* True if the keys of a and b only differ at pos */
+static bool
+maskindex_verify(const MaskIndex *mi, const TrieItem *a, const TrieItem *b)
+{
+    size_t pos = mi->pos;
+    return memcmp(a->key, b->key, pos) == 0 &&
+        memcmp(a->key + pos + 1, b->key + pos + 1, mi->keylen - pos - 1) == 0;
+}
+
+/*
+ * Finds the next pair of keys at Hamming distance 1.
+ *
+ * @return: false once all pairs have been found.
+ */
+bool
+maskindex_next_pair(MaskIndex *mi, const TrieItem **a, const TrieItem **b)
+{
+    while (mi->pos < mi->keylen){
+        struct MaskEntry *entries = mi->entries;
+        while (mi->j < mi->end){
+            const TrieItem *x = entries[mi->i].item;
+            const TrieItem *y = entries[mi->j++].item;
+            if (maskindex_verify(mi, x, y)){
+                *a = x;
+                *b = y;
+                return true;
+            }
+        }
+        if (mi->i + 2 < mi->end){
+            mi->i++;
+            mi->j = mi->i + 1;
+            continue;
+        }
+
+        /* next group of equal hashes with at least two keys */
+        size_t start = mi->end;
+        while (start < mi->num_entries){
+            size_t end = start + 1;
+            while (end < mi->num_entries &&
+                    entries[end].masked == entries[start].masked)
+                end++;
+            if (end - start > 1){
+                mi->i = start;
+                mi->j = start + 1;
+                mi->end = end;
+                break;
+            }
+            start = end;
+        }
+        if (start < mi->num_entries)
+            continue;
+
+        if (++mi->pos < mi->keylen)
+            maskindex_prepare(mi);
+    }
+    return false;
+}
@@ -0,0 +1,413 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cost-based choice of the engine used to find neighbors and pairs.
+ *
+ * The costs are estimated from statistics of the keys in the trie: the
+ * number of keys of each length and the number of distinct characters. The
+ * statistics are gathered on first use and from then on kept up to date as
+ * keys are added and removed.
+ *
+ * Keys are modelled as random strings over the alphabet of the trie, so the
+ * number of nodes at depth d is the smaller of alphabet^d and the number of
+ * keys of at least d characters, and a node at depth d is within maxhd of a
+ * query with the probability that d characters have at most maxhd
+ * mismatches. The costs are in units of one character comparison of a
+ * scan; the weights below were measured on random DNA and text keys, and
+ * only need to be right to within a small factor.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trie.h"
+#include "trie_internal.h"
+
+#define PLAN_COST_NODE 48.0     /* child looked at by a trie search */
+#define PLAN_COST_KEY 4.0       /* key visited by a scan */
+#define PLAN_COST_CHAR 0.25     /* character compared by a scan */
+#define PLAN_COST_CLASS 2.0     /* same, with character equivalences */
+#define PLAN_COST_COPY 144.0    /* node visited to copy keys for a scan */
+#define PLAN_COST_SORT 30.0     /* key per halving step of a sort */
+#define PLAN_COST_INSERT 500.0  /* node created to index halves of keys */
+#define PLAN_COST_VERIFY 1.0    /* character compared one at a time */
+#define PLAN_COST_QUEUE 5.0     /* child queued by a breadth-first search */
+#define PLAN_COST_LEVEL 350.0   /* depth set up by a breadth-first search */
+#define PLAN_OVERLAP 0.6        /* share of a node hidden by prefetching */
+#define PLAN_CACHE_NODES 1e5    /* nodes that mostly stay in cache */
+#define PLAN_BLOCK 16           /* characters compared in one go by a scan */
+
+static void
+triestats_count(TrieStats *stats, const TrieNode *node)
+{
+    for (; node != NULL; node = node->sibling){
+        if (node->item.key != NULL)
+            triestats_add(stats, &node->item);
+        triestats_count(stats, node->child);
+    }
+}
+
+/*
+ * Gathers the statistics of the keys in the trie.
+ */
+TrieStats *
+triestats_new(const TrieRoot *root)
+{
+    TrieStats *stats = safe_calloc(1, sizeof(*stats));
+    if (root->item.key != NULL)
+        triestats_add(stats, &root->item);
+    triestats_count(stats, root->child);
+    return stats;
+}
+
+void
+triestats_free(TrieStats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    free(stats->num_keys);
+    free(stats);
+}
+
+size_t
+triestats_mem_usage(const TrieStats *stats)
+{
+    if (stats == NULL)
+        return 0;
+
+    return sizeof(*stats) + sizeof(*stats->num_keys) * stats->size;
+}
+
+void
+triestats_add(TrieStats *stats, const TrieItem *item)
+{
+    if (item->keylen >= stats->size){
+        size_t size = 2 * item->keylen + 1;
+        stats->num_keys = safe_realloc(stats->num_keys,
+                sizeof(*stats->num_keys) * size);
+        memset(stats->num_keys + stats->size, 0,
+                sizeof(*stats->num_keys) * (size - stats->size));
+        stats->size = size;
+    }
+    stats->num_keys[item->keylen]++;
+    for (size_t i = 0; i < item->keylen; i++)
+        stats->num_chars[(unsigned char)item->key[i]]++;
+}
+
+void
+triestats_remove(TrieStats *stats, const TrieItem *item)
+{
+    stats->num_keys[item->keylen]--;
+    for (size_t i = 0; i < item->keylen; i++)
+        stats->num_chars[(unsigned char)item->key[i]]--;
+}
+
+/* Returns the statistics of the trie, gathering them on first use */
+static const TrieStats *
+trie_stats(TrieRoot *root)
+{
+    if (root->stats == NULL)
+        root->stats = triestats_new(root);
+    return root->stats;
+}
+
+/* Common statistics used by the cost estimates */
+struct PlanInput {
+    const TrieStats *stats;
+    size_t keylen;
+    int maxhd;
+    double n;               /* keys of length keylen */
+    double sigma;           /* size of the alphabet */
+};
+
+static void
+plan_input_init(struct PlanInput *in, TrieRoot *root, size_t keylen,
+        int maxhd)
+{
+    in->stats = trie_stats(root);
+    in->keylen = keylen;
+    in->maxhd = maxhd;
+    in->n = keylen < in->stats->size ? in->stats->num_keys[keylen] : 0;
+    int sigma = 0;
+    for (int c = 0; c < TRIE_NUM_CHARS; c++)
+        sigma += in->stats->num_chars[c] > 0;
+    in->sigma = sigma > 1 ? sigma : 2;
+}
+
+/* Estimated number of nodes at each depth up to keylen, see the top */
+static void
+plan_nodes(const struct PlanInput *in, double *nodes)
+{
+    const TrieStats *stats = in->stats;
+    /* keys of at least d characters */
+    double longer = 0;
+    for (size_t l = in->keylen; l < stats->size; l++)
+        longer += stats->num_keys[l];
+
+    double power = 1;
+    nodes[in->keylen] = longer;
+    for (size_t d = in->keylen; d-- > 0;){
+        if (d < stats->size)
+            longer += stats->num_keys[d];
+        nodes[d] = longer;
+    }
+    for (size_t d = 0; d <= in->keylen; d++){
+        if (power < nodes[d])
+            nodes[d] = power;
+        power *= in->sigma;
+    }
+}
+
+/* Probability that len random characters have at most maxhd mismatches */
+static double
+plan_within(size_t len, int maxhd, double sigma)
+{
+    double *p = safe_calloc(maxhd + 1, sizeof(*p));
+    p[0] = 1;
+    double match = 1 / sigma;
+    for (size_t d = 0; d < len; d++)
+        for (int k = maxhd; k >= 0; k--)
+            p[k] = p[k] * match + (k > 0 ? p[k - 1] * (1 - match) : 0);
+    double within = 0;
+    for (int k = 0; k <= maxhd; k++)
+        within += p[k];
+    free(p);
+    return within;
+}
+
+/*
+ * Estimated cost of searching the trie for the neighbors of one key.
+ *
+ * At each depth, the children of the nodes still within maxhd are looked at,
+ * of which the expected fraction within maxhd is kept. If frontier is not
+ * NULL, it is set to the cost of the breadth-first search (the "frontier"
+ * engine), which looks at the same children but prefetches them for all
+ * states of a depth at once. That only pays off for the nodes that miss the
+ * cache, estimated from the size of the trie, and when there are other
+ * states to overlap with, while queueing the states and setting up each
+ * depth cost extra.
+ */
+static double
+plan_trie_search(const struct PlanInput *in, const double *nodes,
+        double *frontier)
+{
+    int maxhd = in->maxhd;
+    double *p = safe_calloc(maxhd + 1, sizeof(*p));
+    p[0] = 1;
+    double match = 1 / in->sigma;
+    double visited = 1;
+    double cost = 0;
+    double hidden = 0;
+    double size = 0;
+    for (size_t d = 0; d <= in->keylen; d++)
+        size += nodes[d];
+    double miss = size / (size + PLAN_CACHE_NODES);
+    for (size_t d = 1; d <= in->keylen && nodes[d - 1] > 0; d++){
+        double expanded = visited * nodes[d] / nodes[d - 1];
+        cost += expanded;
+        hidden += expanded * PLAN_OVERLAP * miss * (1 - 1 / visited);
+
+        /* p[k]: probability of k mismatches in the first d characters */
+        double within = 0;
+        for (int k = maxhd; k >= 0; k--){
+            p[k] = p[k] * match + (k > 0 ? p[k - 1] * (1 - match) : 0);
+            within += p[k];
+        }
+        visited = nodes[d] * within;
+        if (visited > expanded)
+            visited = expanded;
+        if (visited < 1)
+            visited = 1;   /* the path of the query itself */
+    }
+    free(p);
+    if (frontier != NULL)
+        *frontier = (cost - hidden) * PLAN_COST_NODE + cost * PLAN_COST_QUEUE
+            + (in->keylen + 1) * PLAN_COST_LEVEL;
+    return cost * PLAN_COST_NODE;
+}
+
+/* Estimated cost of comparing one key with all keys of its length */
+static double
+plan_scan(const struct PlanInput *in, const TrieCharClasses *classes)
+{
+    double chars = in->keylen;
+    double per_char = PLAN_COST_CLASS;
+    if (classes == NULL){
+        /* blocks compared until maxhd is exceeded by random keys */
+        double mismatch = 1 - 1 / in->sigma;
+        double blocks = (in->maxhd + 1) / mismatch / PLAN_BLOCK + 1;
+        if (blocks * PLAN_BLOCK < chars)
+            chars = (size_t)blocks * PLAN_BLOCK;
+        per_char = PLAN_COST_CHAR;
+    }
+    return in->n * (PLAN_COST_KEY + chars * per_char);
+}
+
+/* Estimated cost of making the flat copy of the keys for a scan */
+static double
+plan_flatkeys(TrieRoot *root, const struct PlanInput *in,
+        const double *nodes)
+{
+    for (const FlatKeys *fk = root->flat; fk != NULL; fk = fk->next)
+        if (fk->keylen == in->keylen)
+            return 0;
+
+    double cost = in->n * (PLAN_COST_KEY + in->keylen * PLAN_COST_CHAR);
+    for (size_t d = 1; d <= in->keylen; d++)
+        cost += nodes[d] * PLAN_COST_COPY;
+    return cost;
+}
+
+/*
+ * Estimated cost of finding the neighbors of one key through the split index
+ * (see splitindex.c), and of making the index if there is none for keylen.
+ * Each half is searched as a trie of its own holding the halves of all keys,
+ * after which the keys with a half within budget are compared in full.
+ */
+static double
+plan_split(TrieRoot *root, const struct PlanInput *in, double *build)
+{
+    size_t len[2] = {in->keylen / 2, in->keylen - in->keylen / 2};
+    int budget[2] = {in->maxhd / 2, in->maxhd - in->maxhd / 2 - 1};
+    double *nodes = safe_malloc(sizeof(*nodes) * (len[1] + 1));
+    double cost = 0;
+    *build = 0;
+    for (int h = 0; h < 2; h++){
+        double power = 1;
+        for (size_t d = 0; d <= len[h]; d++){
+            nodes[d] = power < in->n ? power : in->n;
+            power *= in->sigma;
+            *build += nodes[d] * PLAN_COST_INSERT;
+        }
+        *build += in->n * len[h] * PLAN_COST_NODE;
+        if (budget[h] < 0)
+            continue;
+
+        struct PlanInput half = *in;
+        half.keylen = len[h];
+        half.maxhd = budget[h];
+        double found = in->n * plan_within(len[h], budget[h], in->sigma);
+        cost += plan_trie_search(&half, nodes, NULL) + found * (PLAN_COST_KEY
+                + in->keylen * PLAN_COST_VERIFY);
+    }
+    free(nodes);
+
+    for (const SplitIndex *si = root->split; si != NULL; si = si->next)
+        if (si->keylen == in->keylen)
+            *build = 0;
+    return cost;
+}
+
+/*
+ * Sets plan->engine to the applicable engine with the lowest cost, other
+ * than skip (or TRIE_ENGINE_AUTO to skip none).
+ */
+static void
+plan_choose(TriePlan *plan, TrieEngine skip)
+{
+    plan->engine = TRIE_ENGINE_AUTO;
+    for (int e = 0; e < TRIE_NUM_ENGINES; e++){
+        if (e == (int)skip || plan->cost[e] < 0)
+            continue;
+        if (plan->engine == TRIE_ENGINE_AUTO
+                || plan->cost[e] < plan->cost[plan->engine])
+            plan->engine = e;
+    }
+}
+
+/*
+ * Estimates the costs of the engines for finding the neighbors of a key of
+ * length keylen, and picks the cheapest one. The costs of a scan and of the
+ * split index include making the flat copy or the index if there is none
+ * for keylen.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_plan_neighbors(TrieRoot *root, size_t keylen, int maxhd,
+        const TrieCharClasses *classes, TriePlan *plan)
+{
+    if (root == NULL || plan == NULL || maxhd < 1)
+        return -1;
+
+    struct PlanInput in;
+    plan_input_init(&in, root, keylen, maxhd);
+    double *nodes = safe_malloc(sizeof(*nodes) * (keylen + 1));
+    plan_nodes(&in, nodes);
+
+    plan->cost[TRIE_ENGINE_TRIE] = plan_trie_search(&in, nodes,
+            &plan->cost[TRIE_ENGINE_FRONTIER]);
+    plan->cost[TRIE_ENGINE_SCAN] = plan_scan(&in, classes)
+        + plan_flatkeys(root, &in, nodes);
+    plan->cost[TRIE_ENGINE_MASKED] = -1;
+    double build;
+    plan->cost[TRIE_ENGINE_SPLIT] = plan_split(root, &in, &build) + build;
+    plan->num_keys = in.n;
+    plan->alphabet = in.sigma;
+    plan_choose(plan, TRIE_ENGINE_AUTO);
+    free(nodes);
+    return 0;
+}
+
+/*
+ * Estimates the costs of the engines for finding all pairs of keys of length
+ * keylen, and picks the cheapest one. The trie search is never picked: it
+ * marks nodes in the trie, so only one can run at a time, and whether
+ * pairs() can be run concurrently should not depend on the estimates. In
+ * measurements it was at best 1.5 times as fast as the other engines.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_plan_pairs(TrieRoot *root, size_t keylen, int maxhd,
+        const TrieCharClasses *classes, TriePlan *plan)
+{
+    if (root == NULL || plan == NULL || maxhd < 1)
+        return -1;
+
+    struct PlanInput in;
+    plan_input_init(&in, root, keylen, maxhd);
+    double *nodes = safe_malloc(sizeof(*nodes) * (keylen + 1));
+    plan_nodes(&in, nodes);
+
+    /* every pair is found from one of its keys */
+    plan->cost[TRIE_ENGINE_TRIE] = in.n * plan_trie_search(&in, nodes, NULL)
+        / 2;
+    plan->cost[TRIE_ENGINE_SCAN] = in.n * plan_scan(&in, classes) / 2
+        + plan_flatkeys(root, &in, nodes);
+    plan->cost[TRIE_ENGINE_MASKED] = -1;
+    plan->cost[TRIE_ENGINE_FRONTIER] = -1;
+    double build;
+    plan->cost[TRIE_ENGINE_SPLIT] = in.n * plan_split(root, &in, &build)
+        + build;
+    if (maxhd == 1 && classes == NULL){
+        double steps = 1;
+        for (double n = in.n; n > 1; n /= 2)
+            steps++;
+        plan->cost[TRIE_ENGINE_MASKED] = keylen * in.n * steps
+            * PLAN_COST_SORT;
+    }
+    plan->num_keys = in.n;
+    plan->alphabet = in.sigma;
+    plan_choose(plan, TRIE_ENGINE_TRIE);
+    free(nodes);
+    return 0;
+}
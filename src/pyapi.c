@@ -19,6 +19,7 @@
 #include <Python.h>
 #include "structmember.h"
 #include "trie.h"
+#include "alphabet.h"
 
 #if PY_MAJOR_VERSION >= 3
 #define IS_PY3K
@@ -27,6 +28,7 @@
 #ifdef IS_PY3K
 #define PyString_Check PyBytes_Check
 #define PyString_AsString PyBytes_AsString
+#define PyString_AsStringAndSize PyBytes_AsStringAndSize
 #define PyString_FromString PyUnicode_FromString
 #define PyInt_FromLong PyLong_FromLong
 
@@ -194,11 +196,151 @@ static PyTypeObject PyTrieIterType = {
  * Trie type                                                                 *
  *****************************************************************************/
 
+/* Type of the keys of a trie. A trie stores either bytes keys (str in python
+ * 2), or unicode keys, which are encoded through an alphabet. */
+typedef enum {
+    KEYS_ANY = 0,   /* no keys inserted yet */
+    KEYS_BYTES,
+    KEYS_UNICODE
+} PyTrieKeyType;
+
 struct PyTrie{
     PyObject_HEAD
     TrieRoot *root;
+    PyTrieKeyType key_type;
+    TrieAlphabet *alphabet;     /* NULL unless key_type is KEYS_UNICODE */
 };
 
+/* Characters of a key as stored in the trie */
+typedef struct {
+    char *s;
+    size_t len;
+    PyObject *owner;            /* reference to the object holding s */
+} PyTrieKey;
+
+/*
+ * Gets the characters of a key as stored in the trie. Bytes keys (str in
+ * python 2) are stored as is and may contain any byte, including NUL. Unicode
+ * keys are stored with one character per code point.
+ *
+ * add: true if the key is going to be inserted. Otherwise code points that
+ * are not in the alphabet are encoded such that the key is not found.
+ *
+ * Returns 0 on success, -1 on error (with an exception set). On success, the
+ * key has to be released with _PyTrie_release_key.
+ */
+static int
+_PyTrie_parse_key(PyTrie *self, PyObject *key, PyTrieKey *k, bool add)
+{
+    Py_ssize_t n;
+    PyTrieKeyType key_type = PyUnicode_Check(key) ? KEYS_UNICODE :
+        KEYS_BYTES;
+
+    if (self->key_type != KEYS_ANY && self->key_type != key_type){
+        PyErr_SetString(PyExc_TypeError, key_type == KEYS_UNICODE ?
+                "trie has bytes keys, not str" :
+                "trie has str keys, not bytes");
+        return -1;
+    }
+
+    if (key_type == KEYS_BYTES){
+        if (PyString_AsStringAndSize(key, &k->s, &n) != 0)
+            return -1;
+        k->len = (size_t)n;
+        Py_INCREF(key);
+        k->owner = key;
+    }else{
+        /* UTF-32 is used to get the code points, as it is the one encoding
+         * of code points every python version handles the same */
+        PyObject *utf32 = PyUnicode_AsEncodedString(key, "utf-32-le",
+                "strict");
+        if (utf32 == NULL)
+            return -1;
+        const unsigned char *b =
+            (const unsigned char *)PyBytes_AS_STRING(utf32);
+        n = PyBytes_GET_SIZE(utf32) / 4;
+        uint32_t *code_points = PyMem_Malloc(sizeof(*code_points) *
+                (n > 0 ? n : 1));
+        k->owner = PyBytes_FromStringAndSize(NULL, n);
+        if (code_points == NULL || k->owner == NULL){
+            PyMem_Free(code_points);
+            Py_DECREF(utf32);
+            Py_XDECREF(k->owner);
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (Py_ssize_t i = 0; i < n; i++)
+            code_points[i] = (uint32_t)b[4*i] | (uint32_t)b[4*i + 1] << 8 |
+                (uint32_t)b[4*i + 2] << 16 | (uint32_t)b[4*i + 3] << 24;
+        Py_DECREF(utf32);
+
+        if (self->alphabet == NULL)
+            self->alphabet = triealphabet_new();
+        k->s = PyBytes_AS_STRING(k->owner);
+        k->len = (size_t)n;
+        int status = triealphabet_encode(self->alphabet, code_points, n,
+                k->s, add);
+        PyMem_Free(code_points);
+        if (status != 0){
+            Py_DECREF(k->owner);
+            PyErr_Format(PyExc_ValueError,
+                    "keys have more than %d distinct characters",
+                    ALPHABET_MAX_SIZE);
+            return -1;
+        }
+    }
+
+    if (add)
+        self->key_type = key_type;
+    return 0;
+}
+
+static void
+_PyTrie_release_key(PyTrieKey *k)
+{
+    Py_CLEAR(k->owner);
+}
+
+/*
+ * Creates the python object for a key stored in the trie. Unicode keys are
+ * decoded through the alphabet of the trie. In python 3, bytes keys are
+ * returned as str, with any bytes that are not valid UTF-8 escaped as lone
+ * surrogates, so key.encode('utf-8', 'surrogateescape') gives back the
+ * original bytes.
+ */
+static PyObject *
+_PyTrie_key_object(const PyTrie *self, const char *s, size_t len)
+{
+    if (self->key_type == KEYS_UNICODE){
+        uint32_t *code_points = PyMem_Malloc(sizeof(*code_points) *
+                (len > 0 ? len : 1));
+        unsigned char *b = PyMem_Malloc(4 * (len > 0 ? len : 1));
+        if (code_points == NULL || b == NULL){
+            PyMem_Free(code_points);
+            PyMem_Free(b);
+            return PyErr_NoMemory();
+        }
+        triealphabet_decode(self->alphabet, s, len, code_points);
+        for (size_t i = 0; i < len; i++){
+            b[4*i] = code_points[i] & 0xff;
+            b[4*i + 1] = (code_points[i] >> 8) & 0xff;
+            b[4*i + 2] = (code_points[i] >> 16) & 0xff;
+            b[4*i + 3] = (code_points[i] >> 24) & 0xff;
+        }
+        int byteorder = -1;     /* little endian */
+        PyObject *key = PyUnicode_DecodeUTF32((const char *)b,
+                (Py_ssize_t)(4 * len), NULL, &byteorder);
+        PyMem_Free(code_points);
+        PyMem_Free(b);
+        return key;
+    }
+#ifdef IS_PY3K
+    return PyUnicode_DecodeUTF8(s, (Py_ssize_t)len, "surrogateescape");
+#else
+    return PyString_FromStringAndSize(s, (Py_ssize_t)len);
+#endif
+}
+
 static PyObject *
 PyTrie_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
@@ -210,8 +352,11 @@ PyTrie_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
         /* the PyType_GenericAlloc already turns on GC tracking, so no need to
          * call PyObject_GC_Track */
         self = (PyTrie *)type->tp_alloc(type, 0);
-        if (self != NULL)
+        if (self != NULL){
             self->root = trie_new();
+            self->key_type = KEYS_ANY;
+            self->alphabet = NULL;
+        }
     }
 
     return (PyObject *)self;
@@ -220,11 +365,31 @@ PyTrie_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 static int
 PyTrie_init(PyTrie *self, PyObject *args, PyObject *kwds)
 {
-    (void)kwds;
     PyObject *other = NULL;
+    PyObject *reverse_index = NULL;
+    Py_ssize_t cache_size = 0;
+    static char *kwlist[] = {"items", "reverse_index", "cache_size", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOn:Trie", kwlist, &other,
+                &reverse_index, &cache_size))
+        return -1;
 
-    if (!PyArg_UnpackTuple(args, "Trie", 0, 1, &other))
+    if (cache_size < 0){
+        PyErr_SetString(PyExc_ValueError, "cache_size < 0");
         return -1;
+    }
+    trie_set_cache_size(self->root, (size_t)cache_size);
+
+    if (reverse_index != NULL){
+        int enable = PyObject_IsTrue(reverse_index);
+        if (enable < 0)
+            return -1;
+        if (enable && trie_enable_reverse(self->root) != 0){
+            PyErr_SetString(PyExc_RuntimeError,
+                    "Unable to create reverse index");
+            return -1;
+        }
+    }
 
     if (other != NULL){
         if (PyTuple_Check(other) != 0){
@@ -235,11 +400,12 @@ PyTrie_init(PyTrie *self, PyObject *args, PyObject *kwds)
                     return -1;
                 PyObject *key = PyTuple_GET_ITEM(item, 0);
                 PyObject *value = PyTuple_GET_ITEM(item, 1);
-                const char *s = PyString_AsString(key);
-                if (PyErr_Occurred() != NULL)
+                PyTrieKey k;
+                if (_PyTrie_parse_key(self, key, &k, true) != 0)
                     return -1;
                 Py_INCREF(value);
-                trie_set_item(self->root, s, value, Py_dealloc);
+                trie_set_item(self->root, k.s, k.len, value, Py_dealloc);
+                _PyTrie_release_key(&k);
             }
         }
     }
@@ -250,7 +416,7 @@ PyTrie_init(PyTrie *self, PyObject *args, PyObject *kwds)
 static int
 PyTrie_traverse(PyTrie *self, visitproc visit, void *arg)
 {
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
     TrieSearchResult *sr = NULL;
     while((sr = trieiter_next(it)) != NULL){
         if (sr != NULL && sr->target != NULL)
@@ -265,6 +431,8 @@ PyTrie_clear(PyTrie *self)
 {
     trie_free(self->root, Py_dealloc);
     self->root = NULL;
+    triealphabet_free(self->alphabet);
+    self->alphabet = NULL;
     return 0;
 }
 
@@ -280,11 +448,16 @@ PyTrie_dealloc(PyTrie *self)
 int
 PyTrie_sq_contains(PyTrie *self, PyObject *key)
 {
-    if (!PyString_Check(key)){
+    PyTrieKey k;
+    if (!PyString_Check(key) && !PyUnicode_Check(key)){
         PyErr_SetString(PyExc_TypeError, "key is not a string");
         return -1;
     }
-    if (trie_has_key(self->root, PyString_AsString(key)))
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return -1;
+    bool found = trie_has_key(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
+    if (found)
         return 1;
     else
         return 0;
@@ -293,11 +466,16 @@ PyTrie_sq_contains(PyTrie *self, PyObject *key)
 static PyObject *
 PyTrie_contains(PyTrie *self, PyObject *key)
 {
-    if (!PyString_Check(key)){
+    PyTrieKey k;
+    if (!PyString_Check(key) && !PyUnicode_Check(key)){
         PyErr_SetString(PyExc_TypeError, "key is not a string");
         return NULL;
     }
-    if (trie_has_key(self->root, PyString_AsString(key)))
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return NULL;
+    bool found = trie_has_key(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
+    if (found)
         Py_RETURN_TRUE;
     else
         Py_RETURN_FALSE;
@@ -313,11 +491,12 @@ PyTrie_get(PyTrie *self, PyObject *args)
     if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &failobj))
         return NULL;
 
-    char *s = PyString_AsString(key);
-    if (PyErr_Occurred() != NULL)
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
         return NULL;
 
-    const TrieItem *item = trie_get_item(self->root, s);
+    const TrieItem *item = trie_get_item(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
 
     if (item == NULL || item->value == NULL)
         val = failobj;
@@ -338,20 +517,21 @@ PyTrie_setdefault(PyTrie *self, PyObject *args)
     if (!PyArg_UnpackTuple(args, "setdefault", 1, 2, &key, &failobj))
         return NULL;
 
-    char *s = PyString_AsString(key);
-    if (PyErr_Occurred() != NULL)
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, true) != 0)
         return NULL;
 
-    const TrieItem *item = trie_get_item(self->root, s);
+    const TrieItem *item = trie_get_item(self->root, k.s, k.len);
 
     if (item == NULL || item->key == NULL){
         /* Adding failobj to the trie, so take ownership of a reference */
         Py_INCREF(failobj);
-        trie_set_item(self->root, s, failobj, Py_dealloc);
+        trie_set_item(self->root, k.s, k.len, failobj, Py_dealloc);
         val = failobj;
     }else{
         val = item->value;
     }
+    _PyTrie_release_key(&k);
     Py_INCREF(val);
     return val;
 }
@@ -373,11 +553,12 @@ PyTrie_pop(PyTrie *self, PyObject *args)
         PyErr_SetString(PyExc_KeyError, "pop(): trie is empty");
         return NULL;
     }
-    const char *s = PyString_AsString(key);
-    if (PyErr_Occurred() != NULL)
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
         return NULL;
 
-    const TrieItem *item = trie_get_item(self->root, s);
+    const TrieItem *item = trie_get_item(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
     if (item == NULL){
         if (deflt){
             Py_INCREF(deflt);
@@ -389,7 +570,7 @@ PyTrie_pop(PyTrie *self, PyObject *args)
     old_value = item->value;
     /* Do not pass Py_dealloc to the trie_del_item function here, so that
      * the reference owned by PyTrie is passed to the caller of pop(). */
-    if (trie_del_item(self->root, s, NULL) != 0){
+    if (trie_del_item(self->root, item->key, item->keylen, NULL) != 0){
         PyErr_SetString(PyExc_RuntimeError, "Unable to delete item");
         return NULL;
     }
@@ -404,7 +585,7 @@ PyTrie_popitem(PyTrie *self)
         return NULL;
     }
 
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
     if (it == NULL){
         PyErr_SetString(PyExc_RuntimeError, "Failed to create iterator");
         return NULL;
@@ -420,11 +601,13 @@ PyTrie_popitem(PyTrie *self)
         return NULL;
     }
 
-    PyObject *key = PyString_FromString(sr->target->key);
+    PyObject *key = _PyTrie_key_object(self, sr->target->key,
+            sr->target->keylen);
     PyObject *value = sr->target->value;
     /* Do not pass Py_dealloc to the trie_del_item function here, so that
      * the reference owned by PyTrie is passed to the caller of popitem(). */
-    if (trie_del_item(self->root, sr->target->key, NULL) != 0){
+    if (trie_del_item(self->root, sr->target->key, sr->target->keylen,
+                NULL) != 0){
         PyErr_SetString(PyExc_RuntimeError, "Unable to delete item");
         free(sr);
         return NULL;
@@ -440,7 +623,7 @@ PyTrie_keys(PyTrie *self)
     PyObject *result = PyList_New(n);
     if (result == NULL)
         return NULL;
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
     if (it == NULL)
         return NULL;
     TrieSearchResult *sr = NULL;
@@ -448,7 +631,8 @@ PyTrie_keys(PyTrie *self)
         sr = trieiter_next(it);
         if (Py_check_trieiter(it) != 0)
             return NULL;
-        PyObject *key = PyString_FromString(sr->target->key);
+        PyObject *key = _PyTrie_key_object(self, sr->target->key,
+                sr->target->keylen);
         PyList_SET_ITEM(result, i, key);
     }
     return result;
@@ -461,7 +645,7 @@ PyTrie_items(PyTrie *self)
     PyObject *result = PyList_New(n);
     if (result == NULL)
         return NULL;
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
     if (it == NULL)
         return NULL;
     TrieSearchResult *sr = NULL;
@@ -469,7 +653,8 @@ PyTrie_items(PyTrie *self)
         sr = trieiter_next(it);
         if (Py_check_trieiter(it) != 0)
             return NULL;
-        PyObject *key = PyString_FromString(sr->target->key);
+        PyObject *key = _PyTrie_key_object(self, sr->target->key,
+                sr->target->keylen);
         PyObject *value = sr->target->value;
         Py_INCREF(value);
         PyList_SET_ITEM(result, i, PyTuple_Pack(2, key, value));
@@ -484,7 +669,7 @@ PyTrie_values(PyTrie *self)
     PyObject *result = PyList_New(n);
     if (result == NULL)
         return NULL;
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
     if (it == NULL)
         return NULL;
     TrieSearchResult *sr = NULL;
@@ -506,7 +691,8 @@ _PyTrieIter_keys_next(PyTrieIter *py_it)
     if (result == NULL)
         return NULL;
 
-    PyObject *result_pyobj = PyString_FromString(result->target->key);
+    PyObject *result_pyobj = _PyTrie_key_object(py_it->trie,
+            result->target->key, result->target->keylen);
     free(result);
     return(result_pyobj);
 }
@@ -514,7 +700,7 @@ _PyTrieIter_keys_next(PyTrieIter *py_it)
 static PyObject *
 PyTrie_iterkeys(PyTrie *self)
 {
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
 
     if (it == NULL){
         PyErr_SetString(PyExc_Exception, "Unable to get iterator");
@@ -539,7 +725,7 @@ _PyTrieIter_values_next(PyTrieIter *py_it)
 static PyObject *
 PyTrie_itervalues(PyTrie *self)
 {
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
 
     if (it == NULL){
         PyErr_SetString(PyExc_Exception, "Unable to get iterator");
@@ -556,7 +742,8 @@ _PyTrie_items_next(PyTrieIter *py_it)
     if (result == NULL)
         return NULL;
 
-    PyObject *key = PyString_FromString(result->target->key);
+    PyObject *key = _PyTrie_key_object(py_it->trie, result->target->key,
+            result->target->keylen);
     PyObject *value = result->target->value;
     Py_INCREF(value);
     return PyTuple_Pack(2, key, value);
@@ -565,7 +752,7 @@ _PyTrie_items_next(PyTrieIter *py_it)
 static PyObject *
 PyTrie_iteritems(PyTrie *self)
 {
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
 
     if (it == NULL){
         PyErr_SetString(PyExc_Exception, "Unable to get iterator");
@@ -581,6 +768,41 @@ PyTrie_num_nodes(PyTrie *self)
     return PyInt_FromLong(trie_num_nodes(self->root));
 }
 
+static PyObject *
+PyTrie_compile(PyTrie *self)
+{
+    if (trie_compile(self->root) != 0){
+        PyErr_SetString(PyExc_RuntimeError, "Unable to compile trie");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+PyTrie_is_compiled(PyTrie *self)
+{
+    if (trie_is_compiled(self->root))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+PyTrie_relayout(PyTrie *self)
+{
+    if (trie_relayout(self->root) != 0){
+        PyErr_SetString(PyExc_RuntimeError, "Unable to relayout trie");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+PyTrie_compact(PyTrie *self)
+{
+    return PyLong_FromSize_t(trie_compact(self->root));
+}
+
 static PyObject *
 PyTrie_has_node(PyTrie *self, PyObject *args)
 {
@@ -589,142 +811,785 @@ PyTrie_has_node(PyTrie *self, PyObject *args)
     if (!PyArg_UnpackTuple(args, "has_node", 1, 1, &key))
        return NULL;
 
-    const char *s = PyString_AsString(key);
-    if (PyErr_Occurred() != NULL)
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
         return NULL;
 
-    if (trie_has_node(self->root, s))
+    bool found = trie_has_node(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
+    if (found)
         Py_RETURN_TRUE;
     else
         Py_RETURN_FALSE;
 }
 
+static PyObject *
+PyTrie_delete_prefix(PyTrie *self, PyObject *args)
+{
+    PyObject *key = NULL;
+
+    if (!PyArg_UnpackTuple(args, "delete_prefix", 1, 1, &key))
+        return NULL;
+
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return NULL;
+
+    size_t num_removed = trie_del_prefix(self->root, k.s, k.len, Py_dealloc);
+    _PyTrie_release_key(&k);
+    return PyLong_FromSize_t(num_removed);
+}
+
+/* Threshold used by the native fast path of retain() */
+struct RetainMinValue {
+    PyObject *min_value;
+    bool is_integer;        /* min_value is an integer fitting a long long */
+    bool is_float;          /* min_value is a float */
+    long long integer;
+    double real;
+};
+
+/*
+ * Returns 1 if item->value >= min_value, 0 if not, and -1 on error. Integers
+ * and floats are compared natively, other objects with the '<' operator.
+ */
+static int
+_PyTrie_retain_min_value(const TrieItem *item, void *arg)
+{
+    struct RetainMinValue *r = (struct RetainMinValue *)arg;
+    PyObject *value = (PyObject *)item->value;
+
+    if (r->is_integer && PyLong_CheckExact(value)){
+        int overflow;
+        long long x = PyLong_AsLongLongAndOverflow(value, &overflow);
+        if (overflow == 0)
+            return x >= r->integer;
+        PyErr_Clear();
+    }
+#ifndef IS_PY3K
+    if (r->is_integer && PyInt_CheckExact(value))
+        return PyInt_AS_LONG(value) >= r->integer;
+#endif
+    if (r->is_float && PyFloat_CheckExact(value))
+        return PyFloat_AS_DOUBLE(value) >= r->real;
+
+    int is_less = PyObject_RichCompareBool(value, r->min_value, Py_LT);
+    if (is_less < 0)
+        return -1;
+    return !is_less;
+}
+
+/* Predicate used by retain(pred) */
+struct RetainPred {
+    PyTrie *trie;
+    PyObject *pred;
+};
+
+/* Returns 1 if pred(key, value) is true, 0 if not, and -1 on error. */
+static int
+_PyTrie_retain_pred(const TrieItem *item, void *arg)
+{
+    struct RetainPred *r = (struct RetainPred *)arg;
+    PyObject *key = _PyTrie_key_object(r->trie, item->key, item->keylen);
+    if (key == NULL)
+        return -1;
+    PyObject *result = PyObject_CallFunctionObjArgs(r->pred, key,
+            (PyObject *)item->value, NULL);
+    Py_DECREF(key);
+    if (result == NULL)
+        return -1;
+    int keep = PyObject_IsTrue(result);
+    Py_DECREF(result);
+    return keep;
+}
+
+static PyObject *
+PyTrie_retain(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *pred = Py_None;
+    PyObject *min_value = Py_None;
+    static char *kwlist[] = {"pred", "min_value", NULL};
+    size_t num_removed = 0;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &pred,
+                &min_value))
+        return NULL;
+
+    if ((pred == Py_None) == (min_value == Py_None)){
+        PyErr_SetString(PyExc_TypeError,
+                "retain() takes either pred or min_value");
+        return NULL;
+    }
+
+    if (pred != Py_None){
+        if (!PyCallable_Check(pred)){
+            PyErr_SetString(PyExc_TypeError, "pred is not callable");
+            return NULL;
+        }
+        struct RetainPred r = {self, pred};
+        status = trie_retain(self->root, _PyTrie_retain_pred, &r,
+                Py_dealloc, &num_removed);
+    }else{
+        struct RetainMinValue r = {min_value, false, false, 0, 0.0};
+        if (PyLong_CheckExact(min_value)){
+            int overflow;
+            r.integer = PyLong_AsLongLongAndOverflow(min_value, &overflow);
+            r.is_integer = overflow == 0 && !PyErr_Occurred();
+            PyErr_Clear();
+        }
+#ifndef IS_PY3K
+        else if (PyInt_CheckExact(min_value)){
+            r.integer = PyInt_AS_LONG(min_value);
+            r.is_integer = true;
+        }
+#endif
+        else if (PyFloat_CheckExact(min_value)){
+            r.real = PyFloat_AS_DOUBLE(min_value);
+            r.is_float = true;
+        }
+        status = trie_retain(self->root, _PyTrie_retain_min_value, &r,
+                Py_dealloc, &num_removed);
+    }
+
+    if (status != 0){
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError,
+                    "Trie structure modified during retain()");
+        return NULL;
+    }
+    return PyLong_FromSize_t(num_removed);
+}
+
 static PyObject *
 PyTrie_longest_prefix(PyTrie *self, PyObject *args, PyObject *kwds)
 {
-    const char *key;
+    PyObject *key;
+    PyTrieKey k;
     static char *kwlist[] = {"key", NULL};
 
-#ifdef IS_PY3K
-    const char format[] = "y";
-#else
-    const char format[] = "s";
-#endif
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &key))
+        return NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, format, kwlist, &key))
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
         return NULL;
 
-    const TrieItem *item = trie_longest_prefix(self->root, key);
+    const TrieItem *item = trie_longest_prefix(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
 
     if (item == NULL){
         Py_RETURN_NONE;
     }else{
-        PyObject *key = PyString_FromString(item->key);
+        PyObject *key = _PyTrie_key_object(self, item->key, item->keylen);
         PyObject *value = item->value;
         Py_INCREF(value);
         return PyTuple_Pack(2, key, value);
     }
 }
 
-static Py_ssize_t
-PyTrie_length(PyTrie *self)
+/* Sets an error and returns -1 if the trie has no reverse index */
+static int
+_PyTrie_check_reverse(PyTrie *self)
 {
-    return trie_num_items(self->root);
+    if (trie_has_reverse(self->root))
+        return 0;
+    PyErr_SetString(PyExc_ValueError,
+            "trie has no reverse index, see Trie(reverse_index=True)");
+    return -1;
 }
 
 static PyObject *
-PyTrie_sizeof(PyTrie *self)
+PyTrie_longest_suffix(PyTrie *self, PyObject *args, PyObject *kwds)
 {
-    return PyInt_FromLong(trie_mem_usage(self->root));
+    PyObject *key;
+    PyTrieKey k;
+    static char *kwlist[] = {"key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &key))
+        return NULL;
+
+    if (_PyTrie_check_reverse(self) != 0)
+        return NULL;
+
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return NULL;
+
+    const TrieItem *item = trie_longest_suffix(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
+
+    if (item == NULL)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(NO)",
+            _PyTrie_key_object(self, item->key, item->keylen),
+            (PyObject *)item->value);
 }
 
-/* GetItem function */
+static TrieCharClasses *_PyTrie_charclasses(PyTrie *self, PyObject *equiv);
+
 static PyObject *
-PyTrie_subscript(PyTrie *self, PyObject *key)
+PyTrie_longest_prefix_approx(PyTrie *self, PyObject *args, PyObject *kwds)
 {
-    const char *s = PyString_AsString(key);
-    if (PyErr_Occurred() != NULL)
+    PyObject *key;
+    PyTrieKey k;
+    int maxhd;
+    int hd;
+    PyObject *equiv = NULL;
+    static char *kwlist[] = {"key", "maxhd", "equiv", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oi|O", kwlist, &key,
+                &maxhd, &equiv))
         return NULL;
 
-    const TrieItem *item = trie_get_item(self->root, s);
+    if (maxhd < 0){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 0");
+        return NULL;
+    }
 
-    if (item == NULL){
-        PyErr_SetObject(PyExc_KeyError, key);
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    if (_PyTrie_parse_key(self, key, &k, false) != 0){
+        triecharclasses_free(classes);
         return NULL;
     }
 
-    Py_INCREF(item->value);
-    return item->value;
+    const TrieItem *item = trie_longest_prefix_approx(self->root, k.s, k.len,
+            maxhd, classes, &hd);
+    _PyTrie_release_key(&k);
+    triecharclasses_free(classes);
+
+    if (item == NULL)
+        Py_RETURN_NONE;
+
+    return Py_BuildValue("(iNO)", hd,
+            _PyTrie_key_object(self, item->key, item->keylen),
+            (PyObject *)item->value);
 }
 
-/* SetItem and DelItem functions.
- * Return 0 on success and -1 on error. */
-static int 
-PyTrie_ass_subscript(PyTrie *self, PyObject *key, PyObject *value)
+/*
+ * Returns a list of (key, value) pairs of all keys that are a prefix of key,
+ * or NULL on error. items is a buffer of *size items, which is enlarged when
+ * needed, so it can be reused for many keys.
+ */
+static PyObject *
+_PyTrie_prefixes(PyTrie *self, PyObject *key, const TrieItem ***items,
+        size_t *size)
 {
-    const char *s = PyString_AsString(key);
-    if (PyErr_Occurred() != NULL)
-        return -1; 
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return NULL;
 
-    if (value == NULL){
-        if (trie_del_item(self->root, s, Py_dealloc) != 0)
-            return -1;
-    }else{
-        /* Take ownership of a reference to value, because Py_dealloc
-         * might otherwise cause the value object to be freed in case it 
-         * already exists in the trie. */
-        Py_INCREF(value);
-        if(trie_set_item(self->root, s, value, Py_dealloc) != 0){
-            PyErr_SetString(PyExc_Exception,
-                    "Unable to set value for string");
-            Py_XDECREF(value);
-            return -1;
+    if (*size < k.len + 1){
+        const TrieItem **tmp = PyMem_Realloc(*items,
+                sizeof(**items) * (k.len + 1));
+        if (tmp == NULL){
+            _PyTrie_release_key(&k);
+            return PyErr_NoMemory();
         }
+        *items = tmp;
+        *size = k.len + 1;
     }
-    return 0;
+    size_t n = trie_prefixes(self->root, k.s, k.len, *items);
+    _PyTrie_release_key(&k);
+
+    PyObject *result = PyList_New(n);
+    if (result == NULL)
+        return NULL;
+    for (size_t i = 0; i < n; i++){
+        const TrieItem *item = (*items)[i];
+        PyObject *pair = Py_BuildValue("(NO)",
+                _PyTrie_key_object(self, item->key, item->keylen),
+                (PyObject *)item->value);
+        if (pair == NULL){
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, pair);
+    }
+    return result;
 }
 
 static PyObject *
-PyTrie_repr(PyTrie *self)
+PyTrie_prefixes(PyTrie *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *colon = NULL;
-    PyObject *pieces = NULL;
-    PyObject *result = NULL;
-    TrieIter *it = NULL;
+    PyObject *key;
+    static char *kwlist[] = {"key", NULL};
+    const TrieItem **items = NULL;
+    size_t size = 0;
 
-    Py_ssize_t i = Py_ReprEnter((PyObject *)self);
-    if (i != 0){
-        return i > 0? PyString_FromString("Trie{...}") : NULL;
-    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &key))
+        return NULL;
 
-    if (trie_num_items(self->root) == 0){
-        result = PyString_FromString("Trie{}");
-        goto Done;
-    }
+    PyObject *result = _PyTrie_prefixes(self, key, &items, &size);
+    PyMem_Free(items);
+    return result;
+}
 
-    it = trieiter_suffixes(self->root, "");
-    if (it == NULL){
-        goto Done;
+static PyObject *
+PyTrie_prefixes_many(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *keys;
+    static char *kwlist[] = {"keys", NULL};
+    const TrieItem **items = NULL;
+    size_t size = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &keys))
+        return NULL;
+
+    PyObject *iter = PyObject_GetIter(keys);
+    if (iter == NULL)
+        return NULL;
+    PyObject *result = PyList_New(0);
+    PyObject *key;
+    while (result != NULL && (key = PyIter_Next(iter)) != NULL){
+        PyObject *prefixes = _PyTrie_prefixes(self, key, &items, &size);
+        Py_DECREF(key);
+        if (prefixes == NULL || PyList_Append(result, prefixes) != 0)
+            Py_CLEAR(result);
+        Py_XDECREF(prefixes);
+    }
+    Py_DECREF(iter);
+    PyMem_Free(items);
+    if (PyErr_Occurred() != NULL){
+        Py_XDECREF(result);
+        return NULL;
     }
+    return result;
+}
 
-    pieces = PyList_New(0);
-    if (pieces == NULL)
-        goto Done;
+/* Occurrences found by scan() and scan_approx() */
+struct ScanResults {
+    PyTrie *trie;
+    PyObject *list;
+    bool with_hd;           /* include Hamming distances in the results */
+};
 
-    colon = PyString_FromString(": ");
-    if (colon == NULL)
-        goto Done;
+/* Appends (pos, key, value), or (pos, hd, key, value) for approximate scans,
+ * to the list of results, returns -1 on error. */
+static int
+_PyTrie_scan_handler(size_t pos, int hd, const TrieItem *item, void *arg)
+{
+    struct ScanResults *r = (struct ScanResults *)arg;
+    PyObject *key = _PyTrie_key_object(r->trie, item->key, item->keylen);
+    PyObject *occurrence;
+    if (r->with_hd)
+        occurrence = Py_BuildValue("(niNO)", (Py_ssize_t)pos, hd, key,
+                (PyObject *)item->value);
+    else
+        occurrence = Py_BuildValue("(nNO)", (Py_ssize_t)pos, key,
+                (PyObject *)item->value);
+    if (occurrence == NULL)
+        return -1;
+    int status = PyList_Append(r->list, occurrence);
+    Py_DECREF(occurrence);
+    return status;
+}
 
-    /* Do repr() on each key:value pair and insert ": " between them. */
-    PyObject *s = NULL;
-    PyObject *temp = NULL;
-    TrieSearchResult *sr = NULL;
-    while ((sr = trieiter_next(it)) != NULL){
-        PyObject *value = (PyObject *)sr->target->value;
-        Py_INCREF(value);
+static PyObject *
+PyTrie_scan(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *text;
+    PyTrieKey k;
+    static char *kwlist[] = {"text", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &text))
+        return NULL;
+
+    if (_PyTrie_parse_key(self, text, &k, false) != 0)
+        return NULL;
+
+    struct ScanResults r = {self, PyList_New(0), false};
+    if (r.list == NULL){
+        _PyTrie_release_key(&k);
+        return NULL;
+    }
+
+    int status = trie_scan(self->root, k.s, k.len, _PyTrie_scan_handler, &r);
+    _PyTrie_release_key(&k);
+    if (status != 0){
+        Py_DECREF(r.list);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Unable to scan text");
+        return NULL;
+    }
+    return r.list;
+}
+
+/* Appends (start, end, key, value) to a list of tokens, returns -1 on
+ * error. */
+static int
+_PyTrie_segment_handler(size_t pos, int hd, const TrieItem *item, void *arg)
+{
+    (void)hd;
+    struct ScanResults *r = (struct ScanResults *)arg;
+    PyObject *token = Py_BuildValue("(nnNO)", (Py_ssize_t)pos,
+            (Py_ssize_t)(pos + item->keylen),
+            _PyTrie_key_object(r->trie, item->key, item->keylen),
+            (PyObject *)item->value);
+    if (token == NULL)
+        return -1;
+    int status = PyList_Append(r->list, token);
+    Py_DECREF(token);
+    return status;
+}
+
+static PyObject *
+PyTrie_segment(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *text;
+    PyTrieKey k;
+    static char *kwlist[] = {"text", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &text))
+        return NULL;
+
+    if (_PyTrie_parse_key(self, text, &k, false) != 0)
+        return NULL;
+
+    struct ScanResults r = {self, PyList_New(0), false};
+    if (r.list == NULL){
+        _PyTrie_release_key(&k);
+        return NULL;
+    }
+
+    int status = trie_segment(self->root, k.s, k.len,
+            _PyTrie_segment_handler, &r);
+    _PyTrie_release_key(&k);
+    if (status != 0){
+        Py_DECREF(r.list);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Unable to segment text");
+        return NULL;
+    }
+    return r.list;
+}
+
+static PyObject *
+PyTrie_scan_approx(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *text;
+    PyTrieKey k;
+    int maxhd;
+    PyObject *equiv = NULL;
+    static char *kwlist[] = {"text", "maxhd", "equiv", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oi|O", kwlist, &text,
+                &maxhd, &equiv))
+        return NULL;
+
+    if (maxhd < 0){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 0");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    struct ScanResults r = {self, NULL, true};
+    if (_PyTrie_parse_key(self, text, &k, false) != 0){
+        triecharclasses_free(classes);
+        return NULL;
+    }
+    r.list = PyList_New(0);
+    if (r.list == NULL){
+        _PyTrie_release_key(&k);
+        triecharclasses_free(classes);
+        return NULL;
+    }
+
+    int status = trie_scan_approx(self->root, k.s, k.len, maxhd, classes,
+            _PyTrie_scan_handler, &r);
+    _PyTrie_release_key(&k);
+    triecharclasses_free(classes);
+    if (status != 0){
+        Py_DECREF(r.list);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Unable to scan text");
+        return NULL;
+    }
+    return r.list;
+}
+
+/* Appends (key, value), or (hd, key, value) for approximate matches, to the
+ * list of results, returns -1 on error. */
+static int
+_PyTrie_endswith_handler(size_t pos, int hd, const TrieItem *item, void *arg)
+{
+    (void)pos;
+    struct ScanResults *r = (struct ScanResults *)arg;
+    PyObject *key = _PyTrie_key_object(r->trie, item->key, item->keylen);
+    PyObject *match;
+    if (r->with_hd)
+        match = Py_BuildValue("(iNO)", hd, key, (PyObject *)item->value);
+    else
+        match = Py_BuildValue("(NO)", key, (PyObject *)item->value);
+    if (match == NULL)
+        return -1;
+    int status = PyList_Append(r->list, match);
+    Py_DECREF(match);
+    return status;
+}
+
+/* Lists the keys ending in key with at most maxhd mismatches, for
+ * endswith() and endswith_approx() */
+static PyObject *
+_PyTrie_endswith(PyTrie *self, PyObject *key, int maxhd, PyObject *equiv,
+        bool with_hd)
+{
+    PyTrieKey k;
+
+    if (_PyTrie_check_reverse(self) != 0)
+        return NULL;
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    if (_PyTrie_parse_key(self, key, &k, false) != 0){
+        triecharclasses_free(classes);
+        return NULL;
+    }
+    struct ScanResults r = {self, PyList_New(0), with_hd};
+    if (r.list == NULL){
+        _PyTrie_release_key(&k);
+        triecharclasses_free(classes);
+        return NULL;
+    }
+
+    int status = trie_endswith(self->root, k.s, k.len, maxhd, classes,
+            _PyTrie_endswith_handler, &r);
+    _PyTrie_release_key(&k);
+    triecharclasses_free(classes);
+    if (status != 0){
+        Py_DECREF(r.list);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Unable to match suffix");
+        return NULL;
+    }
+    return r.list;
+}
+
+static PyObject *
+PyTrie_endswith(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key;
+    static char *kwlist[] = {"s", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &key))
+        return NULL;
+
+    return _PyTrie_endswith(self, key, 0, NULL, false);
+}
+
+static PyObject *
+PyTrie_endswith_approx(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key;
+    int maxhd;
+    PyObject *equiv = NULL;
+    static char *kwlist[] = {"s", "maxhd", "equiv", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oi|O", kwlist, &key,
+                &maxhd, &equiv))
+        return NULL;
+
+    if (maxhd < 0){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 0");
+        return NULL;
+    }
+
+    return _PyTrie_endswith(self, key, maxhd, equiv, true);
+}
+
+static PyObject *
+PyTrie_contains_substring(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key;
+    PyTrieKey k;
+    static char *kwlist[] = {"s", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &key))
+        return NULL;
+
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return NULL;
+
+    struct ScanResults r = {self, PyList_New(0), false};
+    if (r.list == NULL){
+        _PyTrie_release_key(&k);
+        return NULL;
+    }
+
+    int status = trie_find_substring(self->root, k.s, k.len,
+            _PyTrie_scan_handler, &r);
+    _PyTrie_release_key(&k);
+    if (status != 0){
+        Py_DECREF(r.list);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Unable to find substring");
+        return NULL;
+    }
+    return r.list;
+}
+
+static PyObject *
+PyTrie_substring_neighbors(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key;
+    PyTrieKey k;
+    int maxhd;
+    static char *kwlist[] = {"s", "maxhd", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oi", kwlist, &key,
+                &maxhd))
+        return NULL;
+
+    if (maxhd < 0){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 0");
+        return NULL;
+    }
+
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return NULL;
+
+    struct ScanResults r = {self, PyList_New(0), true};
+    if (r.list == NULL){
+        _PyTrie_release_key(&k);
+        return NULL;
+    }
+
+    int status = trie_substring_neighbors(self->root, k.s, k.len, maxhd,
+            _PyTrie_scan_handler, &r);
+    _PyTrie_release_key(&k);
+    if (status != 0){
+        Py_DECREF(r.list);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Unable to find substring");
+        return NULL;
+    }
+    return r.list;
+}
+
+static Py_ssize_t
+PyTrie_length(PyTrie *self)
+{
+    return trie_num_items(self->root);
+}
+
+static PyObject *
+PyTrie_cache_stats(PyTrie *self)
+{
+    TrieCacheStats stats;
+    trie_cache_stats(self->root, &stats);
+    size_t lookups = stats.hits + stats.misses;
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:d,s:n}",
+            "capacity", (Py_ssize_t)stats.capacity,
+            "entries", (Py_ssize_t)stats.num_entries,
+            "hits", (Py_ssize_t)stats.hits,
+            "misses", (Py_ssize_t)stats.misses,
+            "hit_rate", lookups > 0 ? (double)stats.hits / lookups : 0.0,
+            "memory", (Py_ssize_t)stats.memsize);
+}
+
+static PyObject *
+PyTrie_sizeof(PyTrie *self)
+{
+    return PyInt_FromLong(trie_mem_usage(self->root) +
+            triealphabet_mem_usage(self->alphabet));
+}
+
+/* GetItem function */
+static PyObject *
+PyTrie_subscript(PyTrie *self, PyObject *key)
+{
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
+        return NULL;
+
+    const TrieItem *item = trie_get_item(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
+
+    if (item == NULL){
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    Py_INCREF(item->value);
+    return item->value;
+}
+
+/* SetItem and DelItem functions.
+ * Return 0 on success and -1 on error. */
+static int 
+PyTrie_ass_subscript(PyTrie *self, PyObject *key, PyObject *value)
+{
+    PyTrieKey k;
+    int status = 0;
+    if (_PyTrie_parse_key(self, key, &k, value != NULL) != 0)
+        return -1;
+
+    if (value == NULL){
+        if (trie_del_item(self->root, k.s, k.len, Py_dealloc) != 0)
+            status = -1;
+    }else{
+        /* Take ownership of a reference to value, because Py_dealloc
+         * might otherwise cause the value object to be freed in case it 
+         * already exists in the trie. */
+        Py_INCREF(value);
+        if(trie_set_item(self->root, k.s, k.len, value, Py_dealloc) != 0){
+            PyErr_SetString(PyExc_Exception,
+                    "Unable to set value for string");
+            Py_XDECREF(value);
+            status = -1;
+        }
+    }
+    _PyTrie_release_key(&k);
+    return status;
+}
+
+static PyObject *
+PyTrie_repr(PyTrie *self)
+{
+    PyObject *colon = NULL;
+    PyObject *pieces = NULL;
+    PyObject *result = NULL;
+    TrieIter *it = NULL;
+
+    Py_ssize_t i = Py_ReprEnter((PyObject *)self);
+    if (i != 0){
+        return i > 0? PyString_FromString("Trie{...}") : NULL;
+    }
+
+    if (trie_num_items(self->root) == 0){
+        result = PyString_FromString("Trie{}");
+        goto Done;
+    }
+
+    it = trieiter_suffixes(self->root, "", 0);
+    if (it == NULL){
+        goto Done;
+    }
+
+    pieces = PyList_New(0);
+    if (pieces == NULL)
+        goto Done;
+
+    colon = PyString_FromString(": ");
+    if (colon == NULL)
+        goto Done;
+
+    /* Do repr() on each key:value pair and insert ": " between them. */
+    PyObject *s = NULL;
+    PyObject *temp = NULL;
+    TrieSearchResult *sr = NULL;
+    while ((sr = trieiter_next(it)) != NULL){
+        PyObject *value = (PyObject *)sr->target->value;
+        Py_INCREF(value);
 
         /* create 'key' string */
-        temp = PyString_FromString(sr->target->key);
+        temp = _PyTrie_key_object(self, sr->target->key, sr->target->keylen);
         s = PyObject_Repr(temp);
         Py_DECREF(temp);
 
@@ -786,8 +1651,10 @@ _PyTrieIter_suffixes_next(PyTrieIter *py_it)
     if (result == NULL)
         return NULL;
 
-    PyObject *result_pyobj = Py_BuildValue("(sO)",
-            result->target->key + trieiter_len_query(py_it->it),
+    size_t len_query = trieiter_len_query(py_it->it);
+    PyObject *result_pyobj = Py_BuildValue("(NO)",
+            _PyTrie_key_object(py_it->trie, result->target->key + len_query,
+                result->target->keylen - len_query),
             result->target->value);
     free(result);
     return(result_pyobj);
@@ -801,11 +1668,12 @@ PyTrie_suffixes(PyTrie *self, PyObject *args)
     if (!PyArg_UnpackTuple(args, "suffixes", 1, 1, &key))
         return NULL;
 
-    const char *s = PyString_AsString(key);
-    if (PyErr_Occurred() != NULL)
+    PyTrieKey k;
+    if (_PyTrie_parse_key(self, key, &k, false) != 0)
         return NULL;
 
-    TrieIter *it = trieiter_suffixes(self->root, s);
+    TrieIter *it = trieiter_suffixes(self->root, k.s, k.len);
+    _PyTrie_release_key(&k);
 
     if (it == NULL){
         PyErr_SetString(PyExc_Exception, "Unable to get iterator");
@@ -815,6 +1683,120 @@ PyTrie_suffixes(PyTrie *self, PyObject *args)
     return PyTrieIter_new(self, it, _PyTrieIter_suffixes_next);
 }
 
+/*
+ * Gets the trie characters of the characters obj, given in equiv. Tries with
+ * str keys take str characters, other tries bytes or ASCII strings.
+ *
+ * Returns 0 on success, -1 on error. On success, k has to be released with
+ * _PyTrie_release_key.
+ */
+static int
+_PyTrie_equiv_chars(PyTrie *self, PyObject *obj, PyTrieKey *k)
+{
+    if (self->key_type == KEYS_UNICODE)
+        return _PyTrie_parse_key(self, obj, k, false);
+
+    if (PyBytes_Check(obj)){
+        Py_INCREF(obj);
+        k->owner = obj;
+    }else if (PyUnicode_Check(obj)){
+        k->owner = PyUnicode_AsASCIIString(obj);
+        if (k->owner == NULL)
+            return -1;
+    }else{
+        PyErr_SetString(PyExc_TypeError, "expected bytes or str");
+        return -1;
+    }
+    k->s = PyBytes_AS_STRING(k->owner);
+    k->len = PyBytes_GET_SIZE(k->owner);
+    return 0;
+}
+
+/*
+ * Converts a dict mapping characters to their equivalent characters, e.g.
+ * {"N": "ACGT"}, to character classes.
+ *
+ * Returns NULL (without an exception set) if equiv is None or NULL.
+ */
+static TrieCharClasses *
+_PyTrie_charclasses(PyTrie *self, PyObject *equiv)
+{
+    if (equiv == NULL || equiv == Py_None)
+        return NULL;
+
+    if (!PyDict_Check(equiv)){
+        PyErr_SetString(PyExc_TypeError, "equiv must be a dict");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = triecharclasses_new();
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(equiv, &pos, &key, &value)){
+        PyTrieKey ch, members;
+        if (_PyTrie_equiv_chars(self, key, &ch) != 0){
+            triecharclasses_free(classes);
+            return NULL;
+        }
+        if (_PyTrie_equiv_chars(self, value, &members) != 0){
+            _PyTrie_release_key(&ch);
+            triecharclasses_free(classes);
+            return NULL;
+        }
+        if (ch.len != 1){
+            PyErr_SetString(PyExc_ValueError,
+                    "keys of equiv must be single characters");
+            _PyTrie_release_key(&ch);
+            _PyTrie_release_key(&members);
+            triecharclasses_free(classes);
+            return NULL;
+        }
+        /* code points not in the alphabet are in no key, so they are left
+         * out rather than all encoded as the same character */
+        bool known = true;
+        if (self->key_type == KEYS_UNICODE){
+            size_t n = 0;
+            for (size_t i = 0; i < members.len; i++)
+                if (members.s[i] != ALPHABET_UNKNOWN)
+                    members.s[n++] = members.s[i];
+            members.len = n;
+            known = ch.s[0] != ALPHABET_UNKNOWN;
+        }
+        if (known)
+            triecharclasses_set(classes, ch.s[0], members.s, members.len);
+        _PyTrie_release_key(&ch);
+        _PyTrie_release_key(&members);
+    }
+    return classes;
+}
+
+/* Names of the engines, indexed by TrieEngine */
+static const char *engine_names[TRIE_NUM_ENGINES] = {"trie", "scan", "masked",
+    "frontier", "split"};
+
+/*
+ * Sets engine to the engine called name, where NULL and "auto" mean the
+ * engine with the lowest estimated cost.
+ *
+ * @return: 0 on success, -1 with a ValueError set for an unknown name.
+ */
+static int
+_PyTrie_engine(const char *name, TrieEngine *engine)
+{
+    *engine = TRIE_ENGINE_AUTO;
+    if (name == NULL || strcmp(name, "auto") == 0)
+        return 0;
+
+    for (int e = 0; e < TRIE_NUM_ENGINES; e++){
+        if (strcmp(name, engine_names[e]) == 0){
+            *engine = e;
+            return 0;
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "unknown engine '%s'", name);
+    return -1;
+}
+
 static PyObject *
 _PyTrieIter_neighbors_next(PyTrieIter *py_it)
 {
@@ -822,8 +1804,10 @@ _PyTrieIter_neighbors_next(PyTrieIter *py_it)
     if (result == NULL)
         return NULL;
 
-    PyObject *result_pyobj = Py_BuildValue("(isO)",
-            result->hd, result->target->key, result->target->value);
+    PyObject *result_pyobj = Py_BuildValue("(iNO)", result->hd,
+            _PyTrie_key_object(py_it->trie, result->target->key,
+                result->target->keylen),
+            result->target->value);
     free(result);
     return(result_pyobj);
 }
@@ -831,17 +1815,16 @@ _PyTrieIter_neighbors_next(PyTrieIter *py_it)
 static PyObject *
 PyTrie_neighbors(PyTrie *self, PyObject *args, PyObject *kwds)
 {
-    char *s;
+    PyObject *key;
+    PyTrieKey k;
     int maxhd;
-    static char *kwlist[] = {"s", "maxhd", NULL};
+    PyObject *equiv = NULL;
+    const char *engine_name = NULL;
+    TrieEngine engine;
+    static char *kwlist[] = {"s", "maxhd", "equiv", "engine", NULL};
 
-#ifdef IS_PY3K
-    const char *format = "yi";
-#else
-    const char *format = "si";
-#endif
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, format, kwlist, &s, &maxhd))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oi|Oz", kwlist, &key,
+                &maxhd, &equiv, &engine_name))
         return NULL;
 
     if (maxhd < 1){
@@ -849,7 +1832,27 @@ PyTrie_neighbors(PyTrie *self, PyObject *args, PyObject *kwds)
         return NULL;
     }
 
-    TrieIter *it = trieiter_neighbors(self->root, s, maxhd);
+    if (_PyTrie_engine(engine_name, &engine) != 0)
+        return NULL;
+    if (engine == TRIE_ENGINE_MASKED){
+        PyErr_SetString(PyExc_ValueError,
+                "engine 'masked' only applies to pairs()");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    if (_PyTrie_parse_key(self, key, &k, false) != 0){
+        triecharclasses_free(classes);
+        return NULL;
+    }
+
+    TrieIter *it = trieiter_neighbors_engine(self->root, k.s, k.len, maxhd,
+            classes, engine);
+    _PyTrie_release_key(&k);
+    triecharclasses_free(classes);
 
     if (it == NULL){
         PyErr_SetString(PyExc_Exception,
@@ -867,10 +1870,14 @@ _PyTrieIter_pairs_next(PyTrieIter *py_it)
     if (result == NULL)
         return NULL;
 
-    PyObject *result_pyobj = Py_BuildValue("(isOsO)",
+    PyObject *result_pyobj = Py_BuildValue("(iNONO)",
             result->hd,
-            result->query->key, result->query->value,
-            result->target->key, result->target->value);
+            _PyTrie_key_object(py_it->trie, result->query->key,
+                result->query->keylen),
+            result->query->value,
+            _PyTrie_key_object(py_it->trie, result->target->key,
+                result->target->keylen),
+            result->target->value);
     free(result);
     return result_pyobj;
 }
@@ -880,10 +1887,13 @@ PyTrie_pairs(PyTrie *self, PyObject *args, PyObject *kwds)
 {
     int keylen;
     int maxhd;
-    static char *kwlist[] = {"keylen", "maxhd", NULL};
+    PyObject *equiv = NULL;
+    const char *engine_name = NULL;
+    TrieEngine engine;
+    static char *kwlist[] = {"keylen", "maxhd", "equiv", "engine", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii", kwlist, &keylen,
-                &maxhd))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|Oz", kwlist, &keylen,
+                &maxhd, &equiv, &engine_name))
         return NULL;
 
     if (keylen < 0){
@@ -896,7 +1906,28 @@ PyTrie_pairs(PyTrie *self, PyObject *args, PyObject *kwds)
         return NULL;
     }
 
-    TrieIter *it = trieiter_hammingpairs(self->root, keylen, maxhd);
+    if (_PyTrie_engine(engine_name, &engine) != 0)
+        return NULL;
+    if (engine == TRIE_ENGINE_FRONTIER){
+        PyErr_SetString(PyExc_ValueError,
+                "engine 'frontier' only applies to neighbors()");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    if (engine == TRIE_ENGINE_MASKED && (maxhd != 1 || classes != NULL)){
+        PyErr_SetString(PyExc_ValueError,
+                "engine 'masked' requires maxhd=1 and no equiv");
+        triecharclasses_free(classes);
+        return NULL;
+    }
+
+    TrieIter *it = trieiter_pairs_engine(self->root, keylen, maxhd, classes,
+            engine);
+    triecharclasses_free(classes);
 
     if (it == NULL){
         PyErr_SetString(PyExc_Exception, "Unable to get iterator");
@@ -906,6 +1937,218 @@ PyTrie_pairs(PyTrie *self, PyObject *args, PyObject *kwds)
     return PyTrieIter_new(self, it, _PyTrieIter_pairs_next);
 }
 
+static PyObject *
+PyTrie_explain(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    const char *op;
+    int keylen;
+    int maxhd;
+    PyObject *equiv = NULL;
+    static char *kwlist[] = {"op", "keylen", "maxhd", "equiv", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sii|O", kwlist, &op,
+                &keylen, &maxhd, &equiv))
+        return NULL;
+
+    bool pairs = strcmp(op, "pairs") == 0;
+    if (!pairs && strcmp(op, "neighbors") != 0){
+        PyErr_Format(PyExc_ValueError,
+                "op must be 'neighbors' or 'pairs', not '%s'", op);
+        return NULL;
+    }
+    if (keylen < 0){
+        PyErr_SetString(PyExc_ValueError, "keylen < 0");
+        return NULL;
+    }
+    if (maxhd < 1){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 1");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    TriePlan plan;
+    if (pairs)
+        trie_plan_pairs(self->root, keylen, maxhd, classes, &plan);
+    else
+        trie_plan_neighbors(self->root, keylen, maxhd, classes, &plan);
+    triecharclasses_free(classes);
+
+    PyObject *costs = PyDict_New();
+    if (costs == NULL)
+        return NULL;
+    for (int e = 0; e < TRIE_NUM_ENGINES; e++){
+        if (plan.cost[e] < 0)
+            continue;
+        PyObject *cost = PyFloat_FromDouble(plan.cost[e]);
+        if (cost == NULL ||
+                PyDict_SetItemString(costs, engine_names[e], cost) != 0){
+            Py_XDECREF(cost);
+            Py_DECREF(costs);
+            return NULL;
+        }
+        Py_DECREF(cost);
+    }
+    return Py_BuildValue("{s:s,s:N,s:n,s:i}",
+            "engine", engine_names[plan.engine],
+            "costs", costs,
+            "keys", (Py_ssize_t)plan.num_keys,
+            "alphabet", plan.alphabet);
+}
+
+/* Implements has_neighbor() (if any is true) and count_neighbors() */
+static PyObject *
+_PyTrie_count_neighbors(PyTrie *self, PyObject *args, PyObject *kwds,
+        bool any)
+{
+    PyObject *key;
+    PyTrieKey k;
+    int maxhd;
+    PyObject *equiv = NULL;
+    static char *kwlist[] = {"s", "maxhd", "equiv", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oi|O", kwlist, &key,
+                &maxhd, &equiv))
+        return NULL;
+
+    if (maxhd < 0){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 0");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    if (_PyTrie_parse_key(self, key, &k, false) != 0){
+        triecharclasses_free(classes);
+        return NULL;
+    }
+
+    PyObject *result;
+    if (any)
+        result = PyBool_FromLong(trie_has_neighbor(self->root, k.s, k.len,
+                    maxhd, classes));
+    else
+        result = PyLong_FromSize_t(trie_count_neighbors(self->root, k.s,
+                    k.len, maxhd, classes));
+    _PyTrie_release_key(&k);
+    triecharclasses_free(classes);
+    return result;
+}
+
+static PyObject *
+PyTrie_has_neighbor(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    return _PyTrie_count_neighbors(self, args, kwds, true);
+}
+
+static PyObject *
+PyTrie_count_neighbors(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    return _PyTrie_count_neighbors(self, args, kwds, false);
+}
+
+static PyObject *
+PyTrie_insert_if_isolated(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key;
+    PyObject *value;
+    PyTrieKey k;
+    int maxhd;
+    PyObject *equiv = NULL;
+    static char *kwlist[] = {"key", "value", "maxhd", "equiv", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOi|O", kwlist, &key,
+                &value, &maxhd, &equiv))
+        return NULL;
+
+    if (maxhd < 0){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 0");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    if (_PyTrie_parse_key(self, key, &k, true) != 0){
+        triecharclasses_free(classes);
+        return NULL;
+    }
+
+    const TrieItem *blocker;
+    int hd;
+    /* the trie takes ownership of a reference if value is added */
+    Py_INCREF(value);
+    int status = trie_insert_if_isolated(self->root, k.s, k.len, value,
+            maxhd, classes, Py_dealloc, &blocker, &hd);
+    _PyTrie_release_key(&k);
+    triecharclasses_free(classes);
+    if (status != 0)
+        Py_DECREF(value);
+
+    if (status < 0){
+        PyErr_SetString(PyExc_RuntimeError, "Unable to insert key");
+        return NULL;
+    }
+    if (status == 0)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(iNO)", hd,
+            _PyTrie_key_object(self, blocker->key, blocker->keylen),
+            (PyObject *)blocker->value);
+}
+
+static PyObject *
+PyTrie_checkpoint(PyTrie *self)
+{
+    if (trie_checkpoint(self->root) != 0){
+        PyErr_SetString(PyExc_RuntimeError, "Unable to make checkpoint");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+PyTrie_delta_pairs(PyTrie *self, PyObject *args, PyObject *kwds)
+{
+    int keylen;
+    int maxhd;
+    PyObject *equiv = NULL;
+    static char *kwlist[] = {"keylen", "maxhd", "equiv", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|O", kwlist, &keylen,
+                &maxhd, &equiv))
+        return NULL;
+
+    if (keylen < 1){
+        PyErr_SetString(PyExc_ValueError, "keylen < 1");
+        return NULL;
+    }
+
+    if (maxhd < 1){
+        PyErr_SetString(PyExc_ValueError, "maxhd < 1");
+        return NULL;
+    }
+
+    TrieCharClasses *classes = _PyTrie_charclasses(self, equiv);
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+
+    TrieIter *it = trieiter_deltapairs(self->root, keylen, maxhd, classes);
+    triecharclasses_free(classes);
+
+    if (it == NULL){
+        PyErr_SetString(PyExc_ValueError,
+                "no checkpoint, call checkpoint() first");
+        return NULL;
+    }
+
+    return PyTrieIter_new(self, it, _PyTrieIter_pairs_next);
+}
+
 /*
  * Creates a tuple of (key, value) pairs.
  */
@@ -914,7 +2157,7 @@ PyTrie_reduce(PyTrie *self)
 {
     if (self->root == NULL)
         return NULL;
-    TrieIter *it = trieiter_suffixes(self->root, "");
+    TrieIter *it = trieiter_suffixes(self->root, "", 0);
     if (it == NULL)
         return NULL;
 
@@ -929,17 +2172,25 @@ PyTrie_reduce(PyTrie *self)
         if (sr == NULL || sr->target == NULL || sr->target->key == NULL ||
                 sr->target->value == NULL)
             goto fail;
-#ifdef IS_PY3K
-        PyObject *key = PyBytes_FromString(sr->target->key);
-#else
-        PyObject *key = PyString_FromString(sr->target->key);
-#endif
+        PyObject *key;
+        if (self->key_type == KEYS_UNICODE)
+            key = _PyTrie_key_object(self, sr->target->key,
+                    sr->target->keylen);
+        else
+            key = PyBytes_FromStringAndSize(sr->target->key,
+                    sr->target->keylen);
         if (PyErr_Occurred() != NULL)
             goto fail;
         PyObject *value = sr->target->value;
         Py_INCREF(value);
         PyTuple_SET_ITEM(arg, i, PyTuple_Pack(2, key, value));
     }
+    TrieCacheStats stats;
+    trie_cache_stats(self->root, &stats);
+    if (trie_has_reverse(self->root) || stats.capacity > 0)
+        return Py_BuildValue("(O(NOn))", Py_TYPE(self), arg,
+                trie_has_reverse(self->root) ? Py_True : Py_False,
+                (Py_ssize_t)stats.capacity);
     return PyTuple_Pack(2, Py_TYPE(self), PyTuple_Pack(1,arg));
 fail:
     Py_DECREF(arg);
@@ -1000,14 +2251,108 @@ PyDoc_STRVAR(iteritems__doc__,
 PyDoc_STRVAR(num_nodes__doc__,
 "T.num_nodes() -> number of nodes in T");
 
+PyDoc_STRVAR(compile__doc__,
+"T.compile() -> compile T into a double-array, speeding up lookups of keys \n\
+and prefixes. T stays compiled until keys are added or removed.");
+
+PyDoc_STRVAR(is_compiled__doc__,
+"T.is_compiled() -> True if T is compiled, else False");
+
+PyDoc_STRVAR(relayout__doc__,
+"T.relayout() -> move all nodes of T into one contiguous block of memory, \n\
+ordered depth-first with siblings next to each other, which speeds up \n\
+traversals. Best called after bulk loading T.");
+
+PyDoc_STRVAR(compact__doc__,
+"T.compact() -> relayout T, release memory of the nodes removed since the \n\
+last compact(), and return the number of bytes reclaimed.");
+
 PyDoc_STRVAR(has_node__doc__,
 "T.has_node(k) -> True if T has a node corresponding to T[k], even if k is \n\
 not a key in T, else False.");
 
+PyDoc_STRVAR(delete_prefix__doc__,
+"T.delete_prefix(k) -> remove all keys that have k as a prefix (including k \n\
+itself), returning the number of removed keys.");
+
+PyDoc_STRVAR(retain__doc__,
+"T.retain(pred) -> remove all items for which pred(key, value) is false.\n\
+T.retain(min_value=x) -> remove all items with a value < x.\n\
+Both walk the trie once, pruning empty branches, and return the number of \n\
+removed items. Integer and float values are compared natively.");
+
 PyDoc_STRVAR(longest_prefix__doc__,
 "T.longest_prefix(k) -> find longest key matching the beginning of k, \n\
 returning (key, value) pair as a 2-tuple. None is returned if no match.");
 
+PyDoc_STRVAR(longest_prefix_approx__doc__,
+"T.longest_prefix_approx(k, maxhd) -> find the longest key matching the \n\
+beginning of k with at most maxhd mismatches, returning \n\
+(Hamming distance, key, value) as a 3-tuple. Of keys of equal length, the \n\
+one with the fewest mismatches is returned. None is returned if no match. \n\
+equiv={c: members} lets character c match any of members.");
+
+PyDoc_STRVAR(prefixes__doc__,
+"T.prefixes(k) -> list of all (key, value) pairs, as 2-tuples, of keys that \n\
+are a prefix of k (including k itself), shortest key first.");
+
+PyDoc_STRVAR(prefixes_many__doc__,
+"T.prefixes_many(keys) -> list with the result of T.prefixes(k) for each \n\
+k in keys, computed in a single call.");
+
+PyDoc_STRVAR(scan__doc__,
+"T.scan(text) -> list of all occurrences of keys in text, as \n\
+(position, key, value) 3-tuples ordered by the end of the occurrence. \n\
+Overlapping occurrences are all reported, and the empty key occurs at \n\
+every position, including len(text). The text is scanned in a single pass \n\
+(Aho-Corasick), for which the trie is compiled (see compile()).");
+
+PyDoc_STRVAR(scan_approx__doc__,
+"T.scan_approx(text, maxhd) -> list of all substrings of text that differ \n\
+by at most maxhd characters from a key, as (position, Hamming distance, \n\
+key, value) 4-tuples ordered by end position. equiv={c: members} lets \n\
+character c match any of members (see neighbors()).");
+
+PyDoc_STRVAR(segment__doc__,
+"T.segment(text) -> split text into keys, repeatedly taking the longest \n\
+key at the start of the rest of text. Returns a list of \n\
+(start, end, key, value) 4-tuples. Characters where no key starts are \n\
+skipped.");
+
+PyDoc_STRVAR(cache_stats__doc__,
+"T.cache_stats() -> dict with the capacity, number of entries, hits, \n\
+misses, hit rate and memory in bytes of the cache of neighbors() results \n\
+(see Trie(cache_size=n)).");
+
+PyDoc_STRVAR(longest_suffix__doc__,
+"T.longest_suffix(k) -> find the longest key that is a suffix of k, \n\
+returning (key, value) as a 2-tuple, or None if no match. Needs a trie \n\
+created with reverse_index=True.");
+
+PyDoc_STRVAR(endswith__doc__,
+"T.endswith(s) -> list of all (key, value) pairs, as 2-tuples, of keys \n\
+ending in s, in no particular order. Needs a trie created with \n\
+reverse_index=True.");
+
+PyDoc_STRVAR(endswith_approx__doc__,
+"T.endswith_approx(s, maxhd) -> list of all keys whose last len(s) \n\
+characters differ by at most maxhd characters from s, as \n\
+(Hamming distance, key, value) 3-tuples in no particular order. \n\
+equiv={c: members} lets character c match any of members. Needs a trie \n\
+created with reverse_index=True.");
+
+PyDoc_STRVAR(contains_substring__doc__,
+"T.contains_substring(s) -> list of all keys containing s, as \n\
+(position, key, value) 3-tuples ordered by key, where position is the first \n\
+position of s in the key. The keys are looked up in an index of all \n\
+substrings, built on first use and dropped when keys are added or removed.");
+
+PyDoc_STRVAR(substring_neighbors__doc__,
+"T.substring_neighbors(s, maxhd) -> list of all keys containing a \n\
+substring that differs by at most maxhd characters from s, as \n\
+(position, Hamming distance, key, value) 4-tuples ordered by key. Only the \n\
+closest substring of each key is reported (see contains_substring()).");
+
 PyDoc_STRVAR(suffixes__doc__,
 "T.suffixes(k) -> iterate over all (suffix, value) pairs in T, as 2-tuples, \n\
 that have k as a prefix.");
@@ -1015,12 +2360,59 @@ that have k as a prefix.");
 PyDoc_STRVAR(neighbors__doc__,
 "T.neighbors(key=k, maxhd=n) -> iterate over all \n\
 (Hamming distance, key, value) triples, as 3-tuples,\n\
-where key and k differ by at least 1, but maximally n characters.");
+where key and k differ by at least 1, but maximally n characters.\n\
+equiv={c: members} lets character c match any of members, e.g.\n\
+{b'N': b'ACGT'}. Keys only differing by such matches have distance 0.\n\
+engine='trie' searches the trie depth-first, engine='frontier' \n\
+breadth-first, engine='scan' compares k with every key of its length, \n\
+and engine='split' searches the first and second halves of the keys \n\
+apart, which suits large n. By default the engine is chosen as by \n\
+explain().");
 
 PyDoc_STRVAR(pairs__doc__,
 "T.pairs(keylen=l, maxhd=n) -> iterate over *ALL* \n\
 (Hamming distance, key1, value1, key2, value2) 5-tuples, \n\
-where key1 and key2 differ by at least 1, but maximally n characters.");
+where key1 and key2 differ by at least 1, but maximally n characters.\n\
+equiv={c: members} lets character c match any of members.\n\
+engine='masked' finds the pairs for maxhd=1 by grouping the keys on their \n\
+hash with each position masked in turn, engine='scan' compares all keys \n\
+with each other, engine='split' finds the neighbors of each key through \n\
+its halves, and engine='trie' searches the trie. By default the engine is \n\
+chosen as by explain().");
+
+PyDoc_STRVAR(explain__doc__,
+"T.explain(op, keylen, maxhd) -> dict with the engine chosen for \n\
+neighbors() (op='neighbors') of a key of length keylen, or for \n\
+pairs(keylen, maxhd) (op='pairs'), the estimated cost of each engine that \n\
+applies, the number of keys of length keylen and the size of the alphabet. \n\
+equiv={c: members} lets character c match any of members.");
+
+PyDoc_STRVAR(has_neighbor__doc__,
+"T.has_neighbor(s, maxhd) -> True if neighbors(s, maxhd) would return any \n\
+key, stopping at the first one found. s itself need not be a key. \n\
+equiv={c: members} lets character c match any of members.");
+
+PyDoc_STRVAR(count_neighbors__doc__,
+"T.count_neighbors(s, maxhd) -> number of keys neighbors(s, maxhd) would \n\
+return, counted without creating results. s itself need not be a key. \n\
+equiv={c: members} lets character c match any of members.");
+
+PyDoc_STRVAR(insert_if_isolated__doc__,
+"T.insert_if_isolated(k, v, maxhd) -> set T[k] = v unless T has a key of \n\
+the same length that differs by at most maxhd characters from k (k itself \n\
+included). Returns None if k was added, else the closest such key as a \n\
+(Hamming distance, key, value) 3-tuple. equiv={c: members} lets \n\
+character c match any of members.");
+
+PyDoc_STRVAR(checkpoint__doc__,
+"T.checkpoint() -> start tracking the keys added to T from now on, for \n\
+delta_pairs(). Keys tracked since an earlier checkpoint are forgotten.");
+
+PyDoc_STRVAR(delta_pairs__doc__,
+"T.delta_pairs(keylen=l, maxhd=n) -> iterate over the pairs of pairs() \n\
+that include at least one key added since the checkpoint, each pair once. \n\
+Once the iteration is complete, keys of length l are no longer new. \n\
+equiv={c: members} lets character c match any of members.");
 
 static PyMethodDef PyTrie_methods[] = {
     {"__reduce__",      (PyCFunction)PyTrie_reduce, METH_NOARGS,
@@ -1057,16 +2449,64 @@ static PyMethodDef PyTrie_methods[] = {
     /* Trie specific methods */
     {"num_nodes",       (PyCFunction)PyTrie_num_nodes, METH_NOARGS,
         num_nodes__doc__},
+    {"compile",         (PyCFunction)PyTrie_compile, METH_NOARGS,
+        compile__doc__},
+    {"is_compiled",     (PyCFunction)PyTrie_is_compiled, METH_NOARGS,
+        is_compiled__doc__},
+    {"relayout",        (PyCFunction)PyTrie_relayout, METH_NOARGS,
+        relayout__doc__},
+    {"compact",         (PyCFunction)PyTrie_compact, METH_NOARGS,
+        compact__doc__},
+    {"cache_stats",     (PyCFunction)PyTrie_cache_stats, METH_NOARGS,
+        cache_stats__doc__},
     {"has_node",        (PyCFunction)PyTrie_has_node, METH_VARARGS,
         has_node__doc__},
+    {"delete_prefix",   (PyCFunction)PyTrie_delete_prefix, METH_VARARGS,
+        delete_prefix__doc__},
+    {"retain",          (PyCFunction)PyTrie_retain,
+        METH_VARARGS | METH_KEYWORDS, retain__doc__},
     {"longest_prefix",  (PyCFunction)PyTrie_longest_prefix,
         METH_VARARGS | METH_KEYWORDS, longest_prefix__doc__},
+    {"longest_prefix_approx", (PyCFunction)PyTrie_longest_prefix_approx,
+        METH_VARARGS | METH_KEYWORDS, longest_prefix_approx__doc__},
+    {"prefixes",        (PyCFunction)PyTrie_prefixes,
+        METH_VARARGS | METH_KEYWORDS, prefixes__doc__},
+    {"prefixes_many",   (PyCFunction)PyTrie_prefixes_many,
+        METH_VARARGS | METH_KEYWORDS, prefixes_many__doc__},
+    {"scan",            (PyCFunction)PyTrie_scan,
+        METH_VARARGS | METH_KEYWORDS, scan__doc__},
+    {"scan_approx",     (PyCFunction)PyTrie_scan_approx,
+        METH_VARARGS | METH_KEYWORDS, scan_approx__doc__},
+    {"segment",         (PyCFunction)PyTrie_segment,
+        METH_VARARGS | METH_KEYWORDS, segment__doc__},
+    {"longest_suffix",  (PyCFunction)PyTrie_longest_suffix,
+        METH_VARARGS | METH_KEYWORDS, longest_suffix__doc__},
+    {"endswith",        (PyCFunction)PyTrie_endswith,
+        METH_VARARGS | METH_KEYWORDS, endswith__doc__},
+    {"endswith_approx", (PyCFunction)PyTrie_endswith_approx,
+        METH_VARARGS | METH_KEYWORDS, endswith_approx__doc__},
+    {"contains_substring", (PyCFunction)PyTrie_contains_substring,
+        METH_VARARGS | METH_KEYWORDS, contains_substring__doc__},
+    {"substring_neighbors", (PyCFunction)PyTrie_substring_neighbors,
+        METH_VARARGS | METH_KEYWORDS, substring_neighbors__doc__},
     {"suffixes",        (PyCFunction)PyTrie_suffixes,
         METH_VARARGS, suffixes__doc__},
     {"neighbors",       (PyCFunction)PyTrie_neighbors,
         METH_VARARGS | METH_KEYWORDS, neighbors__doc__},
     {"pairs",           (PyCFunction)PyTrie_pairs,
         METH_VARARGS | METH_KEYWORDS, pairs__doc__},
+    {"explain",         (PyCFunction)PyTrie_explain,
+        METH_VARARGS | METH_KEYWORDS, explain__doc__},
+    {"has_neighbor",    (PyCFunction)PyTrie_has_neighbor,
+        METH_VARARGS | METH_KEYWORDS, has_neighbor__doc__},
+    {"count_neighbors", (PyCFunction)PyTrie_count_neighbors,
+        METH_VARARGS | METH_KEYWORDS, count_neighbors__doc__},
+    {"insert_if_isolated", (PyCFunction)PyTrie_insert_if_isolated,
+        METH_VARARGS | METH_KEYWORDS, insert_if_isolated__doc__},
+    {"checkpoint",      (PyCFunction)PyTrie_checkpoint, METH_NOARGS,
+        checkpoint__doc__},
+    {"delta_pairs",     (PyCFunction)PyTrie_delta_pairs,
+        METH_VARARGS | METH_KEYWORDS, delta_pairs__doc__},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
@@ -1094,7 +2534,11 @@ static PyMemberDef PyTrie_members[] = {
     {NULL, 0, 0, 0, ""} /* Sentinel */
 };
 
-PyDoc_STRVAR(trie_doc, "Trie() -> new empty trie");
+PyDoc_STRVAR(trie_doc,
+"Trie(reverse_index=False, cache_size=0) -> new empty trie. With \n\
+reverse_index=True, a mirror of the trie with all keys reversed is \n\
+maintained for longest_suffix(), endswith() and endswith_approx(). \n\
+cache_size > 0 caches the results of that many neighbors() queries.");
 
 static PyTypeObject PyTrieType = {
     PyVarObject_HEAD_INIT(NULL, 0)
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Meet-in-the-middle index for neighbors at large Hamming distances.
+ *
+ * The keys of one length are split into a first and a second half, and each
+ * half is stored in a trie of its own. If two keys are within maxhd of each
+ * other, their first halves are within a = maxhd / 2, or their second halves
+ * are within maxhd - a - 1, as otherwise the halves would add up to more
+ * than maxhd mismatches. So searching both half tries with these budgets
+ * finds all neighbors, and only the keys found are compared in full. Each
+ * half is searched with less than half the budget over half the length,
+ * which keeps the upper levels from exploding as in a search of the whole
+ * trie with a large maxhd.
+ *
+ * The value of a half in its trie is 1 + the index of the last key having
+ * that half, and the other keys having it are chained from there.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trie.h"
+#include "trie_internal.h"
+
+static void
+splitindex_add(SplitIndex *si, const TrieNode *node, size_t depth)
+{
+    if (depth == 0){
+        if (node->item.key == NULL)
+            return;
+
+        size_t i = si->num_keys++;
+        if (si->items == NULL)
+            return;
+
+        si->items[i] = &node->item;
+        for (int h = 0; h < 2; h++){
+            TrieRoot *half = si->halves[h];
+            const TRIECHAR *key = node->item.key + (h == 0 ? 0 : si->mid);
+            size_t len = h == 0 ? si->mid : si->keylen - si->mid;
+            TrieItem *last = (TrieItem *)trie_get_item(half, key, len);
+            TRIEVALUE *value = (TRIEVALUE *)(uintptr_t)(i + 1);
+            if (last != NULL){
+                si->chains[h][i] = (uintptr_t)last->value;
+                last->value = value;
+            }else{
+                si->chains[h][i] = 0;
+                trie_set_item(half, key, len, value, NULL);
+            }
+        }
+        return;
+    }
+    for (node = node->child; node != NULL; node = node->sibling)
+        splitindex_add(si, node, depth - 1);
+}
+
+/*
+ * Creates the index of the halves of the keys of length keylen in the trie.
+ */
+SplitIndex *
+splitindex_new(const TrieRoot *root, size_t keylen)
+{
+    SplitIndex *si = safe_malloc(sizeof(*si));
+    si->keylen = keylen;
+    si->mid = keylen / 2;
+    si->items = NULL;
+    si->next = NULL;
+
+    /* count the keys first, then index them */
+    si->num_keys = 0;
+    splitindex_add(si, (const TrieNode *)root, keylen);
+    size_t n = si->num_keys > 0 ? si->num_keys : 1;
+    si->items = safe_malloc(sizeof(*si->items) * n);
+    for (int h = 0; h < 2; h++){
+        si->halves[h] = trie_new();
+        si->chains[h] = safe_malloc(sizeof(*si->chains[h]) * n);
+    }
+    si->num_keys = 0;
+    splitindex_add(si, (const TrieNode *)root, keylen);
+    for (int h = 0; h < 2; h++)
+        trie_relayout(si->halves[h]);
+    return si;
+}
+
+/*
+ * Frees si and the indexes for other lengths linked to it.
+ */
+void
+splitindex_free(SplitIndex *si)
+{
+    while (si != NULL){
+        SplitIndex *next = si->next;
+        for (int h = 0; h < 2; h++){
+            trie_free(si->halves[h], NULL);
+            free(si->chains[h]);
+        }
+        free(si->items);
+        free(si);
+        si = next;
+    }
+}
+
+/* Size of si alone in memory in bytes */
+size_t
+splitindex_mem_usage(const SplitIndex *si)
+{
+    if (si == NULL)
+        return 0;
+
+    size_t n = si->num_keys > 0 ? si->num_keys : 1;
+    return sizeof(*si) + sizeof(*si->items) * n
+        + 2 * sizeof(*si->chains[0]) * n
+        + trie_mem_usage(si->halves[0]) + trie_mem_usage(si->halves[1]);
+}
+
+/* State of a search of the halves */
+struct SplitSearch {
+    const SplitIndex *si;
+    const TRIECHAR *key;
+    int maxhd;
+    int budget[2];              /* mismatches allowed in each half */
+    const TrieCharClasses *classes;
+    SplitMatches *found;
+};
+
+/* Number of mismatches between a and b, counted until it exceeds limit */
+static int
+split_distance(const TRIECHAR *a, const TRIECHAR *b, size_t len,
+        const TrieCharClasses *classes, int limit)
+{
+    int hd = 0;
+    for (size_t i = 0; i < len && hd <= limit; i++)
+        hd += !triecharclasses_match(classes, a[i], b[i]);
+    return hd;
+}
+
+static void
+splitmatches_add(SplitMatches *found, size_t index, int hd)
+{
+    if (found->len == found->size){
+        found->size = found->size > 0 ? 2 * found->size : 16;
+        found->matches = safe_realloc(found->matches,
+                sizeof(*found->matches) * found->size);
+    }
+    found->matches[found->len].index = index;
+    found->matches[found->len++].hd = hd;
+}
+
+/*
+ * Compares the keys having a half within the budget of half h, hd mismatches
+ * from the half of the query, with the query in full.
+ */
+static void
+split_verify(const struct SplitSearch *s, int h, size_t chain, int hd)
+{
+    const SplitIndex *si = s->si;
+    size_t mid = si->mid;
+    for (; chain != 0; chain = si->chains[h][chain - 1]){
+        const TRIECHAR *other = si->items[chain - 1]->key;
+        int rest;
+        if (h == 0){
+            rest = split_distance(s->key + mid, other + mid,
+                    si->keylen - mid, s->classes, s->maxhd - hd);
+        }else{
+            rest = split_distance(s->key, other, mid, s->classes,
+                    s->maxhd - hd);
+            /* such keys were found through the first half already */
+            if (rest <= s->budget[0])
+                continue;
+        }
+        if (hd + rest <= s->maxhd)
+            splitmatches_add(s->found, chain - 1, hd + rest);
+    }
+}
+
+/* Searches the trie of half h below node, at depth, for the query half */
+static void
+split_search(const struct SplitSearch *s, int h, const TrieNode *node,
+        size_t depth, int hd)
+{
+    const SplitIndex *si = s->si;
+    const TRIECHAR *half = s->key + (h == 0 ? 0 : si->mid);
+    size_t len = h == 0 ? si->mid : si->keylen - si->mid;
+    if (depth == len){
+        if (node->item.key != NULL)
+            split_verify(s, h, (uintptr_t)node->item.value, hd);
+        return;
+    }
+    for (node = node->child; node != NULL; node = node->sibling){
+        int child_hd = hd + !triecharclasses_match(s->classes, node->ch,
+                half[depth]);
+        if (child_hd <= s->budget[h])
+            split_search(s, h, node, depth + 1, child_hd);
+    }
+}
+
+/*
+ * Finds the keys of the index within maxhd of key, which has the length of
+ * the keys of si, including key itself if it is in the index. The keys are
+ * added to found, which is emptied first, each key once.
+ */
+void
+splitindex_find(const SplitIndex *si, const TRIECHAR *key, int maxhd,
+        const TrieCharClasses *classes, SplitMatches *found)
+{
+    struct SplitSearch s;
+    s.si = si;
+    s.key = key;
+    s.maxhd = maxhd;
+    s.budget[0] = maxhd / 2;
+    s.budget[1] = maxhd - s.budget[0] - 1;
+    s.classes = classes;
+    s.found = found;
+
+    found->len = 0;
+    for (int h = 0; h < 2; h++)
+        if (s.budget[h] >= 0)
+            split_search(&s, h, (const TrieNode *)si->halves[h], 0, 0);
+}
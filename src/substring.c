@@ -0,0 +1,277 @@
+/*
+ * Copyright 2016 Bram Gerritsen
+ *
+ * This file is part of vtrie.
+ *
+ * vtrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vtrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vtrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Substring index of a trie.
+ *
+ * The index is a suffix array over all keys: every position of every key is
+ * an entry, and entries are sorted by the part of the key starting at that
+ * position. The keys containing a string then correspond to one contiguous
+ * range of entries, found by binary search.
+ *
+ * Like the double-array, the index refers to the items of the trie, so it is
+ * dropped as soon as nodes are added to or removed from the trie.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trie.h"
+#include "trie_internal.h"
+
+/* A suffix of a key */
+struct SuffixEntry {
+    const TrieItem *item;
+    size_t offset;          /* start of the suffix in the key */
+};
+
+struct SubstringIndex {
+    struct SuffixEntry *entries;
+    size_t num_entries;
+};
+
+/* Match of a query in a key */
+struct SubstringMatch {
+    const TrieItem *item;
+    size_t offset;
+    int hd;
+};
+
+static void
+substringindex_add_node(struct SubstringIndex *si, const TrieNode *node)
+{
+    for (; node != NULL; node = node->sibling){
+        const TrieItem *item = &node->item;
+        if (item->key != NULL){
+            for (size_t i = 0; i < item->keylen; i++){
+                si->entries[si->num_entries].item = item;
+                si->entries[si->num_entries++].offset = i;
+            }
+        }
+        substringindex_add_node(si, node->child);
+    }
+}
+
+/* Returns the total length of the keys in and below node */
+static size_t
+substringindex_count(const TrieNode *node)
+{
+    size_t n = 0;
+    for (; node != NULL; node = node->sibling){
+        if (node->item.key != NULL)
+            n += node->item.keylen;
+        n += substringindex_count(node->child);
+    }
+    return n;
+}
+
+/* Compares s with the suffix of entry e, looking at most at n characters */
+static int
+suffix_compare(const TRIECHAR *s, size_t n, const struct SuffixEntry *e)
+{
+    size_t len = e->item->keylen - e->offset;
+    int cmp = memcmp(s, e->item->key + e->offset, n < len ? n : len);
+    if (cmp != 0 || n == len)
+        return cmp;
+    return n < len ? -1 : 1;
+}
+
+static int
+compare_suffixes(const void *a, const void *b)
+{
+    const struct SuffixEntry *ea = (const struct SuffixEntry *)a;
+    return suffix_compare(ea->item->key + ea->offset,
+            ea->item->keylen - ea->offset, (const struct SuffixEntry *)b);
+}
+
+/*
+ * Creates a substring index of all keys of the trie.
+ */
+SubstringIndex *
+substringindex_new(const TrieRoot *root)
+{
+    size_t num_entries = substringindex_count(root->child);
+
+    SubstringIndex *si = safe_malloc(sizeof(*si));
+    si->entries = safe_malloc(sizeof(*si->entries) *
+            (num_entries > 0 ? num_entries : 1));
+    si->num_entries = 0;
+    substringindex_add_node(si, root->child);
+    qsort(si->entries, si->num_entries, sizeof(*si->entries),
+            compare_suffixes);
+    return si;
+}
+
+void
+substringindex_free(SubstringIndex *si)
+{
+    if (si == NULL)
+        return;
+
+    free(si->entries);
+    free(si);
+}
+
+size_t
+substringindex_mem_usage(const SubstringIndex *si)
+{
+    if (si == NULL)
+        return 0;
+
+    return sizeof(*si) + si->num_entries * sizeof(*si->entries);
+}
+
+/*
+ * Finds the range [*first, *last) of entries whose suffix starts with the n
+ * characters of s.
+ */
+static void
+substringindex_range(const SubstringIndex *si, const TRIECHAR *s, size_t n,
+        size_t *first, size_t *last)
+{
+    size_t lo = 0, hi = si->num_entries;
+    while (lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if (suffix_compare(s, n, &si->entries[mid]) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *first = lo;
+
+    /* suffixes starting with s sort before s followed by anything else */
+    hi = si->num_entries;
+    while (lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        const struct SuffixEntry *e = &si->entries[mid];
+        size_t len = e->item->keylen - e->offset;
+        if (len >= n && memcmp(s, e->item->key + e->offset, n) == 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *last = lo;
+}
+
+/* Orders matches by key, then by Hamming distance, then by offset */
+static int
+compare_matches(const void *a, const void *b)
+{
+    const struct SubstringMatch *ma = (const struct SubstringMatch *)a;
+    const struct SubstringMatch *mb = (const struct SubstringMatch *)b;
+    if (ma->item != mb->item){
+        size_t na = ma->item->keylen, nb = mb->item->keylen;
+        int cmp = memcmp(ma->item->key, mb->item->key, na < nb ? na : nb);
+        if (cmp != 0)
+            return cmp;
+        return na < nb ? -1 : 1;
+    }
+    if (ma->hd != mb->hd)
+        return ma->hd < mb->hd ? -1 : 1;
+    if (ma->offset != mb->offset)
+        return ma->offset < mb->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Calls handler for the best match of every item in matches, in order of
+ * their keys. matches are sorted in place.
+ */
+static int
+report_matches(struct SubstringMatch *matches, size_t n,
+        TrieScanHandler handler, void *arg)
+{
+    qsort(matches, n, sizeof(*matches), compare_matches);
+    for (size_t i = 0; i < n; i++){
+        if (i > 0 && matches[i].item == matches[i - 1].item)
+            continue;
+        int retval = handler(matches[i].offset, matches[i].hd,
+                matches[i].item, arg);
+        if (retval != 0)
+            return retval;
+    }
+    return 0;
+}
+
+int
+substringindex_find(const SubstringIndex *si, const TRIECHAR *s, size_t n,
+        TrieScanHandler handler, void *arg)
+{
+    size_t first, last;
+    substringindex_range(si, s, n, &first, &last);
+    if (first == last)
+        return 0;
+
+    struct SubstringMatch *matches = safe_malloc(sizeof(*matches) *
+            (last - first));
+    for (size_t i = first; i < last; i++){
+        matches[i - first].item = si->entries[i].item;
+        matches[i - first].offset = si->entries[i].offset;
+        matches[i - first].hd = 0;
+    }
+    int retval = report_matches(matches, last - first, handler, arg);
+    free(matches);
+    return retval;
+}
+
+/*
+ * Finds keys with a substring within maxhd mismatches of s. If s is split
+ * into maxhd + 1 pieces, any such substring matches at least one of the
+ * pieces exactly, so only the positions where a piece occurs are verified.
+ */
+int
+substringindex_neighbors(const SubstringIndex *si, const TRIECHAR *s,
+        size_t n, int maxhd, TrieScanHandler handler, void *arg)
+{
+    size_t num_pieces = (size_t)maxhd + 1;
+    size_t num_matches = 0, size = 16;
+    struct SubstringMatch *matches = safe_malloc(sizeof(*matches) * size);
+
+    for (size_t p = 0; p < num_pieces; p++){
+        size_t start = p * n / num_pieces;
+        size_t end = (p + 1) * n / num_pieces;
+        size_t first, last;
+        substringindex_range(si, s + start, end - start, &first, &last);
+
+        for (size_t i = first; i < last; i++){
+            const struct SuffixEntry *e = &si->entries[i];
+            if (e->offset < start || e->offset - start + n > e->item->keylen)
+                continue;
+            size_t offset = e->offset - start;
+            const TRIECHAR *window = e->item->key + offset;
+            int hd = 0;
+            for (size_t j = 0; j < n && hd <= maxhd; j++)
+                hd += window[j] != s[j];
+            if (hd > maxhd)
+                continue;
+
+            if (num_matches == size){
+                size *= 2;
+                matches = safe_realloc(matches, sizeof(*matches) * size);
+            }
+            matches[num_matches].item = e->item;
+            matches[num_matches].offset = offset;
+            matches[num_matches++].hd = hd;
+        }
+    }
+
+    int retval = report_matches(matches, num_matches, handler, arg);
+    free(matches);
+    return retval;
+}
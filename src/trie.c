@@ -23,72 +23,20 @@
 #include <string.h>
 #include "util.h"
 #include "trie.h"
+#include "trie_internal.h"
 
-/*
- * Flags used to set the status of nodes/trie.
- */
-#define TRIE_EXPLORED      0x0001
-
-/* Define the fields of a TrieNode */
-#define TrieNode_FIELDS                                             \
-    struct TrieItem item;                                           \
-    struct TrieNode *parent;                                        \
-    struct TrieNode *sibling;   /* points to next sibling */        \
-    struct TrieNode *child;     /* first in a list of children */   \
-    TRIECHAR ch;                                                    \
-    int flags;
-
-struct ListNode {
-    void *value;
-    struct ListNode *next;
-};
-
-struct TrieNode {
-    TrieNode_FIELDS
-};
-
-struct TrieRoot {
-    TrieNode_FIELDS         /* Root node can hold empty string */
-    size_t num_nodes;       /* Number of nodes in the Trie */
-    size_t num_items;       /* Number of items in the Trie */
-    size_t memsize;         /* Size of trie in memory in bytes */
-    long long state_id;     /* identifier for current state of the Trie */
-    TrieIter *dirty_iter;   /* active dirty iterator, NULL if nothing active */
-};
-
-struct TrieIterState {
-    struct TrieNode *node;  /* current node */
-    struct TrieNode *query; /* node corresponding to current query string */
-    int hd;                 /* Hamming distance between `node` and `query` */
-    int depth;              /* depth of `node` in the trie */
-};
-
-typedef TrieSearchResult * (*TrieIterNextFunc) (TrieIter *);
-
-struct TrieIter {
-    struct TrieRoot *root;
-    struct TrieIterState *head;
-    struct TrieIterState *fill; /* points at new position to be filled */
-    struct TrieIterState *tail;
-    int maxhd;
-    int target_depth;
-    int len_query;
-    bool is_dirty;
-    long long trie_state_id;    /* state_id of Trie at iter creation */
-    int errcode;
-    struct ListNode *stack;
-    TrieIterNextFunc next;
-};
-
-typedef struct ListNode ListNode;
-typedef struct TrieIterState TrieIterState;
-typedef struct TrieNode TrieNode;
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+/* Copies the n characters of s, appending a NUL character to the copy. */
 static TRIECHAR *
 duplicate_string(const TRIECHAR *s, size_t n)
 {
-    TRIECHAR *dup = safe_malloc(sizeof(*dup) * n);
-    return (TRIECHAR *) memcpy(dup, s, sizeof(*dup) * n);
+    TRIECHAR *dup = safe_malloc(sizeof(*dup) * (n + 1));
+    memcpy(dup, s, sizeof(*dup) * n);
+    dup[n] = '\0';
+    return dup;
 }
 
 /*
@@ -164,6 +112,18 @@ trieiter_push_state(TrieIter *it, TrieNode *node, TrieNode *query,
     trieiter_push_state_unsafe(it, node, query, hd, depth);
 }
 
+/*
+ * Pushes a state as trieiter_push_state, prefetching the first child of node,
+ * which is looked at once the state is popped.
+ */
+static void
+trieiter_push_prefetched(TrieIter *it, TrieNode *node, TrieNode *query,
+        int hd, int depth)
+{
+    trienode_prefetch(node->child);
+    trieiter_push_state(it, node, query, hd, depth);
+}
+
 static TrieIterState * 
 trieiter_pop_state(TrieIter *it)
 {
@@ -178,6 +138,7 @@ trieiter_pop_state(TrieIter *it)
 }
 
 static void trie_reset(TrieNode *node);
+static void triefrontier_free(TrieFrontier *levels, size_t num_levels);
 
 static TrieIter *
 trieiter_new(TrieRoot *root, int num_states, int maxhd, int target_depth,
@@ -199,6 +160,16 @@ trieiter_new(TrieRoot *root, int num_states, int maxhd, int target_depth,
     it->errcode = E_SUCCESS;
     it->stack = stack;
     it->next = next;
+    it->classes = NULL;
+    it->entry = NULL;
+    it->pos = 0;
+    it->mask = NULL;
+    it->flat = NULL;
+    it->pos2 = 0;
+    it->frontier = NULL;
+    it->split = NULL;
+    it->found.matches = NULL;
+    it->found.len = it->found.size = 0;
 
     if (is_dirty){
         if (root->dirty_iter != NULL){
@@ -279,7 +250,7 @@ trie_reset(TrieNode *node)
     if (node->sibling != NULL)
         trie_reset(node->sibling);
 
-    node->flags = 0;
+    node->flags &= ~TRIE_EXPLORED;
 }
 
 /*
@@ -298,9 +269,76 @@ void trieiter_free(TrieIter *it)
 
     free(it->head);
     while(stack_pop(&it->stack)!=NULL);
+    triecharclasses_free(it->classes);
+    triecacheentry_free(it->entry);
+    maskindex_free(it->mask);
+    triefrontier_free(it->frontier, it->target_depth + 1);
+    free(it->found.matches);
     free(it);
 }
 
+TrieCharClasses *
+triecharclasses_new(void)
+{
+    TrieCharClasses *classes = safe_calloc(1, sizeof(*classes));
+    for (int ch = 0; ch < TRIE_NUM_CHARS; ch++){
+        classes->members[ch][ch >> 6] = (uint64_t)1 << (ch & 63);
+        classes->matches[ch][ch >> 6] = (uint64_t)1 << (ch & 63);
+    }
+    return classes;
+}
+
+TrieCharClasses *
+triecharclasses_copy(const TrieCharClasses *classes)
+{
+    if (classes == NULL)
+        return NULL;
+
+    TrieCharClasses *copy = safe_malloc(sizeof(*copy));
+    return (TrieCharClasses *)memcpy(copy, classes, sizeof(*copy));
+}
+
+void
+triecharclasses_free(TrieCharClasses *classes)
+{
+    free(classes);
+}
+
+/*
+ * Sets the members of the set associated with ch, replacing the previous
+ * set.
+ */
+void
+triecharclasses_set(TrieCharClasses *classes, TRIECHAR ch,
+        const TRIECHAR *members, size_t num_members)
+{
+    unsigned char uch = (unsigned char)ch;
+    uint64_t *set = classes->members[uch];
+    for (int i = 0; i < TRIE_BITSET_WORDS; i++)
+        set[i] = 0;
+    for (size_t i = 0; i < num_members; i++){
+        unsigned char m = (unsigned char)members[i];
+        set[m >> 6] |= (uint64_t)1 << (m & 63);
+    }
+
+    /* update which characters match ch */
+    for (int other = 0; other < TRIE_NUM_CHARS; other++){
+        bool match = other == uch;
+        for (int i = 0; !match && i < TRIE_BITSET_WORDS; i++)
+            match = (set[i] & classes->members[other][i]) != 0;
+
+        uint64_t bit = (uint64_t)1 << (other & 63);
+        uint64_t bit_ch = (uint64_t)1 << (uch & 63);
+        if (match){
+            classes->matches[uch][other >> 6] |= bit;
+            classes->matches[other][uch >> 6] |= bit_ch;
+        }else{
+            classes->matches[uch][other >> 6] &= ~bit;
+            classes->matches[other][uch >> 6] &= ~bit_ch;
+        }
+    }
+}
+
 static TrieSearchResult *
 triesearchresult_new(const TrieNode *query, const TrieNode *target, int hd)
 {
@@ -313,11 +351,23 @@ triesearchresult_new(const TrieNode *query, const TrieNode *target, int hd)
     return result;
 }
 
+/*
+ * Creates a new node, reusing a node released to the pool of root if there is
+ * one.
+ */
 static TrieNode *
-trienode_new(TRIECHAR *key, TRIEVALUE *value, size_t keylen, TrieNode *parent,
-        TrieNode *sibling, TrieNode *child, TRIECHAR ch, int flags)
+trienode_new(TrieRoot *root, TRIECHAR *key, TRIEVALUE *value, size_t keylen,
+        TrieNode *parent, TrieNode *sibling, TrieNode *child, TRIECHAR ch,
+        int flags)
 {
-    TrieNode *node = safe_malloc(sizeof(*node));
+    TrieNode *node;
+    if (root != NULL && root->free_nodes != NULL){
+        node = root->free_nodes;
+        root->free_nodes = node->sibling;
+        flags |= TRIE_POOLED;
+    }else{
+        node = safe_malloc(sizeof(*node));
+    }
     node->item.key = key;
     node->item.value = value;
     node->item.keylen = keylen;
@@ -329,12 +379,23 @@ trienode_new(TRIECHAR *key, TRIEVALUE *value, size_t keylen, TrieNode *parent,
     return node;
 }
 
+/*
+ * Frees a node. Nodes that are part of a pool are released to the pool of
+ * root instead, or left alone if root is NULL.
+ */
 static void
-trienode_free(TrieNode *node, DeallocHandler dealloc)
+trienode_free(TrieRoot *root, TrieNode *node, DeallocHandler dealloc)
 {
     if (node != NULL){
         trieitem_free(&node->item, dealloc);
-        free(node);
+        if ((node->flags & TRIE_POOLED) == 0){
+            free(node);
+            if (root != NULL)
+                root->num_released++;
+        }else if (root != NULL){
+            node->sibling = root->free_nodes;
+            root->free_nodes = node;
+        }
     }
 }
 
@@ -352,7 +413,8 @@ trienode_get_child(const TrieNode *node, TRIECHAR ch)
  * it has no children.
  */
 static void
-trienode_remove_child(TrieNode *node, TRIECHAR ch, DeallocHandler dealloc)
+trienode_remove_child(TrieRoot *root, TrieNode *node, TRIECHAR ch,
+        DeallocHandler dealloc)
 {
     TrieNode *child = node->child;
     TrieNode *prev = NULL;
@@ -368,19 +430,234 @@ trienode_remove_child(TrieNode *node, TRIECHAR ch, DeallocHandler dealloc)
         if (prev != NULL)
             prev->sibling = child->sibling;
 
-        trienode_free(child, dealloc);
+        trienode_free(root, child, dealloc);
+    }
+}
+
+/*
+ * Unlinks child from the list of children of node. The child itself is not
+ * freed.
+ */
+static void
+trienode_unlink_child(TrieNode *node, TrieNode *child)
+{
+    if (node->child == child){
+        node->child = child->sibling;
+    }else{
+        TrieNode *prev = node->child;
+        while (prev != NULL && prev->sibling != child)
+            prev = prev->sibling;
+        if (prev != NULL)
+            prev->sibling = child->sibling;
+    }
+    child->sibling = NULL;
+}
+
+/*
+ * Drops the compiled form, the substring index, and the flat copies and
+ * split indexes of the keys of the trie, if any.
+ */
+static void
+trie_uncompile(TrieRoot *root)
+{
+    if (root->da != NULL){
+        root->memsize -= datrie_mem_usage(root->da);
+        datrie_free(root->da);
+        root->da = NULL;
+    }
+    if (root->si != NULL){
+        root->memsize -= substringindex_mem_usage(root->si);
+        substringindex_free(root->si);
+        root->si = NULL;
+    }
+    for (FlatKeys *fk = root->flat; fk != NULL; fk = fk->next)
+        root->memsize -= flatkeys_mem_usage(fk);
+    flatkeys_free(root->flat);
+    root->flat = NULL;
+    for (SplitIndex *si = root->split; si != NULL; si = si->next)
+        root->memsize -= splitindex_mem_usage(si);
+    splitindex_free(root->split);
+    root->split = NULL;
+}
+
+/*
+ * Records that nodes have been added to or removed from the trie. This
+ * invalidates any iterator created before the change, as well as the
+ * compiled form of the trie.
+ */
+static void
+trie_touch(TrieRoot *root)
+{
+    root->state_id++;
+    trie_uncompile(root);
+}
+
+/*
+ * Returns a copy of key with its characters in reverse order.
+ */
+static TRIECHAR *
+reverse_string(const TRIECHAR *key, size_t keylen)
+{
+    TRIECHAR *rev = safe_malloc(sizeof(*rev) * (keylen + 1));
+    for (size_t i = 0; i < keylen; i++)
+        rev[i] = key[keylen - 1 - i];
+    rev[keylen] = '\0';
+    return rev;
+}
+
+/*
+ * Adds item to the reverse of the trie, if it is maintained. Items of the
+ * reverse hold the item of the trie as their value, so keys and values are
+ * shared rather than copied.
+ */
+static void
+trie_reverse_add(TrieRoot *root, const TrieItem *item)
+{
+    if (root->reverse == NULL)
+        return;
+
+    TRIECHAR *rev = reverse_string(item->key, item->keylen);
+    trie_set_item(root->reverse, rev, item->keylen, (TRIEVALUE *)item, NULL);
+    free(rev);
+}
+
+/*
+ * Updates the structures derived from the items of the trie after item was
+ * added.
+ */
+static void
+trie_item_added(TrieRoot *root, const TrieItem *item)
+{
+    trie_reverse_add(root, item);
+    triecache_invalidate(root->cache, item->key, item->keylen);
+    if (root->stats != NULL)
+        triestats_add(root->stats, item);
+    if (root->delta != NULL)
+        trie_set_item(root->delta, item->key, item->keylen, NULL, NULL);
+}
+
+/*
+ * Updates the structures derived from the items of the trie before item is
+ * removed. Must be called while the key of item is still set.
+ */
+static void
+trie_item_removed(TrieRoot *root, const TrieItem *item)
+{
+    if (item->key == NULL)
+        return;
+
+    triecache_invalidate(root->cache, item->key, item->keylen);
+    if (root->stats != NULL)
+        triestats_remove(root->stats, item);
+    if (root->delta != NULL)
+        trie_del_item(root->delta, item->key, item->keylen, NULL);
+    if (root->reverse != NULL){
+        TRIECHAR *rev = reverse_string(item->key, item->keylen);
+        trie_del_item(root->reverse, rev, item->keylen, NULL);
+        free(rev);
+    }
+}
+
+static void
+trie_reverse_add_node(TrieRoot *root, const TrieNode *node)
+{
+    for (; node != NULL; node = node->sibling){
+        if (node->item.key != NULL)
+            trie_reverse_add(root, &node->item);
+        trie_reverse_add_node(root, node->child);
     }
 }
 
+/*
+ * (Re)builds the reverse of the trie from all of its items.
+ */
+static void
+trie_build_reverse(TrieRoot *root)
+{
+    trie_free(root->reverse, NULL);
+    root->reverse = trie_new();
+    if (root->item.key != NULL)
+        trie_reverse_add(root, &root->item);
+    trie_reverse_add_node(root, root->child);
+}
+
+/*
+ * Starts maintaining a mirror of the trie in which every key is reversed,
+ * used by trie_longest_suffix and trie_endswith. The mirror is kept up to
+ * date as items are added or removed, until the trie is freed.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_enable_reverse(TrieRoot *root)
+{
+    if (root == NULL)
+        return -1;
+
+    if (root->reverse == NULL)
+        trie_build_reverse(root);
+    return root->reverse != NULL ? 0 : -1;
+}
+
+bool
+trie_has_reverse(const TrieRoot *root)
+{
+    return root != NULL && root->reverse != NULL;
+}
+
+/*
+ * Makes a checkpoint: from now on, keys added to the trie are tracked as new
+ * until trieiter_deltapairs has gone through their pairs. Keys tracked since
+ * an earlier checkpoint are forgotten.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_checkpoint(TrieRoot *root)
+{
+    if (root == NULL)
+        return -1;
+
+    trie_free(root->delta, NULL);
+    root->delta = trie_new();
+    return root->delta != NULL ? 0 : -1;
+}
+
+/*
+ * Sets the maximum number of neighbor queries whose results are cached,
+ * dropping all cached results. A capacity of 0 disables the cache.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_set_cache_size(TrieRoot *root, size_t capacity)
+{
+    if (root == NULL)
+        return -1;
+
+    triecache_free(root->cache);
+    root->cache = triecache_new(capacity);
+    return 0;
+}
+
+void
+trie_cache_stats(const TrieRoot *root, TrieCacheStats *stats)
+{
+    if (root == NULL || stats == NULL)
+        return;
+
+    triecache_stats(root->cache, stats);
+}
+
 static const TrieNode *
-trie_get_node(const TrieRoot *root, const TRIECHAR *key)
+trie_get_node(const TrieRoot *root, const TRIECHAR *key, size_t keylen)
 {
     if (root == NULL)
         return NULL;
 
     TrieNode *node = (TrieNode *)root;
-    for(const TRIECHAR *ch = key; node != NULL && *ch != '\0'; ch++)
-        node = trienode_get_child(node, *ch);
+    for(size_t i = 0; node != NULL && i < keylen; i++)
+        node = trienode_get_child(node, key[i]);
 
     return node;
 }
@@ -404,26 +681,41 @@ trie_num_items(const TrieRoot *root)
 size_t
 trie_mem_usage(const TrieRoot *root)
 {
-    return root->memsize;
+    size_t memsize = root->memsize + triecache_mem_usage(root->cache)
+        + triestats_mem_usage(root->stats);
+    if (root->reverse != NULL)
+        memsize += root->reverse->memsize;
+    if (root->delta != NULL)
+        memsize += root->delta->memsize;
+    return memsize;
 }
 
 bool
-trie_has_key(const TrieRoot *root, const TRIECHAR *key)
+trie_has_key(const TrieRoot *root, const TRIECHAR *key, size_t keylen)
 {
-    const TrieNode *node = trie_get_node(root, key);
+    if (root != NULL && root->da != NULL)
+        return datrie_get_item(root->da, key, keylen) != NULL;
+
+    const TrieNode *node = trie_get_node(root, key, keylen);
     return node != NULL && node->item.key != NULL;
 }
 
 bool
-trie_has_node(const TrieRoot *root, const TRIECHAR *key)
+trie_has_node(const TrieRoot *root, const TRIECHAR *key, size_t keylen)
 {
-    return trie_get_node(root, key) != NULL;
+    if (root != NULL && root->da != NULL)
+        return datrie_has_node(root->da, key, keylen);
+
+    return trie_get_node(root, key, keylen) != NULL;
 }
 
 const TrieItem *
-trie_get_item(const TrieRoot *root, const TRIECHAR *key)
+trie_get_item(const TrieRoot *root, const TRIECHAR *key, size_t keylen)
 {
-    const TrieNode *node = trie_get_node(root, key);
+    if (root != NULL && root->da != NULL)
+        return datrie_get_item(root->da, key, keylen);
+
+    const TrieNode *node = trie_get_node(root, key, keylen);
     if (node == NULL || node->item.key == NULL)
         return NULL;
     
@@ -431,18 +723,21 @@ trie_get_item(const TrieRoot *root, const TRIECHAR *key)
 }
 
 const TrieItem *
-trie_longest_prefix(const TrieRoot *root, const TRIECHAR *key)
+trie_longest_prefix(const TrieRoot *root, const TRIECHAR *key, size_t keylen)
 {
     if (root == NULL)
         return NULL;
 
+    if (root->da != NULL)
+        return datrie_longest_prefix(root->da, key, keylen);
+
     TrieNode *node = (TrieNode *)root;
     const TrieItem *res = NULL;
     if (root->item.key != NULL)
         res = &root->item;
 
-    for(const TRIECHAR *ch = key; node != NULL && *ch != '\0'; ch++){
-        node = trienode_get_child(node, *ch);
+    for(size_t i = 0; node != NULL && i < keylen; i++){
+        node = trienode_get_child(node, key[i]);
         if (node != NULL && node->item.key != NULL)
             res = &node->item;
     }
@@ -450,265 +745,1649 @@ trie_longest_prefix(const TrieRoot *root, const TRIECHAR *key)
     return res;
 }
 
-TrieRoot *
-trie_new()
+/*
+ * Finds the longest key that matches the beginning of key with at most maxhd
+ * mismatches. Of keys of equal length, the one with the fewest mismatches is
+ * returned.
+ *
+ * The path of key is explored depth-first with a mismatch budget, as in
+ * trieiter_neighbors_next, skipping branches that can no longer improve on
+ * the best key found so far.
+ *
+ * classes: character equivalences, may be NULL.
+ * hd: if not NULL, set to the Hamming distance between the returned key and
+ * the beginning of key.
+ *
+ * @return: the item of the key, or NULL if there is none.
+ */
+const TrieItem *
+trie_longest_prefix_approx(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes, int *hd)
 {
-    TrieRoot *root = safe_malloc(sizeof(*root));
+    if (root == NULL || (key == NULL && keylen > 0) || maxhd < 0)
+        return NULL;
 
-    /* TrieNode specific fields */
-    root->item.key = NULL;
-    root->item.value = NULL;
-    root->item.keylen = 0;
-    root->parent = NULL;
-    root->sibling = NULL;
-    root->child = NULL;
-    root->ch = '\0';
-    root->flags = 0;
+    TrieIter *it = trieiter_new((TrieRoot *)root, 1, maxhd, 0, 0, NULL, NULL,
+            false);
+    if (it == NULL)
+        return NULL;
 
-    /* Trie (root) specific fields */
-    root->num_nodes = 0;
-    root->num_items = 0;
-    root->memsize = sizeof(*root);
-    root->state_id = 0;
-    root->dirty_iter = NULL;
-    return root;
+    const TrieItem *best = NULL;
+    int best_hd = 0;
+    trieiter_push_state(it, (TrieNode *)root, NULL, 0, 0);
+    TrieIterState *state;
+    while ((state = trieiter_pop_state(it)) != NULL){
+        TrieNode *node = state->node;
+        int node_hd = state->hd;
+        size_t depth = state->depth;
+
+        if (node->item.key != NULL && (best == NULL ||
+                    depth > best->keylen ||
+                    (depth == best->keylen && node_hd < best_hd))){
+            best = &node->item;
+            best_hd = node_hd;
+        }
+
+        /* nothing below node can be longer than key, so stop if the best
+         * key is as long as key and at least as close */
+        if (depth == keylen || (best != NULL && best->keylen == keylen &&
+                    best_hd <= node_hd))
+            continue;
+
+        for (TrieNode *child = node->child; child != NULL;
+                child = child->sibling){
+            if (triecharclasses_match(classes, child->ch, key[depth]))
+                trieiter_push_state(it, child, NULL, node_hd, depth + 1);
+            else if (node_hd < maxhd)
+                trieiter_push_state(it, child, NULL, node_hd + 1, depth + 1);
+        }
+    }
+    trieiter_free(it);
+
+    if (hd != NULL)
+        *hd = best_hd;
+    return best;
 }
 
 /*
- * Free memory of a trie.
+ * Finds the key of length keylen closest to key, with at most maxhd
+ * mismatches. The search is depth-first, trying matching characters before
+ * mismatching ones, and the mismatch budget shrinks to below the distance of
+ * the best key found so far, so it ends as soon as an equal key is found.
  *
- * node: this node and everything below it will be removed from the trie.
- * dealloc: function used to deallocate memory of any non-NULL value a trie
- * node may reference.
+ * @return: the item of the key, or NULL if there is none.
  */
-static void
-_trie_free(TrieNode *node, DeallocHandler dealloc)
+static const TrieItem *
+trie_closest_item(const TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        int maxhd, const TrieCharClasses *classes, int *hd)
 {
-    if (node == NULL)
-        return;
+    TrieIter *it = trieiter_new((TrieRoot *)root, 1, maxhd, 0, 0, NULL, NULL,
+            false);
+    if (it == NULL)
+        return NULL;
 
-    if (node->child != NULL)
-        _trie_free(node->child, dealloc);
+    const TrieItem *best = NULL;
+    int bound = maxhd;
+    trieiter_push_state(it, (TrieNode *)root, NULL, 0, 0);
+    TrieIterState *state;
+    while (bound >= 0 && (state = trieiter_pop_state(it)) != NULL){
+        TrieNode *node = state->node;
+        int node_hd = state->hd;
+        size_t depth = state->depth;
 
-    if (node->sibling != NULL)
-        _trie_free(node->sibling, dealloc);
+        if (node_hd > bound)
+            continue;
+
+        if (depth == keylen){
+            if (node->item.key != NULL){
+                best = &node->item;
+                *hd = node_hd;
+                bound = node_hd - 1;
+            }
+            continue;
+        }
 
-    trienode_free(node, dealloc);
+        /* matching children are pushed last, so they are explored first */
+        TrieNode *child;
+        if (node_hd < bound)
+            for (child = node->child; child != NULL; child = child->sibling)
+                if (!triecharclasses_match(classes, child->ch, key[depth]))
+                    trieiter_push_state(it, child, NULL, node_hd + 1,
+                            depth + 1);
+        for (child = node->child; child != NULL; child = child->sibling)
+            if (triecharclasses_match(classes, child->ch, key[depth]))
+                trieiter_push_state(it, child, NULL, node_hd, depth + 1);
+    }
+    trieiter_free(it);
+    return best;
 }
 
-void
-trie_free(TrieRoot *root, DeallocHandler dealloc)
+/*
+ * Counts the keys depth levels below node, apart from the item skip, stopping
+ * at limit.
+ */
+static size_t
+trienode_count_keys(const TrieNode *node, size_t depth, const TrieItem *skip,
+        size_t limit)
 {
-    _trie_free((TrieNode *)root, dealloc);
+    if (depth == 0)
+        return node->item.key != NULL && &node->item != skip;
+
+    size_t n = 0;
+    for (const TrieNode *child = node->child; child != NULL && n < limit;
+            child = child->sibling)
+        n += trienode_count_keys(child, depth - 1, skip, limit - n);
+    return n;
 }
 
 /*
- * Insert key into the trie and associate it with the provided value.
- *
- * root: root of the trie.
- * key: key to insert.
- * value: value to associate key with in the trie.
- * dealloc: handler to use to free memory of any value with which the key 
- * might already be associated. NULL will be interpreted to mean to not
- * deallocate memory of a pre-existing value.
+ * Counts the keys that would be returned by trieiter_neighbors for key,
+ * stopping once limit keys are found. key itself need not be in the trie.
  *
- * @return: 0 means successful insertion of the key, and a non-zero value
- * means insertion failed. 
+ * Branches are followed as in trieiter_neighbors_next, but without creating
+ * results. Once the remaining mismatch budget covers the rest of key, every
+ * key below a node is a neighbor, so they are counted without comparing
+ * characters.
  */
-int
-trie_set_item(TrieRoot *root, const TRIECHAR *key, TRIEVALUE *value,
-        DeallocHandler dealloc)
+static size_t
+trie_count_neighbors_upto(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes,
+        size_t limit)
 {
-    if (root == NULL || key == NULL)
-        return -1;
+    TrieIter *it = trieiter_new((TrieRoot *)root, 1, maxhd, 0, 0, NULL, NULL,
+            false);
+    if (it == NULL)
+        return 0;
+
+    /* the query itself is not a neighbor */
+    const TrieItem *self = trie_get_item(root, key, keylen);
+    size_t n = 0;
+    trieiter_push_state(it, (TrieNode *)root, NULL, 0, 0);
+    TrieIterState *state;
+    while (n < limit && (state = trieiter_pop_state(it)) != NULL){
+        TrieNode *node = state->node;
+        int hd = state->hd;
+        size_t depth = state->depth;
+
+        if ((size_t)(maxhd - hd) >= keylen - depth){
+            n += trienode_count_keys(node, keylen - depth, self, limit - n);
+            continue;
+        }
 
-    TrieNode *node = (TrieNode *)root;
-    const TRIECHAR *ch;
-    for (ch = key; *ch != '\0'; ch++){
-        TrieNode *child = trienode_get_child(node, *ch);
-        if (child == NULL){
-            node->child = trienode_new(
-                    NULL,           /* key */
-                    NULL,           /* value */
-                    0,              /* keylen */
-                    node,           /* parent */
-                    node->child,    /* sibling */
-                    NULL,           /* child */
-                    *ch,
-                    0               /* flags */
-                    );
-            child = node->child;
-            root->num_nodes++;
-            root->memsize += sizeof(*child);
+        for (TrieNode *child = node->child; child != NULL;
+                child = child->sibling){
+            if (triecharclasses_match(classes, child->ch, key[depth]))
+                trieiter_push_state(it, child, NULL, hd, depth + 1);
+            else if (hd < maxhd)
+                trieiter_push_state(it, child, NULL, hd + 1, depth + 1);
         }
-        node = child;
+    }
+    trieiter_free(it);
+    return n;
+}
+
+/*
+ * Checks if any key would be returned by trieiter_neighbors for key,
+ * stopping at the first one found. key itself need not be in the trie.
+ */
+bool
+trie_has_neighbor(const TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        int maxhd, const TrieCharClasses *classes)
+{
+    if (root == NULL || key == NULL || maxhd < 0)
+        return false;
+
+    return trie_count_neighbors_upto(root, key, keylen, maxhd, classes, 1)
+        > 0;
+}
+
+/*
+ * Counts the keys that would be returned by trieiter_neighbors for key.
+ * key itself need not be in the trie.
+ */
+size_t
+trie_count_neighbors(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes)
+{
+    if (root == NULL || key == NULL || maxhd < 0)
+        return 0;
+
+    return trie_count_neighbors_upto(root, key, keylen, maxhd, classes,
+            SIZE_MAX);
+}
+
+/*
+ * Adds key to the trie unless a key of the same length is within maxhd
+ * mismatches of it (including key itself), checking for such a key and
+ * inserting in one call.
+ *
+ * classes: character equivalences, may be NULL.
+ * blocker: if not NULL, set to the closest key within maxhd, or NULL if key
+ * was added.
+ * hd: if not NULL, set to the Hamming distance of blocker.
+ *
+ * @return: 0 if key was added, 1 if it was not because of blocker, -1 on
+ * error.
+ */
+int
+trie_insert_if_isolated(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        TRIEVALUE *value, int maxhd, const TrieCharClasses *classes,
+        DeallocHandler dealloc, const TrieItem **blocker, int *hd)
+{
+    if (root == NULL || key == NULL || maxhd < 0)
+        return -1;
+
+    int closest_hd = 0;
+    const TrieItem *closest = trie_closest_item(root, key, keylen, maxhd,
+            classes, &closest_hd);
+    if (blocker != NULL)
+        *blocker = closest;
+    if (hd != NULL)
+        *hd = closest_hd;
+    if (closest != NULL)
+        return 1;
+
+    return trie_set_item(root, key, keylen, value, dealloc);
+}
+
+/*
+ * Finds all keys that are a prefix of key (including key itself), in a
+ * single descent along the path of key.
+ *
+ * items: receives the items of the keys, shortest first. It needs room for
+ * keylen + 1 items.
+ *
+ * @return: number of items found.
+ */
+size_t
+trie_prefixes(const TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        const TrieItem **items)
+{
+    if (root == NULL || items == NULL)
+        return 0;
+
+    if (root->da != NULL)
+        return datrie_prefixes(root->da, key, keylen, items);
+
+    const TrieNode *node = (const TrieNode *)root;
+    size_t n = 0;
+    if (root->item.key != NULL)
+        items[n++] = &root->item;
+
+    for(size_t i = 0; node != NULL && i < keylen; i++){
+        node = trienode_get_child(node, key[i]);
+        if (node != NULL && node->item.key != NULL)
+            items[n++] = &node->item;
+    }
+
+    return n;
+}
+
+/*
+ * Splits text into keys from left to right, each time taking the longest key
+ * that is a prefix of the rest of the text (see trie_longest_prefix), and
+ * calling handler for it with the position where it starts. Characters at
+ * which no key starts are skipped. The empty key is never used.
+ *
+ * @return: 0 on success, -1 on error, or the first non-zero value returned
+ * by handler.
+ */
+int
+trie_segment(const TrieRoot *root, const TRIECHAR *text, size_t len,
+        TrieScanHandler handler, void *arg)
+{
+    if (root == NULL || (text == NULL && len > 0) || handler == NULL)
+        return -1;
+
+    size_t pos = 0;
+    while (pos < len){
+        const TrieItem *item = trie_longest_prefix(root, text + pos,
+                len - pos);
+        if (item == NULL || item->keylen == 0){
+            pos++;
+            continue;
+        }
+        int retval = handler(pos, 0, item, arg);
+        if (retval != 0)
+            return retval;
+        pos += item->keylen;
+    }
+    return 0;
+}
+
+/*
+ * Finds the longest key that is a suffix of key, using the reverse of the
+ * trie. NULL is returned if there is none, or if the reverse is not
+ * maintained.
+ */
+const TrieItem *
+trie_longest_suffix(const TrieRoot *root, const TRIECHAR *key,
+        size_t keylen)
+{
+    if (root == NULL || root->reverse == NULL || key == NULL)
+        return NULL;
+
+    TRIECHAR *rev = reverse_string(key, keylen);
+    const TrieItem *item = trie_longest_prefix(root->reverse, rev, keylen);
+    free(rev);
+    return item != NULL ? (const TrieItem *)item->value : NULL;
+}
+
+/* Reports the items of the trie referenced from node and below */
+static int
+trie_endswith_report(const TrieNode *node, size_t len, int hd,
+        TrieScanHandler handler, void *arg)
+{
+    if (node->item.key != NULL){
+        const TrieItem *item = (const TrieItem *)node->item.value;
+        int retval = handler(item->keylen - len, hd, item, arg);
+        if (retval != 0)
+            return retval;
+    }
+    for (const TrieNode *child = node->child; child != NULL;
+            child = child->sibling){
+        int retval = trie_endswith_report(child, len, hd, handler, arg);
+        if (retval != 0)
+            return retval;
+    }
+    return 0;
+}
+
+/* Matches the reversed string rev against the reverse of the trie */
+static int
+trie_endswith_node(const TrieNode *node, const TRIECHAR *rev, size_t len,
+        size_t depth, int hd, int maxhd, const TrieCharClasses *classes,
+        TrieScanHandler handler, void *arg)
+{
+    if (depth == len)
+        return trie_endswith_report(node, len, hd, handler, arg);
+
+    for (const TrieNode *child = node->child; child != NULL;
+            child = child->sibling){
+        int child_hd = hd;
+        if (!triecharclasses_match(classes, child->ch, rev[depth]))
+            child_hd++;
+        if (child_hd > maxhd)
+            continue;
+        int retval = trie_endswith_node(child, rev, len, depth + 1,
+                child_hd, maxhd, classes, handler, arg);
+        if (retval != 0)
+            return retval;
+    }
+    return 0;
+}
+
+/*
+ * Finds all keys whose last len characters differ by at most maxhd
+ * characters from s, calling handler for each of them with pos set to the
+ * position in the key where the match starts. The reverse of the trie is
+ * walked from the end of s, so branches are abandoned as soon as maxhd
+ * mismatches are used up.
+ *
+ * @return: 0 on success, -1 on error (including the reverse of the trie not
+ * being maintained), or the first non-zero value returned by handler.
+ */
+int
+trie_endswith(const TrieRoot *root, const TRIECHAR *s, size_t len,
+        int maxhd, const TrieCharClasses *classes, TrieScanHandler handler,
+        void *arg)
+{
+    if (root == NULL || root->reverse == NULL || (s == NULL && len > 0) ||
+            maxhd < 0 || handler == NULL)
+        return -1;
+
+    TRIECHAR *rev = reverse_string(s, len);
+    int retval = trie_endswith_node((const TrieNode *)root->reverse, rev,
+            len, 0, 0, maxhd, classes, handler, arg);
+    free(rev);
+    return retval;
+}
+
+/*
+ * Builds the substring index of the trie if it is not already built.
+ */
+static int
+trie_build_substring_index(TrieRoot *root)
+{
+    if (root->si == NULL){
+        root->si = substringindex_new(root);
+        if (root->si == NULL)
+            return -1;
+        root->memsize += substringindex_mem_usage(root->si);
+    }
+    return 0;
+}
+
+/*
+ * Reports the empty key, if there is one, when s is empty too. It has no
+ * suffixes in the substring index, and comes before any other key.
+ */
+static int
+trie_empty_substring(const TrieRoot *root, size_t len,
+        TrieScanHandler handler, void *arg)
+{
+    if (len > 0 || root->item.key == NULL)
+        return 0;
+    return handler(0, 0, &root->item, arg);
+}
+
+/*
+ * Finds all keys containing s, calling handler once for each of them with
+ * pos set to the first position of s in the key. Every key contains the
+ * empty string, including the empty key.
+ *
+ * The keys are looked up in a suffix array of all keys, which is built on
+ * first use and dropped as soon as keys are added or removed.
+ *
+ * @return: 0 on success, -1 on error, or the first non-zero value returned
+ * by handler.
+ */
+int
+trie_find_substring(TrieRoot *root, const TRIECHAR *s, size_t len,
+        TrieScanHandler handler, void *arg)
+{
+    if (root == NULL || (s == NULL && len > 0) || handler == NULL)
+        return -1;
+
+    if (trie_build_substring_index(root) != 0)
+        return -1;
+
+    int retval = trie_empty_substring(root, len, handler, arg);
+    if (retval != 0)
+        return retval;
+    return substringindex_find(root->si, s, len, handler, arg);
+}
+
+/*
+ * Finds all keys with a substring within maxhd mismatches of s, calling
+ * handler once for each of them with the smallest Hamming distance found and
+ * the position of that substring in the key.
+ *
+ * @return: 0 on success, -1 on error, or the first non-zero value returned
+ * by handler.
+ */
+int
+trie_substring_neighbors(TrieRoot *root, const TRIECHAR *s, size_t len,
+        int maxhd, TrieScanHandler handler, void *arg)
+{
+    if (root == NULL || (s == NULL && len > 0) || maxhd < 0 ||
+            handler == NULL)
+        return -1;
+
+    if (trie_build_substring_index(root) != 0)
+        return -1;
+
+    int retval = trie_empty_substring(root, len, handler, arg);
+    if (retval != 0)
+        return retval;
+    return substringindex_neighbors(root->si, s, len, maxhd, handler, arg);
+}
+
+TrieRoot *
+trie_new()
+{
+    TrieRoot *root = safe_malloc(sizeof(*root));
+
+    /* TrieNode specific fields */
+    root->item.key = NULL;
+    root->item.value = NULL;
+    root->item.keylen = 0;
+    root->parent = NULL;
+    root->sibling = NULL;
+    root->child = NULL;
+    root->ch = '\0';
+    root->flags = 0;
+
+    /* Trie (root) specific fields */
+    root->num_nodes = 0;
+    root->num_items = 0;
+    root->memsize = sizeof(*root);
+    root->state_id = 0;
+    root->dirty_iter = NULL;
+    root->da = NULL;
+    root->pools = NULL;
+    root->free_nodes = NULL;
+    root->num_released = 0;
+    root->si = NULL;
+    root->reverse = NULL;
+    root->cache = NULL;
+    root->delta = NULL;
+    root->stats = NULL;
+    root->flat = NULL;
+    root->split = NULL;
+    return root;
+}
+
+/*
+ * Free memory of a trie.
+ *
+ * node: this node and everything below it will be removed from the trie.
+ * dealloc: function used to deallocate memory of any non-NULL value a trie
+ * node may reference.
+ */
+static void
+_trie_free(TrieNode *node, DeallocHandler dealloc)
+{
+    if (node == NULL)
+        return;
+
+    if (node->child != NULL)
+        _trie_free(node->child, dealloc);
+
+    if (node->sibling != NULL)
+        _trie_free(node->sibling, dealloc);
+
+    trienode_free(NULL, node, dealloc);
+}
+
+void
+trie_free(TrieRoot *root, DeallocHandler dealloc)
+{
+    if (root == NULL)
+        return;
+
+    datrie_free(root->da);
+    substringindex_free(root->si);
+    trie_free(root->reverse, NULL);
+    triecache_free(root->cache);
+    trie_free(root->delta, NULL);
+    triestats_free(root->stats);
+    flatkeys_free(root->flat);
+    splitindex_free(root->split);
+    ListNode *pools = root->pools;
+    _trie_free((TrieNode *)root, dealloc);
+    void *pool;
+    while ((pool = stack_pop(&pools)) != NULL)
+        free(pool);
+}
+
+/*
+ * Compiles the trie into a double-array, which is used instead of the nodes
+ * for looking up keys and prefixes until nodes are added to or removed from
+ * the trie. Compiling an already compiled trie does nothing.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_compile(TrieRoot *root)
+{
+    if (root == NULL)
+        return -1;
+
+    if (root->da == NULL){
+        root->da = datrie_new(root);
+        if (root->da == NULL)
+            return -1;
+        root->memsize += datrie_mem_usage(root->da);
+    }
+    return 0;
+}
+
+bool
+trie_is_compiled(const TrieRoot *root)
+{
+    return root != NULL && root->da != NULL;
+}
+
+/*
+ * Finds all occurrences of keys in text in a single pass (Aho-Corasick),
+ * calling handler for each of them. Overlapping occurrences are all
+ * reported, in order of their end position.
+ *
+ * The trie is compiled if it is not already, and the failure links of the
+ * automaton are added to the compiled form, so they are built once and
+ * dropped along with it as soon as keys are added or removed.
+ *
+ * @return: 0 on success, -1 on error, or the first non-zero value returned
+ * by handler.
+ */
+int
+trie_scan(TrieRoot *root, const TRIECHAR *text, size_t len,
+        TrieScanHandler handler, void *arg)
+{
+    if (root == NULL || (text == NULL && len > 0) || handler == NULL)
+        return -1;
+
+    if (trie_compile(root) != 0)
+        return -1;
+
+    size_t memsize = datrie_mem_usage(root->da);
+    datrie_build_links(root->da, root);
+    root->memsize += datrie_mem_usage(root->da) - memsize;
+
+    return datrie_scan(root->da, text, len, handler, arg);
+}
+
+/* A window of the text being matched by scan_approx, see below */
+struct ScanWindow {
+    const TrieNode *node;   /* node reached by the window so far */
+    int hd;
+    size_t pos;             /* start of the window in the text */
+};
+
+struct ScanWindows {
+    struct ScanWindow *windows;
+    size_t len;
+    size_t size;
+};
+
+static void
+scanwindows_add(struct ScanWindows *sw, const TrieNode *node, int hd,
+        size_t pos)
+{
+    if (sw->len == sw->size){
+        sw->size = sw->size > 0 ? 2 * sw->size : 64;
+        sw->windows = safe_realloc(sw->windows,
+                sizeof(*sw->windows) * sw->size);
+    }
+    struct ScanWindow *w = &sw->windows[sw->len++];
+    w->node = node;
+    w->hd = hd;
+    w->pos = pos;
+}
+
+/*
+ * Finds all substrings of text that are within maxhd mismatches of a key,
+ * calling handler for each of them in order of their end position, and of
+ * their start position for the same end. Matches with 0 mismatches are
+ * included, and the empty key occurs at every position from 0 to len, as in
+ * trie_scan.
+ *
+ * The text is read in a single pass. Every window of the text that is still
+ * within maxhd of the path to some node is kept, along with that node, as
+ * in the breadth-first search of neighbors. Each character of the text
+ * advances all of these windows at once, to the children of their nodes
+ * that keep them within maxhd, after which a new window starts at the next
+ * position. The children of the nodes of the next step are prefetched while
+ * the rest of the current step is done, so the memory accesses of all
+ * windows overlap.
+ *
+ * classes: character equivalences, may be NULL.
+ *
+ * @return: 0 on success, -1 on error, or the first non-zero value returned
+ * by handler.
+ */
+int
+trie_scan_approx(const TrieRoot *root, const TRIECHAR *text, size_t len,
+        int maxhd, const TrieCharClasses *classes, TrieScanHandler handler,
+        void *arg)
+{
+    if (root == NULL || (text == NULL && len > 0) || handler == NULL ||
+            maxhd < 0)
+        return -1;
+
+    struct ScanWindows cur = {NULL, 0, 0}, next = {NULL, 0, 0};
+    const TrieItem *empty = root->item.key != NULL ? &root->item : NULL;
+    int retval = empty != NULL ? handler(0, 0, empty, arg) : 0;
+    for (size_t i = 0; i < len && retval == 0; i++){
+        TRIECHAR ch = text[i];
+        scanwindows_add(&cur, (const TrieNode *)root, 0, i);
+        next.len = 0;
+        for (size_t j = 0; j < cur.len && retval == 0; j++){
+            const struct ScanWindow *w = &cur.windows[j];
+            const TrieNode *child = w->node->child;
+            for (; child != NULL && retval == 0; child = child->sibling){
+                int hd = w->hd + !triecharclasses_match(classes, child->ch,
+                        ch);
+                if (hd > maxhd)
+                    continue;
+                if (child->item.key != NULL)
+                    retval = handler(w->pos, hd, &child->item, arg);
+                if (child->child != NULL){
+                    trienode_prefetch(child->child);
+                    scanwindows_add(&next, child, hd, w->pos);
+                }
+            }
+        }
+        if (empty != NULL && retval == 0)
+            retval = handler(i + 1, 0, empty, arg);
+        struct ScanWindows tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+
+    free(cur.windows);
+    free(next.windows);
+    return retval;
+}
+
+/*
+ * Moves the children of old_parent, and everything below them, into pool.
+ * The children of a node are placed next to each other, followed by the
+ * subtrees of the children in turn. next counts the nodes taken from pool.
+ *
+ * The items of the nodes are moved along with them. Old nodes that are not
+ * part of a pool are freed.
+ */
+static void
+trie_relayout_children(TrieNode *old_parent, TrieNode *new_parent,
+        TrieNode *pool, size_t *next)
+{
+    TrieNode *child = old_parent->child;
+    size_t num_children = 0;
+    for (TrieNode *c = child; c != NULL; c = c->sibling)
+        num_children++;
+
+    if (num_children == 0)
+        return;
+
+    TrieNode *block = pool + *next;
+    *next += num_children;
+    new_parent->child = block;
+
+    for (size_t i = 0; child != NULL; i++){
+        TrieNode *sibling = child->sibling;
+        block[i] = *child;
+        block[i].parent = new_parent;
+        block[i].sibling = i + 1 < num_children ? &block[i + 1] : NULL;
+        block[i].flags |= TRIE_POOLED;
+        trie_relayout_children(child, &block[i], pool, next);
+        if ((child->flags & TRIE_POOLED) == 0)
+            free(child);
+        child = sibling;
+    }
+}
+
+/*
+ * Moves all nodes of the trie into a single, newly allocated pool, in
+ * depth-first order with the children of each node stored next to each
+ * other. Following a path from the root, or scanning the children of a node,
+ * then touches far fewer memory pages than with nodes scattered over the
+ * heap. Memory of the old nodes is released.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_relayout(TrieRoot *root)
+{
+    if (root == NULL)
+        return -1;
+
+    TrieNode *pool = NULL;
+    size_t next = 0;
+    if (root->num_nodes > 0)
+        pool = safe_malloc(sizeof(*pool) * root->num_nodes);
+    trie_relayout_children((TrieNode *)root, (TrieNode *)root, pool, &next);
+
+    void *old_pool;
+    while ((old_pool = stack_pop(&root->pools)) != NULL)
+        free(old_pool);
+    root->free_nodes = NULL;
+    if (pool != NULL)
+        stack_push(&root->pools, pool);
+
+    /* all nodes moved, so iterators and the compiled trie are invalid, and
+     * the reverse and the cache refer to the old items */
+    trie_touch(root);
+    if (root->reverse != NULL)
+        trie_build_reverse(root);
+    triecache_clear(root->cache);
+    return 0;
+}
+
+/*
+ * Rebuilds the node storage of the trie contiguously (see trie_relayout),
+ * dropping the space of nodes that were removed from the trie but still
+ * held on to for reuse. Freed memory is returned to the operating system
+ * where the C library supports it.
+ *
+ * @return: number of bytes of node storage reclaimed, that is of the nodes
+ * removed since the last compaction: those released to the pool and those
+ * freed one by one, whose memory the C library holds on to until trimmed.
+ */
+size_t
+trie_compact(TrieRoot *root)
+{
+    if (root == NULL)
+        return 0;
+
+    size_t num_free = root->num_released;
+    for (TrieNode *node = root->free_nodes; node != NULL;
+            node = node->sibling)
+        num_free++;
+
+    trie_relayout(root);
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+
+    root->num_released = 0;
+    return num_free * sizeof(TrieNode);
+}
+
+/*
+ * Insert key into the trie and associate it with the provided value.
+ *
+ * root: root of the trie.
+ * key: key to insert.
+ * value: value to associate key with in the trie.
+ * dealloc: handler to use to free memory of any value with which the key 
+ * might already be associated. NULL will be interpreted to mean to not
+ * deallocate memory of a pre-existing value.
+ *
+ * @return: 0 means successful insertion of the key, and a non-zero value
+ * means insertion failed. 
+ */
+int
+trie_set_item(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        TRIEVALUE *value, DeallocHandler dealloc)
+{
+    if (root == NULL || key == NULL)
+        return -1;
+
+    TrieNode *node = (TrieNode *)root;
+    for (size_t i = 0; i < keylen; i++){
+        TrieNode *child = trienode_get_child(node, key[i]);
+        if (child == NULL){
+            node->child = trienode_new(
+                    root,
+                    NULL,           /* key */
+                    NULL,           /* value */
+                    0,              /* keylen */
+                    node,           /* parent */
+                    node->child,    /* sibling */
+                    NULL,           /* child */
+                    key[i],
+                    0               /* flags */
+                    );
+            child = node->child;
+            root->num_nodes++;
+            root->memsize += sizeof(*child);
+        }
+        node = child;
     }
 
-    if (node->item.key == NULL){
+    bool is_new = node->item.key == NULL;
+    if (is_new){
         root->num_items++;
         /* update state_id because one or more nodes have been added */
-        root->state_id++;
+        trie_touch(root);
     }else{
         root->memsize -= sizeof(TRIECHAR) * (node->item.keylen + 1);
         trieitem_free(&node->item, dealloc);
     }
 
-    size_t keylen = ch - key;
-    node->item.key = duplicate_string(key, keylen + 1);
+    node->item.key = duplicate_string(key, keylen);
     node->item.keylen = keylen;
     node->item.value = value;
 
     root->memsize += sizeof(TRIECHAR) * (keylen + 1);
+    if (is_new)
+        trie_item_added(root, &node->item);
+
+    return 0;
+}
+
+/*
+ * Removes node and any of its ancestors that no longer lead up to an item.
+ */
+static void
+trie_prune(TrieRoot *root, TrieNode *node, DeallocHandler dealloc)
+{
+    TrieNode *parent;
+
+    while (node != (TrieNode *)root && node->child == NULL &&
+            node->item.key == NULL){
+        parent = node->parent;
+        trienode_remove_child(root, parent, node->ch, dealloc);
+        root->memsize -= sizeof(*node);
+        node = parent;
+        root->num_nodes--;
+    }
+}
+
+/*
+ * Removes key from the trie, including any nodes leading up to it unless
+ * this would break the trie for other strings.
+ *
+ * 0 is returned in case of successful removal of the string from the trie.
+ */
+int
+trie_del_item(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        DeallocHandler dealloc)
+{
+    if (root == NULL || key == NULL)
+        return -1;
+
+    TrieNode *node = (TrieNode *)trie_get_node(root, key, keylen);
+
+    if (node == NULL || node->item.key == NULL)
+        return -1;
+
+    root->memsize -= sizeof(TRIECHAR) * (node->item.keylen + 1);
+    trie_item_removed(root, &node->item);
+    trieitem_free(&node->item, dealloc);
+    root->num_items--;
+
+    trie_prune(root, node, dealloc);
+
+    /* update state_id because one or more nodes have been removed */
+    trie_touch(root);
+    return 0;
+}
+
+/*
+ * Frees node, its item and everything below it, keeping the counters of the
+ * trie up to date. The root node itself is never freed, only its item.
+ *
+ * The counters are decremented node by node rather than by counts kept per
+ * subtree: every node has to be visited to be freed anyway, while counts per
+ * node would make every node larger and every insert update all nodes on
+ * its path. Each removed key is still passed to trie_item_removed, as the
+ * reverse trie, the delta, the cache and the statistics track single keys.
+ *
+ * @return: number of items that were removed.
+ */
+static size_t
+trie_free_subtree(TrieRoot *root, TrieNode *node, DeallocHandler dealloc)
+{
+    size_t num_removed = 0;
+    TrieNode *child = node->child;
+    while (child != NULL){
+        TrieNode *sibling = child->sibling;
+        num_removed += trie_free_subtree(root, child, dealloc);
+        child = sibling;
+    }
+    node->child = NULL;
+
+    if (node->item.key != NULL){
+        root->memsize -= sizeof(TRIECHAR) * (node->item.keylen + 1);
+        root->num_items--;
+        num_removed++;
+        trie_item_removed(root, &node->item);
+    }
+    trieitem_free(&node->item, dealloc);
+
+    if (node != (TrieNode *)root){
+        root->memsize -= sizeof(*node);
+        root->num_nodes--;
+        trienode_free(root, node, dealloc);
+    }
+    return num_removed;
+}
+
+/*
+ * Removes all keys that have key as a prefix (including key itself). The
+ * subtree below key is unlinked from the trie in one go and then freed,
+ * instead of removing the keys one by one.
+ *
+ * @return: number of items that were removed.
+ */
+size_t
+trie_del_prefix(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        DeallocHandler dealloc)
+{
+    if (root == NULL || key == NULL)
+        return 0;
+
+    TrieNode *node = (TrieNode *)trie_get_node(root, key, keylen);
+
+    if (node == NULL)
+        return 0;
+
+    TrieNode *parent = node->parent;
+    if (parent != NULL)
+        trienode_unlink_child(parent, node);
+
+    size_t num_removed = trie_free_subtree(root, node, dealloc);
+
+    if (parent != NULL)
+        trie_prune(root, parent, dealloc);
+
+    if (num_removed > 0){
+        /* update state_id because one or more nodes have been removed */
+        trie_touch(root);
+    }
+    return num_removed;
+}
+
+/*
+ * Applies pred to the items of node and everything below it, removing any
+ * item for which pred returns 0. Branches left without items are pruned
+ * bottom-up while walking the trie.
+ *
+ * @return: 0 on success, -1 if pred signalled an error or modified the trie.
+ */
+static int
+trie_retain_node(TrieRoot *root, TrieNode *node, TrieItemPredicate pred,
+        void *arg, DeallocHandler dealloc, size_t *num_removed)
+{
+    TrieNode *prev = NULL;
+    TrieNode *child = node->child;
+    while (child != NULL){
+        TrieNode *sibling = child->sibling;
+        if (trie_retain_node(root, child, pred, arg, dealloc,
+                    num_removed) != 0)
+            return -1;
+
+        if (child->child == NULL && child->item.key == NULL){
+            if (prev == NULL)
+                node->child = sibling;
+            else
+                prev->sibling = sibling;
+            root->memsize -= sizeof(*child);
+            root->num_nodes--;
+            trienode_free(root, child, dealloc);
+        }else{
+            prev = child;
+        }
+        child = sibling;
+    }
+
+    if (node->item.key != NULL){
+        long long state_id = root->state_id;
+        int keep = pred(&node->item, arg);
+        /* nodes may have been freed if pred modified the trie, so stop
+         * without touching any of them */
+        if (keep < 0 || state_id != root->state_id)
+            return -1;
+        if (keep == 0){
+            /* pred may have rebuilt a copy holding this item */
+            trie_uncompile(root);
+            root->memsize -= sizeof(TRIECHAR) * (node->item.keylen + 1);
+            trie_item_removed(root, &node->item);
+            trieitem_free(&node->item, dealloc);
+            root->num_items--;
+            (*num_removed)++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Removes all items for which pred returns 0, in a single pass over the trie.
+ *
+ * pred: called for every item in the trie, it should return 1 to keep the
+ * item, 0 to remove it, and -1 to signal an error. pred must not modify the
+ * trie.
+ * arg: passed on to pred.
+ * num_removed: if not NULL, set to the number of removed items. Items
+ * removed before an error occurred stay removed.
+ *
+ * @return: 0 on success, -1 on error.
+ */
+int
+trie_retain(TrieRoot *root, TrieItemPredicate pred, void *arg,
+        DeallocHandler dealloc, size_t *num_removed)
+{
+    size_t n = 0;
+
+    if (root == NULL || pred == NULL)
+        return -1;
+
+    /* pred may read the trie, so the compiled form and the indexes, which
+     * point at items, must not outlive the items removed while walking */
+    trie_uncompile(root);
+    int retval = trie_retain_node(root, (TrieNode *)root, pred, arg, dealloc,
+            &n);
+
+    if (n > 0){
+        /* update state_id because one or more nodes have been removed */
+        trie_touch(root);
+    }
+    if (num_removed != NULL)
+        *num_removed = n;
+    return retval;
+}
+
+static TrieSearchResult *
+trieiter_suffixes_next(TrieIter *it)
+{
+    TrieIterState *state = NULL;
+    while ((state = trieiter_pop_state(it)) != NULL){
+        TrieSearchResult *result = NULL;
+        if (state->node->item.key != NULL)
+            result = triesearchresult_new(state->query, state->node, 0);
+
+        TrieNode *query = state->query;
+        TrieNode *child = state->node->child;
+        int depth = state->depth;
+        for (; child != NULL; child = child->sibling){
+            trienode_prefetch(child->sibling);
+            trieiter_push_prefetched(it, child, query, 0, depth + 1);
+        }
+
+        if (result != NULL)
+            return result;
+    }
+    return NULL;
+}
+
+TrieIter *
+trieiter_suffixes(TrieRoot *root, const TRIECHAR *key, size_t keylen)
+{
+    if (root == NULL || key == NULL)
+        return NULL;
+
+    TrieNode *query = (TrieNode *)trie_get_node(root, key, keylen);
+
+    if (query == NULL)
+        return NULL;
+
+    TrieIter *it = trieiter_new(
+            root,
+            1,          /* number of states */
+            0,          /* maxhd (not used) */
+            0,          /* target_depth (not used) */
+            keylen,     /* len_query (not used) */
+            NULL,       /* stack (not used) */
+            trieiter_suffixes_next,
+            false       /* is_dirty */
+            );
+
+    if (it == NULL)
+        return NULL;
+
+    trieiter_push_state(it, query, query, 0, 0);
+    return it;
+}
+
+static TrieSearchResult *
+trieiter_neighbors_next(TrieIter *it)
+{
+    TrieIterState *state = NULL;
+    TrieNode *query, *target, *child;
+    int hd, depth;
+    while ((state = trieiter_pop_state(it)) != NULL){
+        if (state->depth == it->target_depth){
+            /* the query itself is not a neighbor, but keys that only differ
+             * by equivalent characters are (at distance 0) */
+            if (state->node->item.key == NULL || state->node == state->query)
+                continue;
+            query = state->query;
+            target = state->node;
+            hd = state->hd;
+            return triesearchresult_new(query, target, hd);
+        }
+
+        query = state->query;
+        child = state->node->child;
+        depth = state->depth;
+        hd = state->hd;
+        for (; child != NULL; child = child->sibling){
+            trienode_prefetch(child->sibling);
+            if (triecharclasses_match(it->classes, child->ch,
+                        *(query->item.key + depth)))
+                trieiter_push_prefetched(it, child, query, hd, depth + 1);
+            else if (hd < it->maxhd)
+                trieiter_push_prefetched(it, child, query, hd + 1,
+                        depth + 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Direct kernel for maxhd 1 without character classes.
+ *
+ * A neighbor at distance 1 is the query with one character replaced, so
+ * instead of carrying a mismatch budget along every branch, the kernel
+ * follows the path of the query and at each depth tries the children that
+ * differ from the query, below which the rest of the query is matched by
+ * direct descent. The iterator keeps a single state, holding the
+ * mismatching child and the depth of its parent, with hd set once the
+ * descent below it is done. For maxhd 2 the same scheme was measured no
+ * faster than the generic search, which is used from there on.
+ */
+#define TRIE_DIRECT_MAXHD 1
+
+/*
+ * Sets state to the first child that differs from key, along the path of
+ * key starting at node, which is at depth. If there is none, end is set to
+ * the node at the end of the path, if the path reaches that far.
+ */
+static bool
+neighbors_first_mismatch(const TrieNode *node, size_t depth,
+        const TRIECHAR *key, size_t keylen, TrieIterState *state,
+        const TrieNode **end)
+{
+    for (; node != NULL && depth < keylen; depth++){
+        for (TrieNode *child = node->child; child != NULL;
+                child = child->sibling){
+            if (child->ch != key[depth]){
+                state->node = child;
+                state->depth = depth;
+                state->hd = 0;
+                return true;
+            }
+        }
+        node = trienode_get_child(node, key[depth]);
+    }
+    *end = node;
+    return false;
+}
+
+/* Moves state to the next child that differs from key, see
+ * neighbors_first_mismatch */
+static bool
+neighbors_next_mismatch(const TRIECHAR *key, size_t keylen,
+        TrieIterState *state, const TrieNode **end)
+{
+    size_t depth = state->depth;
+    for (TrieNode *child = state->node->sibling; child != NULL;
+            child = child->sibling){
+        if (child->ch != key[depth]){
+            state->node = child;
+            state->hd = 0;
+            return true;
+        }
+    }
+    TrieNode *node = trienode_get_child(state->node->parent, key[depth]);
+    return neighbors_first_mismatch(node, depth + 1, key, keylen, state,
+            end);
+}
+
+static TrieSearchResult *
+trieiter_neighbors_hd1_next(TrieIter *it)
+{
+    if (it->fill == it->head)
+        return NULL;
+
+    TrieIterState *state = it->head;
+    TrieNode *query = state->query;
+    const TRIECHAR *key = query->item.key;
+    size_t keylen = query->item.keylen;
+
+    for (;;){
+        const TrieNode *end = NULL;
+        if (state->hd == 0){
+            state->hd = 1;
+            end = state->node;
+            for (size_t i = state->depth + 1; end != NULL && i < keylen; i++)
+                end = trienode_get_child(end, key[i]);
+            if (end != NULL && end->item.key != NULL)
+                return triesearchresult_new(query, end, 1);
+        }else if (!neighbors_next_mismatch(key, keylen, state, &end)){
+            /* the path of the query is done */
+            it->fill--;
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Returns the flat copy of the keys of length keylen, making it if there is
+ * none. The copies are dropped as soon as keys are added or removed.
+ */
+static const FlatKeys *
+trie_flatkeys(TrieRoot *root, size_t keylen)
+{
+    FlatKeys *fk;
+    for (fk = root->flat; fk != NULL; fk = fk->next)
+        if (fk->keylen == keylen)
+            return fk;
+
+    fk = flatkeys_new(root, keylen);
+    fk->next = root->flat;
+    root->flat = fk;
+    root->memsize += flatkeys_mem_usage(fk);
+    return fk;
+}
+
+/*
+ * Finds the next neighbor by comparing the query, held by the only state of
+ * the iterator, with the next keys of the flat copy.
+ */
+static TrieSearchResult *
+trieiter_neighbors_scan_next(TrieIter *it)
+{
+    const FlatKeys *fk = it->flat;
+    const TrieItem *query = &it->head->query->item;
+    int hd;
+    size_t i;
+    do {
+        i = flatkeys_find(fk, it->pos, query->key, it->maxhd, it->classes,
+                &hd);
+        it->pos = i + 1;
+    } while (i < fk->num_keys && fk->items[i] == query);
+
+    if (i == fk->num_keys)
+        return NULL;
+
+    TrieSearchResult *result = safe_calloc(1, sizeof(*result));
+    result->query = query;
+    result->target = fk->items[i];
+    result->hd = hd;
+    return result;
+}
+
+/*
+ * Returns the split index of the keys of length keylen, making it if there
+ * is none. Like the flat copies, the indexes are dropped as soon as keys are
+ * added or removed.
+ */
+static const SplitIndex *
+trie_splitindex(TrieRoot *root, size_t keylen)
+{
+    SplitIndex *si;
+    for (si = root->split; si != NULL; si = si->next)
+        if (si->keylen == keylen)
+            return si;
+
+    si = splitindex_new(root, keylen);
+    si->next = root->split;
+    root->split = si;
+    root->memsize += splitindex_mem_usage(si);
+    return si;
+}
+
+/*
+ * Returns the next neighbor among the keys found through the split index
+ * for the query, held by the only state of the iterator.
+ */
+static TrieSearchResult *
+trieiter_neighbors_split_next(TrieIter *it)
+{
+    const TrieItem *query = &it->head->query->item;
+    while (it->pos < it->found.len){
+        const SplitMatch *match = &it->found.matches[it->pos++];
+        const TrieItem *item = it->split->items[match->index];
+        if (item == query)
+            continue;
 
-    return 0;
+        TrieSearchResult *result = safe_calloc(1, sizeof(*result));
+        result->query = query;
+        result->target = item;
+        result->hd = match->hd;
+        return result;
+    }
+    return NULL;
 }
 
 /*
- * Removes key from the trie, including any nodes leading up to it unless
- * this would break the trie for other strings.
+ * Breadth-first search for neighbors.
  *
- * 0 is returned in case of successful removal of the string from the trie.
+ * Instead of popping one state at a time off a stack, the search expands a
+ * batch of states within maxhd at one depth (the frontier) into the states
+ * at the next depth. The states of each depth are kept as arrays of nodes
+ * and Hamming distances. Every node added to the next depth has its first
+ * child prefetched, so the memory accesses of the next batch overlap with
+ * the work on the current one, which pays off on large tries with many
+ * states per depth. Children are linked through siblings rather than stored
+ * together, so their characters are compared one by one, but without
+ * branching on the outcome.
+ *
+ * Batches are expanded as results are asked for: the deepest depth with
+ * states left to expand is expanded into the next depth, until the depth of
+ * the query is reached, whose states are the results. So at most about
+ * TRIE_FRONTIER_BATCH states are kept per depth, and the first result is
+ * found without expanding everything within maxhd.
  */
-int
-trie_del_item(TrieRoot *root, const TRIECHAR *key, DeallocHandler dealloc)
-{
-    TrieNode *parent;
 
-    if (root == NULL || key == NULL)
-        return -1;
+#define TRIE_FRONTIER_BATCH 1024
 
-    TrieNode *node = (TrieNode *)trie_get_node(root, key);
+static void
+triefrontier_add(TrieFrontier *level, const TrieNode *node, int hd)
+{
+    if (level->len == level->size){
+        level->size = level->size > 0 ? 2 * level->size : 64;
+        level->nodes = safe_realloc(level->nodes,
+                sizeof(*level->nodes) * level->size);
+        level->hds = safe_realloc(level->hds,
+                sizeof(*level->hds) * level->size);
+    }
+    level->nodes[level->len] = node;
+    level->hds[level->len++] = hd;
+}
 
-    if (node == NULL || node->item.key == NULL)
-        return -1;
+/* Frees the levels allocated by trieiter_neighbors_frontier */
+static void
+triefrontier_free(TrieFrontier *levels, size_t num_levels)
+{
+    if (levels == NULL)
+        return;
 
-    root->memsize -= sizeof(TRIECHAR) * (node->item.keylen + 1);
-    trieitem_free(&node->item, dealloc);
-    root->num_items--;
+    for (size_t i = 0; i < num_levels; i++){
+        free(levels[i].nodes);
+        free(levels[i].hds);
+    }
+    free(levels);
+}
 
-    while (node != (TrieNode *)root && node->child == NULL &&
-            node->item.key == NULL){
-        parent = node->parent;
-        trienode_remove_child(parent, node->ch, dealloc);
-        root->memsize -= sizeof(*node);
-        node = parent;
-        root->num_nodes--;
+/*
+ * Expands the next batch of states of cur into next, replacing the states
+ * of next. ch is the character of the query at the depth of next.
+ */
+static void
+triefrontier_expand(TrieFrontier *cur, TrieFrontier *next, TRIECHAR ch,
+        int maxhd, const TrieCharClasses *classes)
+{
+    next->len = next->pos = 0;
+    for (; cur->pos < cur->len && next->len < TRIE_FRONTIER_BATCH;
+            cur->pos++){
+        int hd = cur->hds[cur->pos];
+        const TrieNode *child = cur->nodes[cur->pos]->child;
+        if (hd < maxhd || classes != NULL){
+            for (; child != NULL; child = child->sibling){
+                int child_hd = hd + !triecharclasses_match(classes,
+                        child->ch, ch);
+                if (child_hd <= maxhd){
+                    trienode_prefetch(child->child);
+                    triefrontier_add(next, child, child_hd);
+                }
+            }
+        }else{
+            /* no mismatches left, so only the matching child remains */
+            for (; child != NULL && child->ch != ch; child = child->sibling);
+            if (child != NULL){
+                trienode_prefetch(child->child);
+                triefrontier_add(next, child, hd);
+            }
+        }
     }
+}
 
-    /* update state_id because one or more nodes have been removed */
-    root->state_id++;
-    return 0;
+/*
+ * Starts a breadth-first search for the neighbors of query, with one level
+ * of states for every depth up to that of the query.
+ */
+static void
+trieiter_neighbors_frontier(TrieIter *it, const TrieNode *query)
+{
+    size_t num_levels = query->item.keylen + 1;
+    it->frontier = safe_calloc(num_levels, sizeof(*it->frontier));
+    triefrontier_add(&it->frontier[0], (const TrieNode *)it->root, 0);
 }
 
+/*
+ * Returns the next neighbor at the depth of the query, expanding batches
+ * of states when all neighbors found so far have been returned.
+ */
 static TrieSearchResult *
-trieiter_suffixes_next(TrieIter *it)
+trieiter_neighbors_frontier_next(TrieIter *it)
 {
-    TrieIterState *state = NULL;
-    while ((state = trieiter_pop_state(it)) != NULL){
-        TrieSearchResult *result = NULL;
-        if (state->node->item.key != NULL)
-            result = triesearchresult_new(state->query, state->node, 0);
-
-        TrieNode *query = state->query;
-        TrieNode *child = state->node->child;
-        int depth = state->depth;
-        for (; child != NULL; child = child->sibling)
-                trieiter_push_state(it, child, query, 0, depth + 1);
+    TrieFrontier *levels = it->frontier;
+    const TrieNode *query = it->head->query;
+    size_t keylen = query->item.keylen;
+    TrieFrontier *last = &levels[keylen];
+    for (;;){
+        while (last->pos < last->len){
+            size_t i = last->pos++;
+            const TrieNode *node = last->nodes[i];
+            if (node != query && node->item.key != NULL)
+                return triesearchresult_new(query, node, last->hds[i]);
+        }
 
-        if (result != NULL)
-            return result;
+        /* the deeper levels are done, so expand the deepest one left */
+        size_t depth = keylen;
+        while (depth > 0 && levels[depth - 1].pos == levels[depth - 1].len)
+            depth--;
+        if (depth == 0)
+            return NULL;
+        triefrontier_expand(&levels[depth - 1], &levels[depth],
+                query->item.key[depth - 1], it->maxhd, it->classes);
     }
-    return NULL;
 }
 
-TrieIter *
-trieiter_suffixes(TrieRoot *root, const TRIECHAR *key)
+static bool
+trieiter_neighbors_is_direct(const TrieIter *it)
 {
-    if (root == NULL || key == NULL)
-        return NULL;
-
-    TrieNode *query = (TrieNode *)trie_get_node(root, key);
-
-    if (query == NULL)
-        return NULL;
-
-    TrieIter *it = trieiter_new(
-            root,
-            1,          /* number of states */
-            0,          /* maxhd (not used) */
-            0,          /* target_depth (not used) */
-            strlen(key),/* len_query (not used) */
-            NULL,       /* stack (not used) */
-            trieiter_suffixes_next,
-            false       /* is_dirty */
-            );
+    return it->classes == NULL && it->maxhd <= TRIE_DIRECT_MAXHD;
+}
 
-    if (it == NULL)
-        return NULL;
+/* Finds the next neighbor with the kernel suited to the iterator */
+static TrieSearchResult *
+trieiter_neighbors_search(TrieIter *it)
+{
+    if (it->flat != NULL)
+        return trieiter_neighbors_scan_next(it);
+    if (it->split != NULL)
+        return trieiter_neighbors_split_next(it);
+    if (it->frontier != NULL)
+        return trieiter_neighbors_frontier_next(it);
+    if (!trieiter_neighbors_is_direct(it))
+        return trieiter_neighbors_next(it);
+    return trieiter_neighbors_hd1_next(it);
+}
 
-    trieiter_push_state(it, query, query, 0, 0);
-    return it;
+/*
+ * Finds the next neighbor as trieiter_neighbors_next, recording it in the
+ * entry of the iterator. Once all neighbors are found, the entry is moved to
+ * the cache of the trie.
+ */
+static TrieSearchResult *
+trieiter_neighbors_record(TrieIter *it)
+{
+    TrieSearchResult *result = trieiter_neighbors_search(it);
+    if (it->entry == NULL)
+        return result;
+
+    if (result != NULL){
+        triecacheentry_add_result(it->entry, result->target, result->hd);
+    }else if (it->root->cache != NULL){
+        triecache_put(it->root->cache, it->entry);
+        it->entry = NULL;
+    }
+    return result;
 }
 
+/*
+ * Returns the next neighbor from the cached results in the entry of the
+ * iterator. The only state of the iterator holds the query.
+ */
 static TrieSearchResult *
-trieiter_neighbors_next(TrieIter *it)
+trieiter_neighbors_replay(TrieIter *it)
 {
-    TrieIterState *state = NULL;
-    TrieNode *query, *target, *child;
-    int hd, depth;
-    while ((state = trieiter_pop_state(it)) != NULL){
-        if (state->depth == it->target_depth){
-            if (state->node->item.key == NULL || state->hd == 0)
-                continue;
-            query = state->query;
-            target = state->node;
-            hd = state->hd;
-            return triesearchresult_new(query, target, hd);
-        }
+    if (it->pos == it->entry->num_results)
+        return NULL;
 
-        query = state->query;
-        child = state->node->child;
-        depth = state->depth;
-        hd = state->hd;
-        for (; child != NULL; child = child->sibling){
-            if (child->ch == *(query->item.key + depth))
-                trieiter_push_state(it, child, query, hd, depth + 1);
-            else if (hd < it->maxhd)
-                trieiter_push_state(it, child, query, hd + 1, depth + 1);
-        }
-    }
-    return NULL;
+    TrieSearchResult *result = safe_calloc(1, sizeof(*result));
+    result->query = &it->head->query->item;
+    result->target = it->entry->results[it->pos].item;
+    result->hd = it->entry->results[it->pos++].hd;
+    return result;
 }
 
-TrieIter *
-trieiter_neighbors(TrieRoot *root, const TRIECHAR *key, int maxhd)
+/*
+ * Iterates over the neighbors of key with the trie, scan, frontier or split
+ * engine. Results are taken from the cache, if enabled, regardless of the
+ * engine.
+ */
+static TrieIter *
+trieiter_neighbors_using(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        int maxhd, const TrieCharClasses *classes, TrieEngine engine)
 {
     if (root == NULL || key == NULL || maxhd < 1)
         return NULL;
 
-    TrieNode *query = (TrieNode *)trie_get_node(root, key);
+    TrieNode *query = (TrieNode *)trie_get_node(root, key, keylen);
 
     if (query == NULL || query->item.key == NULL)
         return NULL;
 
     TrieIter *it = trieiter_new(
             root,
-            1,                          /* number of states */
+            maxhd,                      /* number of states */
             maxhd,
             query->item.keylen,        /* target_depth */
             query->item.keylen,        /* len_query (not used) */
             NULL,                       /* stack (not used) */
-            trieiter_neighbors_next,
+            trieiter_neighbors_search,
             false                       /* is_dirty */
             );
 
     if (it == NULL)
         return NULL;
 
-    trieiter_push_state(it, (TrieNode *)it->root, query, 0, 0);
+    if (root->cache != NULL){
+        const TrieCacheEntry *cached = triecache_get(root->cache, key,
+                keylen, maxhd, classes);
+        /* the cached entry may be evicted while iterating, so replay a
+         * copy of its results */
+        it->entry = triecacheentry_new(key, keylen, maxhd, classes);
+        if (cached != NULL){
+            for (size_t i = 0; i < cached->num_results; i++)
+                triecacheentry_add_result(it->entry, cached->results[i].item,
+                        cached->results[i].hd);
+            it->next = trieiter_neighbors_replay;
+            trieiter_push_state(it, query, query, 0, 0);
+            return it;
+        }
+        it->next = trieiter_neighbors_record;
+    }
+
+    it->classes = triecharclasses_copy(classes);
+    if (engine == TRIE_ENGINE_SCAN){
+        it->flat = trie_flatkeys(root, query->item.keylen);
+        trieiter_push_state(it, query, query, 0, 0);
+        return it;
+    }
+    if (engine == TRIE_ENGINE_FRONTIER){
+        trieiter_neighbors_frontier(it, query);
+        trieiter_push_state(it, query, query, 0, 0);
+        return it;
+    }
+    if (engine == TRIE_ENGINE_SPLIT){
+        it->split = trie_splitindex(root, query->item.keylen);
+        splitindex_find(it->split, query->item.key, maxhd, it->classes,
+                &it->found);
+        trieiter_push_state(it, query, query, 0, 0);
+        return it;
+    }
+
+    const TrieNode *end;
+    if (!trieiter_neighbors_is_direct(it)){
+        trieiter_push_state(it, (TrieNode *)it->root, query, 0, 0);
+    }else if (neighbors_first_mismatch((TrieNode *)root, 0, query->item.key,
+                query->item.keylen, it->fill, &end)){
+        it->fill->query = query;
+        it->fill++;
+    }
     return it;
 }
 
+TrieIter *
+trieiter_neighbors(TrieRoot *root, const TRIECHAR *key, size_t keylen,
+        int maxhd, const TrieCharClasses *classes)
+{
+    return trieiter_neighbors_using(root, key, keylen, maxhd, classes,
+            TRIE_ENGINE_TRIE);
+}
+
+/*
+ * Iterates over the neighbors of key as trieiter_neighbors, with the given
+ * engine. TRIE_ENGINE_AUTO picks the engine with the lowest estimated cost
+ * (see trie_plan_neighbors).
+ *
+ * @return: NULL if key is not in the trie or the engine does not apply.
+ */
+TrieIter *
+trieiter_neighbors_engine(TrieRoot *root, const TRIECHAR *key,
+        size_t keylen, int maxhd, const TrieCharClasses *classes,
+        TrieEngine engine)
+{
+    if (engine == TRIE_ENGINE_AUTO){
+        TriePlan plan;
+        if (trie_plan_neighbors(root, keylen, maxhd, classes, &plan) != 0)
+            return NULL;
+        engine = plan.engine;
+    }
+    if (engine == TRIE_ENGINE_MASKED || engine >= TRIE_NUM_ENGINES)
+        return NULL;
+    return trieiter_neighbors_using(root, key, keylen, maxhd, classes,
+            engine);
+}
+
 static void
 trie_find_all_strings(TrieNode *node, int depth, ListNode **targets)
 {
@@ -752,15 +2431,18 @@ trieiter_hammingpairs_next(TrieIter *it)
         n_children = 0;
         n_explored = 0;
         for (child = node->child; child != NULL; child = child->sibling){
+            trienode_prefetch(child->sibling);
             n_children++;
             if ((child->flags & TRIE_EXPLORED) == TRIE_EXPLORED){
                 n_explored++;
             }
             else{
-                if (child->ch == *(query->item.key + depth))
-                    trieiter_push_state(it, child, query, hd, depth+1);
+                if (triecharclasses_match(it->classes, child->ch,
+                            *(query->item.key + depth)))
+                    trieiter_push_prefetched(it, child, query, hd, depth+1);
                 else if (hd < it->maxhd)
-                    trieiter_push_state(it, child, query, hd+1, depth+1);
+                    trieiter_push_prefetched(it, child, query, hd+1,
+                            depth+1);
             }
         }
         if (n_children == n_explored)
@@ -769,8 +2451,239 @@ trieiter_hammingpairs_next(TrieIter *it)
     return NULL;
 }
 
+static TrieSearchResult *
+trieiter_maskedpairs_next(TrieIter *it)
+{
+    const TrieItem *a, *b;
+    if (!maskindex_next_pair(it->mask, &a, &b))
+        return NULL;
+
+    TrieSearchResult *result = safe_malloc(sizeof(*result));
+    result->query = a;
+    result->target = b;
+    result->hd = 1;
+    return result;
+}
+
+/*
+ * Iterates over all pairs of keys of length keylen at Hamming distance 1,
+ * like trieiter_hammingpairs with maxhd 1. Instead of searching the trie for
+ * every key, the keys are grouped by their hash with one position masked
+ * (see maskindex.c), which takes keylen sorts of the keys. The trie is not
+ * modified, so the iterator is not dirty.
+ */
+TrieIter *
+trieiter_maskedpairs(TrieRoot *root, int keylen)
+{
+    if (root == NULL || keylen <= 0)
+        return NULL;
+
+    TrieIter *it = trieiter_new(
+            root,
+            1,          /* number of states (not used) */
+            1,          /* maxhd */
+            keylen,     /* target_depth */
+            keylen,     /* len_query (not used) */
+            NULL,       /* stack (not used) */
+            trieiter_maskedpairs_next,
+            false       /* is_dirty */
+            );
+
+    if (it != NULL)
+        it->mask = maskindex_new(root, keylen);
+    return it;
+}
+
+/*
+ * Finds the next pair by comparing the keys of the flat copy, each key with
+ * the keys following it.
+ */
+static TrieSearchResult *
+trieiter_scanpairs_next(TrieIter *it)
+{
+    const FlatKeys *fk = it->flat;
+    while (it->pos < fk->num_keys){
+        const TRIECHAR *key = fk->keys + it->pos * fk->stride;
+        int hd;
+        size_t j = flatkeys_find(fk, it->pos2, key, it->maxhd, it->classes,
+                &hd);
+        if (j < fk->num_keys){
+            it->pos2 = j + 1;
+            TrieSearchResult *result = safe_calloc(1, sizeof(*result));
+            result->query = fk->items[it->pos];
+            result->target = fk->items[j];
+            result->hd = hd;
+            return result;
+        }
+        it->pos++;
+        it->pos2 = it->pos + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Finds the next pair through the split index, searching for the keys within
+ * maxhd of each key in turn and keeping those following it in the index.
+ */
+static TrieSearchResult *
+trieiter_splitpairs_next(TrieIter *it)
+{
+    const SplitIndex *si = it->split;
+    while (it->pos2 < si->num_keys){
+        if (it->pos == it->found.len){
+            if (++it->pos2 == si->num_keys)
+                break;
+            splitindex_find(si, si->items[it->pos2]->key, it->maxhd,
+                    it->classes, &it->found);
+            it->pos = 0;
+            continue;
+        }
+        const SplitMatch *match = &it->found.matches[it->pos++];
+        if (match->index <= it->pos2)
+            continue;
+
+        TrieSearchResult *result = safe_calloc(1, sizeof(*result));
+        result->query = si->items[it->pos2];
+        result->target = si->items[match->index];
+        result->hd = match->hd;
+        return result;
+    }
+    return NULL;
+}
+
+/*
+ * Iterates over the same pairs as trieiter_hammingpairs, with the given
+ * engine. TRIE_ENGINE_AUTO picks the engine with the lowest estimated cost
+ * other than the trie search (see trie_plan_pairs), which is the only one
+ * that gives a dirty iterator.
+ *
+ * @return: NULL if the engine does not apply.
+ */
+TrieIter *
+trieiter_pairs_engine(TrieRoot *root, int keylen, int maxhd,
+        const TrieCharClasses *classes, TrieEngine engine)
+{
+    if (root == NULL || keylen <= 0 || maxhd < 1)
+        return NULL;
+
+    if (engine == TRIE_ENGINE_AUTO){
+        TriePlan plan;
+        if (trie_plan_pairs(root, keylen, maxhd, classes, &plan) != 0)
+            return NULL;
+        engine = plan.engine;
+    }
+
+    switch(engine){
+    case TRIE_ENGINE_TRIE:
+        return trieiter_hammingpairs(root, keylen, maxhd, classes);
+    case TRIE_ENGINE_MASKED:
+        if (maxhd != 1 || classes != NULL)
+            return NULL;
+        return trieiter_maskedpairs(root, keylen);
+    case TRIE_ENGINE_SCAN:
+    case TRIE_ENGINE_SPLIT:
+        break;
+    default:
+        return NULL;
+    }
+
+    TrieIter *it = trieiter_new(
+            root,
+            1,          /* number of states (not used) */
+            maxhd,
+            keylen,     /* target_depth */
+            keylen,     /* len_query (not used) */
+            NULL,       /* stack (not used) */
+            engine == TRIE_ENGINE_SCAN ? trieiter_scanpairs_next :
+                trieiter_splitpairs_next,
+            false       /* is_dirty */
+            );
+
+    if (it == NULL)
+        return NULL;
+
+    it->classes = triecharclasses_copy(classes);
+    if (engine == TRIE_ENGINE_SCAN){
+        it->flat = trie_flatkeys(root, keylen);
+        it->pos2 = 1;
+    }else{
+        it->split = trie_splitindex(root, keylen);
+        if (it->split->num_keys > 0)
+            splitindex_find(it->split, it->split->items[0]->key, maxhd,
+                    it->classes, &it->found);
+    }
+    return it;
+}
+
+/* Predicate selecting the items whose key length differs from *arg */
+static int
+trieitem_other_length(const TrieItem *item, void *arg)
+{
+    return item->keylen != *(size_t *)arg;
+}
+
+/*
+ * Finds the next pair as trieiter_hammingpairs_next. Once all pairs are
+ * found, the new keys of the length of the pairs are no longer new.
+ */
+static TrieSearchResult *
+trieiter_deltapairs_next(TrieIter *it)
+{
+    TrieSearchResult *result = trieiter_hammingpairs_next(it);
+    if (result == NULL && it->root->delta != NULL){
+        size_t keylen = (size_t)it->target_depth;
+        trie_retain(it->root->delta, trieitem_other_length, &keylen, NULL,
+                NULL);
+    }
+    return result;
+}
+
+/*
+ * Iterates over the pairs of keys of length keylen within maxhd of each
+ * other, of which at least one key was added since the checkpoint. Only
+ * the new keys are used as queries. As in trieiter_hammingpairs, queries
+ * are marked explored, so a pair of two new keys is only found once while
+ * pairs with keys from before the checkpoint are always found.
+ *
+ * @return: NULL if there is no checkpoint (see trie_checkpoint).
+ */
+TrieIter *
+trieiter_deltapairs(TrieRoot *root, int keylen, int maxhd,
+        const TrieCharClasses *classes)
+{
+    if (root == NULL || root->delta == NULL || keylen <= 0)
+        return NULL;
+
+    ListNode *queries = NULL;
+    ListNode *new_keys = NULL;
+    trie_find_all_strings((TrieNode *)root->delta, keylen, &new_keys);
+    TrieNode *node;
+    while ((node = stack_pop(&new_keys)) != NULL){
+        TrieNode *query = (TrieNode *)trie_get_node(root, node->item.key,
+                node->item.keylen);
+        if (query != NULL)
+            stack_push(&queries, query);
+    }
+
+    TrieIter *it = trieiter_new(
+            root,
+            1,          /* number of states */
+            maxhd,
+            keylen,     /* target_depth */
+            keylen,     /* len_query (not used) */
+            queries,    /* stack */
+            trieiter_deltapairs_next,
+            true        /* is_dirty */
+            );
+
+    if (it != NULL)
+        it->classes = triecharclasses_copy(classes);
+    return it;
+}
+
 TrieIter *
-trieiter_hammingpairs(TrieRoot *root, int keylen, int maxhd)
+trieiter_hammingpairs(TrieRoot *root, int keylen, int maxhd,
+        const TrieCharClasses *classes)
 {
     if (root == NULL || keylen <= 0)
         return NULL;
@@ -788,6 +2701,8 @@ trieiter_hammingpairs(TrieRoot *root, int keylen, int maxhd)
             trieiter_hammingpairs_next,
             true        /* is_dirty */
             );
-    
+
+    if (it != NULL)
+        it->classes = triecharclasses_copy(classes);
     return it;
 }
@@ -10,7 +10,8 @@ else:
 
 import pytest
 import pickle
-from itertools import product, permutations
+import random
+from itertools import islice, product, permutations
 from vtrie import Trie
 
 def test_reduce():
@@ -211,12 +212,109 @@ def test_delitem():
     with pytest.raises(KeyError):
         t[b""]
 
+def test_binary_keys():
+    if sys.version_info < (3,):
+        key = lambda x: x
+    else:
+        key = lambda x: x.encode("utf-8", "surrogateescape")
+
+    t = Trie()
+    t[b"a\0b"] = 1
+    t[b"a\0c"] = 2
+    t[b"a"] = 3
+    t[b"\xff\xfe"] = 4
+    assert len(t) == 4
+    assert t[b"a\0b"] == 1
+    assert t[b"a\0c"] == 2
+    assert t[b"a"] == 3
+    assert b"a\0" not in t
+    assert t.has_node(b"a\0")
+    assert sorted(key(k) for k in t) == \
+            sorted([b"a\0b", b"a\0c", b"a", b"\xff\xfe"])
+    assert sorted((key(k), v) for k, v in t.items()) == \
+            sorted([(b"a\0b", 1), (b"a\0c", 2), (b"a", 3), (b"\xff\xfe", 4)])
+    repr(t)
+
+    lp = t.longest_prefix(b"a\0bcd")
+    assert (key(lp[0]), lp[1]) == (b"a\0b", 1)
+    assert set((key(k), v) for k, v in t.suffixes(b"a\0")) == \
+            set([(b"b", 1), (b"c", 2)])
+    assert set((hd, key(k), v) for hd, k, v in t.neighbors(b"a\0b", 1)) == \
+            set([(1, b"a\0c", 2)])
+    assert sorted(sorted([key(k1), key(k2)])
+            for hd, k1, v1, k2, v2 in t.pairs(3, 1)) == [[b"a\0b", b"a\0c"]]
+
+    t2 = pickle.loads(pickle.dumps(t))
+    assert sorted(t2.items()) == sorted(t.items())
+
+    t.compile()
+    assert t[b"a\0c"] == 2
+    assert b"a\0" not in t
+    del t[b"a\0b"]
+    assert b"a\0b" not in t
+    assert t.delete_prefix(b"a\0") == 1
+    assert len(t) == 2
+
+def test_unicode_keys():
+    t = Trie()
+    t[u"caf\u00e9"] = 1
+    t[u"cafe"] = 2
+    t[u"\u03b1\u03b2\u03b3"] = 3
+    t[u"\U0001f600!"] = 4
+    assert len(t) == 4
+    assert t[u"caf\u00e9"] == 1
+    assert u"cafe" in t
+    assert u"caf\u00e8" not in t
+    assert u"\u03b1\u03b2" not in t
+    assert t.has_node(u"\u03b1\u03b2")
+    assert sorted(t.keys()) == sorted([u"caf\u00e9", u"cafe",
+        u"\u03b1\u03b2\u03b3", u"\U0001f600!"])
+    repr(t)
+
+    # Hamming distance counts code points, not bytes
+    assert list(t.neighbors(u"caf\u00e9", 1)) == [(1, u"cafe", 2)]
+    assert list(t.neighbors(u"cafe", 1, equiv = {u"e": u"e\u00e9"})) == \
+            [(0, u"caf\u00e9", 1)]
+    assert [(hd, sorted([k1, k2])) for hd, k1, v1, k2, v2 in t.pairs(4, 1)] \
+            == [(1, [u"cafe", u"caf\u00e9"])]
+
+    # equiv characters in no key do not make unrelated classes overlap
+    u = Trie()
+    u[u"a\u00e9"] = 1
+    u[u"a\u00f6"] = 3
+    assert list(u.neighbors(u"a\u00e9", 1, equiv = {u"\u00e9": u"\u00fc",
+        u"\u00f6": u"\u00df"})) == [(1, u"a\u00f6", 3)]
+    assert list(u.neighbors(u"a\u00e9", 1, equiv = {u"\u00fc": u"\u00e9",
+        u"\u00df": u"\u00f6"})) == [(1, u"a\u00f6", 3)]
+    assert t.longest_prefix(u"cafeteria") == (u"cafe", 2)
+    assert sorted(t.suffixes(u"caf")) == [(u"e", 2), (u"\u00e9", 1)]
+    assert t.pop(u"\U0001f600!") == 4
+
+    t2 = pickle.loads(pickle.dumps(t))
+    assert sorted(t2.items()) == sorted(t.items())
+
+    # keys are either all bytes or all str
+    with pytest.raises(TypeError):
+        t[b"bytes"] = 0
+    t3 = Trie()
+    t3[b"bytes"] = 0
+    with pytest.raises(TypeError):
+        t3[u"str"] = 0
+
+    # at most 255 distinct characters
+    t = Trie()
+    for i in range(255):
+        t[(b"\\u%04x" % (0x400 + i)).decode("unicode_escape")] = i
+    with pytest.raises(ValueError):
+        t[u"\u2603"] = 0
+    assert u"\u2603" not in t
+
 def test_sizeof():
     # NOTE: this test may fail because it assumes to know the size in bytes of
     # the root node and of non-root nodes. So failure of this test may not
     # necessarily indicate that the trie is reporting the wrong size.
     t = Trie()
-    rs = 96 # size of root node in bytes
+    rs = 184 # size of root node in bytes
     ns = 56 # size of trie node in bytes
     sizeof = lambda t:t.__sizeof__()
     assert t.__sizeof__() == sizeof(t) == rs
@@ -237,6 +335,87 @@ def test_sizeof():
     del t[b"hello"] # can only remove "llo" nodes
     assert sizeof(t) == rs + ns*13 + 14 + 3
 
+def test_relayout():
+    t = Trie()
+    t.relayout()
+    assert len(t) == 0
+    t[b""] = 0
+    t.relayout()
+    assert t[b""] == 0
+
+    t = Trie()
+    strings = [b("".join(p)) for p in product("ABCD", "ABCD", "ABCD", "AB")]
+    for i, s in enumerate(strings):
+        t[s] = i
+    n = t.num_nodes()
+    size = t.__sizeof__()
+    pairs = set(t.pairs(4, 2, engine="trie"))
+    it = iter(t)
+    t.relayout()
+    with pytest.raises(RuntimeError):
+        next(it)
+    assert t.num_nodes() == n
+    assert t.__sizeof__() == size
+    for i, s in enumerate(strings):
+        assert t[s] == i
+    assert set(t.pairs(4, 2, engine="trie")) == pairs
+    assert set(t.neighbors(b"ABCA", 1)) == set([
+        (1, "ABCB", strings.index(b"ABCB")),
+        (1, "AACA", strings.index(b"AACA")),
+        (1, "ABAA", strings.index(b"ABAA")),
+        (1, "ABBA", strings.index(b"ABBA")),
+        (1, "ABDA", strings.index(b"ABDA")),
+        (1, "BBCA", strings.index(b"BBCA")),
+        (1, "CBCA", strings.index(b"CBCA")),
+        (1, "DBCA", strings.index(b"DBCA")),
+        (1, "ACCA", strings.index(b"ACCA")),
+        (1, "ADCA", strings.index(b"ADCA"))])
+
+    # Removed nodes are reused by later insertions
+    for s in strings[::2]:
+        del t[s]
+    assert t.delete_prefix(b"D") == 16
+    for i, s in enumerate(strings):
+        if i % 2 == 0:
+            t[s] = i
+    assert len(t) == len(strings) - 16
+    t.relayout()
+    for i, s in enumerate(strings):
+        if i % 2 == 0 or not s.startswith(b"D"):
+            assert t[s] == i
+        else:
+            assert not s in t
+    t.retain(lambda k, v: v % 3 == 0)
+    t.relayout()
+    assert set(t.values()) == set(i for i, s in enumerate(strings)
+            if i % 3 == 0 and (i % 2 == 0 or not s.startswith(b"D")))
+
+def test_compact():
+    ns = 56 # size of trie node in bytes
+    t = Trie()
+    assert t.compact() == 0
+    for i in xrange(1000):
+        t[b(str(i))] = i
+    n = t.num_nodes()
+    # Nodes that were allocated one by one are freed on deletion, and their
+    # memory is counted once it is handed back by compaction
+    del t[b"999"]
+    assert t.num_nodes() == n - 1
+    assert t.compact() == ns
+    assert t.compact() == 0
+
+    # Nodes from a relayout are kept for reuse until compaction
+    assert t.delete_prefix(b"9") == 110
+    assert t.num_nodes() == n - 111
+    t[b"9x"] = 1 # reuses 2 of the 110 removed nodes
+    assert t.compact() == (110 - 2) * ns
+    assert t.compact() == 0
+    assert t.num_nodes() == n - 109
+    for i in xrange(999):
+        if not str(i).startswith("9"):
+            assert t[b(str(i))] == i
+    assert t[b"9x"] == 1
+
 def test_has_key():
     t = Trie()
     assert not t.has_key(b"a")
@@ -442,6 +621,62 @@ def test_has_node():
     assert not t.has_node(b"Hello!")
     assert t[b"Hello"] == 0
 
+def test_compile():
+    t = Trie()
+    t.compile()
+    assert t.is_compiled()
+    assert not b"" in t
+    assert t.longest_prefix(b"abc") is None
+
+    strings = [b("".join(p)) for p in product("ABC", "ABC", "ABC")]
+    strings += [b"", b"A", b"AB", b"foo", b"foobar", b"~~"]
+    t = Trie()
+    for i, s in enumerate(strings):
+        t[s] = i
+    size = t.__sizeof__()
+    t.compile()
+    assert t.is_compiled()
+    assert t.__sizeof__() > size
+    for i, s in enumerate(strings):
+        assert s in t
+        assert t[s] == i
+        assert t.get(s) == i
+        assert t.has_node(s)
+    assert not b"ABCA" in t
+    assert not b"fo" in t
+    assert t.has_node(b"fo")
+    assert not t.has_node(b"fox")
+    assert t.get(b"fo", 123) == 123
+    assert t.longest_prefix(b"foozle") == ("foo", strings.index(b"foo"))
+    assert t.longest_prefix(b"foobarbaz") == ("foobar", strings.index(b"foobar"))
+    assert t.longest_prefix(b"ACX") == ("A", strings.index(b"A"))
+    assert t.longest_prefix(b"X") == ("", strings.index(b""))
+
+    # Changing values keeps the trie compiled
+    t[b"foo"] = "bar"
+    assert t.is_compiled()
+    assert t[b"foo"] == "bar"
+
+    # Adding and removing keys does not
+    t[b"new"] = 1
+    assert not t.is_compiled()
+    assert t[b"new"] == 1
+    t.compile()
+    assert t[b"new"] == 1
+    del t[b"new"]
+    assert not t.is_compiled()
+    assert not b"new" in t
+    assert t.__sizeof__() == size
+
+    # Larger, dense trie
+    t = Trie()
+    for i in xrange(5000):
+        t[b(str(i * 7))] = i
+    t.compile()
+    for i in xrange(5000):
+        assert t[b(str(i * 7))] == i
+        assert not b(str(i * 7) + "x") in t
+
 def test_longest_prefix():
     t = Trie()
     assert t.longest_prefix(b"foobar") is None
@@ -458,6 +693,418 @@ def test_longest_prefix():
     assert t.longest_prefix(key=b"foozle") == ("fo", 1)
     assert t.longest_prefix(key=b"foobar") == ("foobar", 3)
 
+def test_longest_prefix_approx():
+    t = Trie()
+    assert t.longest_prefix_approx(b"abc", 1) is None
+    t[b"ACG"] = 1
+    t[b"ACGTTA"] = 2
+    t[b"TCGTAA"] = 3
+    t[b"ACGTAC"] = 4
+
+    assert t.longest_prefix_approx(b"ACGTAAGG", 0) == (0, "ACG", 1)
+    # all keys of length 6 are one mismatch away
+    assert t.longest_prefix_approx(b"ACGTAAGG", 1) in \
+            [(1, "ACGTAC", 4), (1, "TCGTAA", 3), (1, "ACGTTA", 2)]
+    # ties in length go to the key with the fewest mismatches
+    assert t.longest_prefix_approx(b"ACGTACGG", 2) == (0, "ACGTAC", 4)
+    assert t.longest_prefix_approx(b"TCGTAT", 2) == (1, "TCGTAA", 3)
+    assert t.longest_prefix_approx(b"GGG", 1) is None
+    assert t.longest_prefix_approx(b"GGG", 3) == (2, "ACG", 1)
+    assert t.longest_prefix_approx(b"AC", 2) is None
+    assert t.longest_prefix_approx(b"ANGTAC", 0, equiv = {b"N": b"ACGT"}) \
+            == (0, "ACGTAC", 4)
+    with pytest.raises(ValueError):
+        t.longest_prefix_approx(b"ACG", -1)
+
+    # with maxhd 0 it agrees with longest_prefix
+    for q in [b"ACGTTAC", b"ACGT", b"TCGTAAA", b"A"]:
+        exact = t.longest_prefix(q)
+        approx = t.longest_prefix_approx(q, 0)
+        assert (exact is None and approx is None) or \
+                approx == (0, exact[0], exact[1])
+
+def test_prefixes():
+    t = Trie()
+    assert t.prefixes(b"abc") == []
+    t[b"a"] = 1
+    t[b"abc"] = 3
+    t[b"abcde"] = 5
+    t[b"abd"] = 0
+    assert t.prefixes(b"abcdef") == [("a", 1), ("abc", 3), ("abcde", 5)]
+    assert t.prefixes(b"abc") == [("a", 1), ("abc", 3)]
+    assert t.prefixes(b"ab") == [("a", 1)]
+    assert t.prefixes(b"b") == []
+    assert t.prefixes(b"") == []
+    t[b""] = 0
+    assert t.prefixes(b"") == [("", 0)]
+    assert t.prefixes(b"abx") == [("", 0), ("a", 1)]
+    # the last prefix is the longest prefix
+    assert t.prefixes(b"abcdx")[-1] == t.longest_prefix(b"abcdx")
+
+    queries = [b"abcdef", b"", b"xyz", b"abdd"]
+    expected = [t.prefixes(q) for q in queries]
+    assert t.prefixes_many(queries) == expected
+    assert t.prefixes_many(iter(queries)) == expected
+    assert t.prefixes_many([]) == []
+    t.compile()
+    assert t.prefixes_many(queries) == expected
+    with pytest.raises(TypeError):
+        t.prefixes_many([b"a", 1])
+    with pytest.raises(TypeError):
+        t.prefixes_many(1)
+
+def test_delete_prefix():
+    t = Trie()
+    assert t.delete_prefix(b"foo") == 0
+    t[b"fo"] = 1
+    t[b"foo"] = 2
+    t[b"foobar"] = 3
+    t[b"foozle"] = 4
+    t[b"hello"] = 5
+    n = t.num_nodes()
+    size = t.__sizeof__()
+    assert t.delete_prefix(b"fooz") == 1
+    assert t.num_nodes() == n - 3
+    assert t.__sizeof__() == size - 3 * 56 - 7
+    assert set(t.keys()) == set(["fo", "foo", "foobar", "hello"])
+    assert t.delete_prefix(b"foo") == 2
+    assert set(t.keys()) == set(["fo", "hello"])
+    assert t.delete_prefix(b"x") == 0
+    assert len(t) == 2
+
+    # Nodes leading up to the removed prefix are pruned as well
+    assert t.delete_prefix(b"hell") == 1
+    assert not t.has_node(b"h")
+    assert t.num_nodes() == 2
+
+    # Removing with an empty prefix clears the trie
+    t[b""] = 0
+    t[b"abc"] = [1, 2]
+    assert t.delete_prefix(b"") == 3
+    assert len(t) == 0
+    assert t.num_nodes() == 0
+    assert t.__sizeof__() == Trie().__sizeof__()
+
+    # Active iterators must notice the removal
+    t[b"abc"] = 1
+    it = iter(t)
+    t.delete_prefix(b"a")
+    with pytest.raises(RuntimeError):
+        next(it)
+
+def test_retain():
+    t = Trie()
+    assert t.retain(lambda k, v: False) == 0
+    for i in xrange(100):
+        t[b(str(i))] = i
+    n = t.num_nodes()
+    assert t.retain(lambda k, v: int(k) % 2 == 0) == 50
+    assert set(t.values()) == set(xrange(0, 100, 2))
+
+    # Numeric thresholds, mixing integers and floats
+    assert t.retain(min_value = 10) == 5
+    assert min(t.values()) == 10
+    assert t.retain(min_value = 20.5) == 6
+    assert min(t.values()) == 22
+    t[b"float"] = 1.5
+    t[b"big"] = 2**70
+    assert t.retain(min_value = 2) == 1
+    assert b"big" in t and not b"float" in t
+    n = len(t)
+    assert t.retain(min_value = 2**65) == n - 1
+    assert t.keys() == ["big"]
+
+    # pred may read the trie, also once it is compiled or indexed
+    u = Trie()
+    for i in xrange(200):
+        u[b("k%03d" % i)] = i
+    u.compile()
+    assert u.retain(lambda k, v: (u.get(b"k199"), k != "k199")[1]) == 1
+    assert len(u) == 199 and u.get(b"k198") == 198
+    list(u.contains_substring(b"k0"))
+    reads = lambda: (list(u.contains_substring(b"k1")),
+            list(u.neighbors(b"k000", 2, engine="scan")),
+            list(u.neighbors(b"k000", 2, engine="split")))
+    assert u.retain(lambda k, v: (reads(), k[1] != "1")[1]) == 99
+    assert len(u) == 100
+    assert sorted(k for _, k, _ in u.neighbors(b"k000", 1,
+        engine="scan")) == ["k00%d" % i for i in xrange(1, 10)] + \
+                ["k0%d0" % i for i in xrange(1, 10)]
+
+    # Empty branches are pruned
+    assert t.retain(lambda k, v: False) == 1
+    assert len(t) == 0
+    assert t.num_nodes() == 0
+    assert t.__sizeof__() == Trie().__sizeof__()
+
+    with pytest.raises(TypeError):
+        t.retain()
+    with pytest.raises(TypeError):
+        t.retain(lambda k, v: True, min_value = 1)
+
+    # Errors raised by the predicate are propagated
+    t[b"a"] = 1
+    t[b"b"] = None
+    with pytest.raises(TypeError):
+        t.retain(min_value = 1)
+    def fail(k, v):
+        raise ValueError()
+    with pytest.raises(ValueError):
+        t.retain(fail)
+
+    # The predicate must not modify the trie
+    def modify(k, v):
+        t[b"xyz"] = 1
+        return True
+    with pytest.raises(RuntimeError):
+        t.retain(modify)
+
+def test_scan():
+    def naive_scan(t, text):
+        return sorted((i, text[i:j].decode(), t[text[i:j]])
+                for j in range(len(text) + 1) for i in range(j + 1)
+                if text[i:j] in t)
+
+    t = Trie()
+    assert t.scan(b"abc") == []
+    for k in [b"he", b"she", b"his", b"hers", b"e", b"ers"]:
+        t[k] = len(k)
+    text = b"ushershishe"
+    result = t.scan(text)
+    assert sorted(result) == naive_scan(t, text)
+    # occurrences are ordered by their end, longest key first
+    assert result[:4] == [(1, "she", 3), (2, "he", 2), (3, "e", 1),
+            (2, "hers", 4)]
+    assert t.is_compiled()
+    assert t.scan(b"") == []
+    assert t.scan(b"xyz") == []
+
+    # the automaton is dropped and rebuilt when keys change
+    t[b"ush"] = 0
+    assert not t.is_compiled()
+    assert (0, "ush", 0) in t.scan(text)
+    del t[b"e"]
+    assert sorted(t.scan(text)) == naive_scan(t, text)
+
+    # the empty key occurs at every position, after the keys ending there
+    t[b""] = -1
+    result = t.scan(text)
+    assert sorted(result) == naive_scan(t, text)
+    assert result[:5] == [(0, "", -1), (1, "", -1), (2, "", -1),
+            (0, "ush", 0), (3, "", -1)]
+    assert t.scan(b"") == [(0, "", -1)]
+    assert t.prefixes(text)[0] == ("", -1)
+
+    t = Trie()
+    keys = [b("".join(p))
+            for n in (1, 2, 3) for p in product("ACG", repeat = n)]
+    for i, k in enumerate(keys):
+        t[k] = i
+    text = b"ACGGTACAGCATTGACGGA"
+    assert sorted(t.scan(text)) == naive_scan(t, text)
+
+    # positions of str keys count code points
+    t = Trie()
+    t[u"\u00e9t\u00e9"] = 1
+    assert t.scan(u"l'\u00e9t\u00e9") == [(2, u"\u00e9t\u00e9", 1)]
+    assert t.scan(u"\u2603") == []
+
+def test_scan_approx():
+    def hamming(s1, s2):
+        return sum(c1 != c2 for c1, c2 in zip(s1, s2))
+
+    def naive_scan(t, text, maxhd):
+        return sorted((i, hamming(k, text[i:i + len(k)]), k.decode(), v)
+                for k, v in ((b(k), v) for k, v in t.items())
+                for i in range(len(text) - len(k) + 1)
+                if hamming(k, text[i:i + len(k)]) <= maxhd)
+
+    t = Trie()
+    assert t.scan_approx(b"abc", 1) == []
+    t[b"ACGT"] = 0
+    t[b"AC"] = 1
+    t[b"TTT"] = 2
+    text = b"ACGAACGTTTA"
+    assert sorted(t.scan_approx(text, 0)) == \
+            sorted((p, 0, k, v) for p, k, v in t.scan(text))
+    for maxhd in range(4):
+        result = t.scan_approx(text, maxhd)
+        assert sorted(result) == naive_scan(t, text, maxhd)
+        ends = [x[0] + len(x[2]) for x in result]
+        assert ends == sorted(ends)
+
+    with pytest.raises(ValueError):
+        t.scan_approx(text, -1)
+
+    # keys longer than the rest of the text do not match
+    assert sorted(t.scan_approx(b"ACG", 1)) == naive_scan(t, b"ACG", 1)
+
+    assert (4, 0, "ACGT", 0) in t.scan_approx(b"GGGGANGT", 1,
+            equiv = {b"N": b"ACGT"})
+
+    # the empty key occurs at every position, as in scan()
+    t[b""] = 3
+    assert t.scan_approx(text, 0) == [(p, 0, k, v) for p, k, v in
+            t.scan(text)]
+    assert sorted(t.scan_approx(text, 1)) == naive_scan(t, text, 1)
+    assert t.scan_approx(b"", 1) == [(0, 0, "", 3)]
+
+    t = Trie()
+    keys = [b("".join(p)) for p in product("ACG", repeat = 4)]
+    for i, k in enumerate(keys):
+        t[k] = i
+    text = b"ACGGTACAGCATTGACGGA"
+    assert sorted(t.scan_approx(text, 2)) == naive_scan(t, text, 2)
+
+def test_segment():
+    t = Trie()
+    assert t.segment(b"abc") == []
+    t[b"the"] = 1
+    t[b"then"] = 2
+    t[b"re"] = 3
+    t[b"there"] = 4
+    t[b"is"] = 5
+    assert t.segment(b"thereis") == [(0, 5, "there", 4), (5, 7, "is", 5)]
+    assert t.segment(b"thenthe") == [(0, 4, "then", 2), (4, 7, "the", 1)]
+    # characters without a matching key are skipped
+    assert t.segment(b"x there, is") == [(2, 7, "there", 4),
+            (9, 11, "is", 5)]
+    assert t.segment(b"") == []
+
+    # the empty key does not consume any text
+    t[b""] = 0
+    assert t.segment(b"xis") == [(1, 3, "is", 5)]
+
+    # segmenting gives the same result as repeated longest_prefix calls
+    text = b"thenthereisthe re"
+    tokens = []
+    i = 0
+    while i < len(text):
+        match = t.longest_prefix(text[i:])
+        if match is None or len(match[0]) == 0:
+            i += 1
+            continue
+        tokens.append((i, i + len(match[0]), match[0], match[1]))
+        i += len(match[0])
+    assert t.segment(text) == tokens
+    t.compile()
+    assert t.segment(text) == tokens
+
+def test_substring():
+    t = Trie()
+    assert t.contains_substring(b"A") == []
+    t[b"ACGTAC"] = 1
+    t[b"TTACG"] = 2
+    t[b"GGG"] = 3
+    t[b"AC"] = 4
+    # keys ordered, with the first position of the substring in the key
+    assert t.contains_substring(b"AC") == [(0, "AC", 4), (0, "ACGTAC", 1),
+            (2, "TTACG", 2)]
+    assert t.contains_substring(b"GG") == [(0, "GGG", 3)]
+    assert t.contains_substring(b"ACGTACG") == []
+    assert len(t.contains_substring(b"")) == 4
+    # every key contains the empty string, the empty key included
+    u = Trie()
+    u[b""] = 0
+    u[b"abc"] = 1
+    u[b"xbz"] = 2
+    assert u.contains_substring(b"") == [(0, "", 0), (0, "abc", 1),
+            (0, "xbz", 2)]
+    assert u.substring_neighbors(b"", 1) == [(0, 0, "", 0),
+            (0, 0, "abc", 1), (0, 0, "xbz", 2)]
+    assert u.contains_substring(b"b") == [(1, "abc", 1), (1, "xbz", 2)]
+    assert u.substring_neighbors(b"q", 1) == [(0, 1, "abc", 1),
+            (0, 1, "xbz", 2)]
+
+    # the index is rebuilt after the keys change
+    t[b"CACA"] = 5
+    assert t.contains_substring(b"CA") == [(0, "CACA", 5)]
+    assert t.contains_substring(b"AC") == [(0, "AC", 4), (0, "ACGTAC", 1),
+            (1, "CACA", 5), (2, "TTACG", 2)]
+    del t[b"CACA"]
+    assert t.contains_substring(b"CA") == []
+
+    assert t.substring_neighbors(b"TAC", 0) == [(3, 0, "ACGTAC", 1),
+            (1, 0, "TTACG", 2)]
+    # the closest substring of each key is reported
+    assert t.substring_neighbors(b"GTA", 1) == [(2, 0, "ACGTAC", 1),
+            (0, 1, "TTACG", 2)]
+    assert t.substring_neighbors(b"CCC", 1) == []
+    assert t.substring_neighbors(b"CCC", 3) == [(0, 2, "ACGTAC", 1),
+            (0, 3, "GGG", 3), (1, 2, "TTACG", 2)]
+    with pytest.raises(ValueError):
+        t.substring_neighbors(b"A", -1)
+
+    # compare against a brute force search
+    t = Trie()
+    keys = ["".join(p) for n in range(1, 8) for p in product("ACGT",
+        repeat=n)][::37]
+    for key in keys:
+        t[key.encode()] = key
+    for s in ["".join(p) for p in product("ACGT", repeat=3)][::5]:
+        assert sorted(x[1] for x in t.contains_substring(s.encode())) == \
+                sorted(key for key in keys if s in key)
+        expected = []
+        for key in keys:
+            hds = [sum(a != b for a, b in zip(s, key[i:i + len(s)]))
+                    for i in range(len(key) - len(s) + 1)]
+            if hds and min(hds) <= 1:
+                expected.append((min(hds), key))
+        assert sorted((x[1], x[2]) for x in t.substring_neighbors(
+            s.encode(), 1)) == sorted(expected)
+
+def test_reverse_index():
+    t = Trie()
+    with pytest.raises(ValueError):
+        t.endswith(b"A")
+    with pytest.raises(ValueError):
+        t.longest_suffix(b"A")
+
+    t = Trie(reverse_index=True)
+    assert t.endswith(b"A") == []
+    assert t.longest_suffix(b"A") is None
+    t[b"CASSLGQGYEQYF"] = 1
+    t[b"CASSPGTGYEQYF"] = 2
+    t[b"CASRDNTEAFF"] = 3
+    t[b"YF"] = 4
+    t[b"F"] = 5
+    assert sorted(t.endswith(b"GYEQYF")) == [("CASSLGQGYEQYF", 1),
+            ("CASSPGTGYEQYF", 2)]
+    assert sorted(t.endswith(b"YF")) == [("CASSLGQGYEQYF", 1),
+            ("CASSPGTGYEQYF", 2), ("YF", 4)]
+    assert len(t.endswith(b"")) == 5
+    assert t.longest_suffix(b"GYEQYF") == ("YF", 4)
+    assert t.longest_suffix(b"CASSPGTGYEQYF") == ("CASSPGTGYEQYF", 2)
+    assert t.longest_suffix(b"EAFF") == ("F", 5)
+    assert t.longest_suffix(b"EAF") == ("F", 5)
+    assert t.longest_suffix(b"AA") is None
+
+    # end-anchored fuzzy matching
+    assert sorted(t.endswith_approx(b"GTEQYF", 1)) == [
+            (1, "CASSLGQGYEQYF", 1), (1, "CASSPGTGYEQYF", 2)]
+    assert sorted(t.endswith_approx(b"NTEAFF", 0, equiv={b"N": b"DN"})) == \
+            [(0, "CASRDNTEAFF", 3)]
+    assert sorted(t.endswith_approx(b"TEAYF", 1)) == [(1, "CASRDNTEAFF", 3)]
+    with pytest.raises(ValueError):
+        t.endswith_approx(b"F", -1)
+
+    # the reverse index follows changes to the trie and shares its values
+    del t[b"YF"]
+    t[b"CASSPGTGYEQYF"] = 6
+    assert sorted(t.endswith(b"YF")) == [("CASSLGQGYEQYF", 1),
+            ("CASSPGTGYEQYF", 6)]
+    assert t.delete_prefix(b"CASS") == 2
+    assert t.endswith(b"YF") == []
+    t.retain(lambda k, v: v != 5)
+    assert t.endswith(b"F") == [("CASRDNTEAFF", 3)]
+    t[b"ACF"] = 7
+    t.compact()
+    assert sorted(t.endswith(b"F")) == [("ACF", 7), ("CASRDNTEAFF", 3)]
+
+    # the option survives pickling
+    t2 = pickle.loads(pickle.dumps(t))
+    assert sorted(t2.endswith(b"F")) == [("ACF", 7), ("CASRDNTEAFF", 3)]
+
 def test_suffixes():
     t = Trie()
     t[b"production"] = 1
@@ -540,6 +1187,144 @@ def test_neighbors():
         t[s] = 0
     assert len(neighbors(t, b"AAA", 1)) == 6
 
+def test_neighbors_cache():
+    t = Trie()
+    assert t.cache_stats()["capacity"] == 0
+    t = Trie(cache_size=2)
+    for key in (b"ACGT", b"ACGA", b"TCGA", b"ACCC", b"GGGG", b"AC"):
+        t[key] = key
+    expected = [(1, "ACGA", b"ACGA"), (2, "ACCC", b"ACCC"),
+            (2, "TCGA", b"TCGA")]
+    assert sorted(t.neighbors(b"ACGT", 2)) == expected
+    assert sorted(t.neighbors(b"ACGT", 2)) == expected
+    stats = t.cache_stats()
+    assert (stats["hits"], stats["misses"], stats["entries"]) == (1, 1, 1)
+    assert stats["hit_rate"] == 0.5
+    assert stats["memory"] > 0
+    assert t.__sizeof__() >= stats["memory"]
+
+    # other options are cached separately, the least recently used entry is
+    # evicted
+    assert sorted(t.neighbors(b"ACGT", 1)) == [(1, "ACGA", b"ACGA")]
+    assert len(list(t.neighbors(b"ACGT", 1, equiv={b"T": b"A"}))) == 2
+    assert t.cache_stats()["entries"] == 2
+    assert sorted(t.neighbors(b"ACGT", 2)) == expected
+    assert t.cache_stats()["hits"] == 1
+
+    # values are looked up when iterating over cached results
+    t[b"ACGA"] = 1
+    assert sorted(t.neighbors(b"ACGT", 2))[0] == (1, "ACGA", 1)
+    assert t.cache_stats()["hits"] == 2
+
+    # keys far from cached queries leave them in place, nearby keys do not
+    t[b"TTTT"] = 2
+    assert t.cache_stats()["entries"] == 2
+    t[b"ACTT"] = 3
+    assert t.cache_stats()["entries"] == 0
+    assert sorted(t.neighbors(b"ACGT", 1)) == [(1, "ACGA", 1),
+            (1, "ACTT", 3)]
+    del t[b"ACGA"]
+    assert sorted(t.neighbors(b"ACGT", 1)) == [(1, "ACTT", 3)]
+    t.compact()
+    assert t.cache_stats()["entries"] == 0
+    assert sorted(t.neighbors(b"ACGT", 1)) == [(1, "ACTT", 3)]
+
+    # abandoned iterations are not cached
+    t = Trie(cache_size=10)
+    for key in product("AC", repeat=3):
+        t[b("".join(key))] = 0
+    next(t.neighbors(b"AAA", 1))
+    assert t.cache_stats()["entries"] == 0
+    with pytest.raises(ValueError):
+        Trie(cache_size=-1)
+
+    t2 = pickle.loads(pickle.dumps(t))
+    assert t2.cache_stats()["capacity"] == 10
+
+    # changing keys does not look at the cached queries, they are checked
+    # when next looked up, so the size of the cache stays the same until
+    # then (bench/bench_cache.py times this)
+    t = Trie(cache_size=1000)
+    cached = ["".join(key) for key in islice(product("AC", repeat=14),
+        1000)]
+    for key in cached:
+        t[b(key)] = 0
+    for key in cached:
+        list(t.neighbors(b(key), 1))
+    t[b"G" * 14] = 0
+    del t[b"G" * 14]
+    size = t.__sizeof__()
+    for i in range(100):
+        t[b(cached[i][:-1] + "G")] = 0
+        del t[b(cached[i][:-1] + "G")]
+    assert t.__sizeof__() == size
+    assert t.cache_stats()["entries"] == 0
+    assert t.__sizeof__() < size
+
+    # changing the empty key only drops the results of the empty query
+    t = Trie(cache_size=10)
+    t[b""] = 0
+    t[b"A"] = 1
+    assert list(t.neighbors(b"", 1)) == []
+    assert list(t.neighbors(b"A", 1)) == []
+    del t[b""]
+    t[b""] = 0
+    assert t.cache_stats()["entries"] == 1
+    assert list(t.neighbors(b"", 1)) == []
+    t[b"C"] = 2
+    assert list(t.neighbors(b"A", 1)) == [(1, "C", 2)]
+    assert t.cache_stats()["misses"] == 4
+
+    # many changes since a query was cached drop its results
+    t = Trie(cache_size=10)
+    keys = ["".join(key) for key in product("ACGT", repeat=4)]
+    for key in keys:
+        t[b(key)] = 0
+    list(t.neighbors(b"AAAA", 1))
+    for key in keys[-100:]:
+        del t[b(key)]
+    assert t.cache_stats()["entries"] == 0
+    assert sorted(t.neighbors(b"AAAA", 1)) == sorted((1, key, 0)
+            for key in keys[:-100] if sum(c != "A" for c in key) == 1)
+
+def test_equiv():
+    neighbors = lambda t, s, maxhd, equiv: set([
+        tuple(x) for x in t.neighbors(s, maxhd, equiv = equiv)])
+
+    t = Trie()
+    t[b"ACGT"] = 0
+    t[b"ANGT"] = 1
+    t[b"ATGA"] = 2
+    t[b"NNNN"] = 3
+
+    assert neighbors(t, b"ACGT", 1, None) == set([(1, "ANGT", 1)])
+    equiv = {b"N": b"ACGT"}
+    assert neighbors(t, b"ACGT", 1, equiv) == set([
+            (0, "ANGT", 1), (0, "NNNN", 3)])
+    # equivalence is symmetric, and N matches T in ATGA
+    assert neighbors(t, b"ANGT", 1, equiv) == set([
+            (0, "ACGT", 0), (0, "NNNN", 3), (1, "ATGA", 2)])
+    # str characters are accepted as well
+    assert neighbors(t, b"ACGT", 1, {"N": "ACGT"}) == \
+            neighbors(t, b"ACGT", 1, equiv)
+    # characters with overlapping sets match each other
+    assert neighbors(t, b"ACGT", 1, {b"C": b"CT", b"T": b"T"}) == set([
+            (1, "ANGT", 1), (1, "ATGA", 2)])
+    assert neighbors(t, b"ACGT", 2, {b"C": b"CT", b"T": b"T"}) == set([
+            (1, "ANGT", 1), (1, "ATGA", 2)])
+    assert neighbors(t, b"ATGA", 1, {b"C": b"CT"}) == set([(1, "ACGT", 0)])
+
+    with pytest.raises(TypeError):
+        list(t.neighbors(b"ACGT", 1, equiv = [b"N"]))
+    with pytest.raises(ValueError):
+        list(t.neighbors(b"ACGT", 1, equiv = {b"NN": b"ACGT"}))
+
+    pairs = set((hd, k1, k2) if k1 < k2 else (hd, k2, k1)
+            for hd, k1, v1, k2, v2 in t.pairs(4, 1, equiv = equiv))
+    assert pairs == set([
+            (0, "ACGT", "ANGT"), (0, "ACGT", "NNNN"), (0, "ANGT", "NNNN"),
+            (1, "ANGT", "ATGA"), (0, "ATGA", "NNNN")])
+
 def eqp(pairs, x):
     """test if pairs and x are equal."""
     if len(pairs) != len(x):
@@ -549,6 +1334,19 @@ def eqp(pairs, x):
             return False
     return True
 
+def norm_pairs(pairs, values=False):
+    """pairs as sorted (hd, key1, key2) tuples with the keys in order, or
+    (hd, (key1, value1), (key2, value2)) tuples if values is true."""
+    if values:
+        return sorted((p[0],) + tuple(sorted([(p[1], p[2]), (p[3], p[4])]))
+                for p in pairs)
+    return sorted((p[0],) + tuple(sorted([p[1], p[3]])) for p in pairs)
+
+def random_keys(n, keylen, alphabet="ACGT"):
+    """n random str keys of length keylen, drawn with the random module."""
+    return ["".join(random.choice(alphabet) for i in range(keylen))
+            for j in range(n)]
+
 def test_pairs():
     get_pairs = lambda t, keylen, maxhd:[(s1, s2) \
             for hd, s1, value1, s2, value2 in t.pairs(keylen, maxhd)]
@@ -572,15 +1370,32 @@ def test_pairs():
     t[b"hello"] = 0
     t[b"h3llo"] = 1
     assert eqp([("hello", "h3llo")], get_pairs(t, 5, 1))
-    i1 = t.pairs(5, 1)
-    i2 = t.pairs(5, 1)
+    i1 = t.pairs(5, 1, engine="trie")
+    i2 = t.pairs(5, 1, engine="trie")
     with pytest.raises(RuntimeError):
         next(i1)
     assert next(i2) == (1, "hello", 0, "h3llo", 1)
 
+    # By default pairs() never returns a dirty iterator, whatever the engine
+    # picked for the size of the input
+    random.seed(97)
+    for n in (50, 5000):
+        t = Trie()
+        for i, key in enumerate(random_keys(n, 12)):
+            t[b(key)] = i
+        for maxhd in (1, 2):
+            assert t.explain("pairs", 12, maxhd)["engine"] != "trie"
+            i1 = t.pairs(12, maxhd)
+            i2 = t.pairs(12, maxhd)
+            found = list(zip(i1, i2))
+            assert list(i1) == list(i2) == []
+            expected = norm_pairs(t.pairs(12, maxhd, engine="trie"))
+            assert norm_pairs(p for p, _ in found) == expected
+            assert norm_pairs(p for _, p in found) == expected
+
     # One should be able to modify the trie if a dirty iterator is active.
     t = Trie()
-    it = t.pairs(1,1)
+    it = t.pairs(1,1, engine="trie")
     t[b"abc"] = 1
 
     t = Trie()
@@ -673,3 +1488,289 @@ def test_pairs():
         if i > 100:
             break
     assert len(list(t.pairs(3,3))) == (27 * 26) / 2
+
+def test_delta_pairs():
+    t = Trie()
+    with pytest.raises(ValueError):
+        t.delta_pairs(3, 1)
+    for key in product("ACG", repeat=3):
+        t[b("".join(key))] = 0
+    t.checkpoint()
+    assert list(t.delta_pairs(3, 1)) == []
+
+    t[b"ACT"] = 1
+    t[b"ATT"] = 2
+    t[b"TTTT"] = 3
+    # pairs with at least one new key, each once
+    expected = [p for p in t.pairs(3, 1) if p[2] or p[4]]
+    assert norm_pairs(t.delta_pairs(3, 1)) == norm_pairs(expected)
+    # the checkpoint advanced for keys of length 3 only
+    assert list(t.delta_pairs(3, 1)) == []
+    assert list(t.delta_pairs(4, 1)) == []
+    t[b"TTTA"] = 4
+    assert list(t.delta_pairs(4, 1)) == [(1, "TTTA", 4, "TTTT", 3)]
+
+    # removed keys are no longer new, a partial iteration keeps keys new
+    t[b"TTT"] = 5
+    t[b"GGT"] = 6
+    del t[b"GGT"]
+    it = t.delta_pairs(3, 2)
+    next(it)
+    del it
+    delta = list(t.delta_pairs(3, 2))
+    assert all(p[1] == "TTT" for p in delta)
+    assert norm_pairs(delta) == norm_pairs(p for p in t.pairs(3, 2)
+            if 5 in (p[2], p[4]))
+
+    # a new checkpoint forgets earlier keys
+    t[b"TTC"] = 7
+    t.checkpoint()
+    assert list(t.delta_pairs(3, 1)) == []
+
+def test_insert_if_isolated():
+    t = Trie()
+    assert t.insert_if_isolated(b"ACGT", 1, 1) is None
+    assert t[b"ACGT"] == 1
+    # blocked by the closest key within maxhd, including the key itself
+    assert t.insert_if_isolated(b"ACGA", 2, 1) == (1, "ACGT", 1)
+    assert t.insert_if_isolated(b"ACGT", 2, 0) == (0, "ACGT", 1)
+    assert t[b"ACGT"] == 1 and b"ACGA" not in t
+    assert t.insert_if_isolated(b"AGGA", 2, 1) is None
+    assert t.insert_if_isolated(b"AGGT", 3, 2) in [(1, "ACGT", 1),
+            (1, "AGGA", 2)]
+    assert t.insert_if_isolated(b"AGGAT", 3, 2) is None
+    assert t.insert_if_isolated(b"TTTT", 4, 1) is None
+    assert len(t) == 4
+    assert t.insert_if_isolated(b"NCGT", 5, 0, equiv={b"N": b"ACGT"}) == \
+            (0, "ACGT", 1)
+    with pytest.raises(ValueError):
+        t.insert_if_isolated(b"A", 1, -1)
+
+    # greedy clustering keeps keys at least maxhd + 1 apart
+    t = Trie()
+    for i, key in enumerate(product("ACG", repeat=4)):
+        t.insert_if_isolated(b("".join(key)), i, 1)
+    keys = list(t.keys())
+    assert all(sum(a != b for a, b in zip(k1, k2)) > 1
+            for k1, k2 in permutations(keys, 2))
+    # and every key is within maxhd of a kept one
+    for key in product("ACG", repeat=4):
+        assert t.insert_if_isolated(b("".join(key)), 0, 1) is not None
+
+def test_count_neighbors():
+    t = Trie()
+    assert not t.has_neighbor(b"ACG", 1)
+    assert t.count_neighbors(b"ACG", 3) == 0
+    for key in product("ACGT", repeat=3):
+        t[b("".join(key))] = 0
+    t[b"AC"] = 0
+    t[b"ACGT"] = 0
+    # the same keys as neighbors(), without the query itself
+    for maxhd in range(4):
+        assert t.count_neighbors(b"ACG", maxhd) == \
+                len(list(t.neighbors(b"ACG", max(maxhd, 1)))) * (maxhd > 0)
+    assert t.count_neighbors(b"ACG", 3) == 63
+    assert t.has_neighbor(b"ACG", 1)
+    assert not t.has_neighbor(b"ACG", 0)
+    # the query does not have to be a key
+    del t[b"ACG"]
+    assert t.count_neighbors(b"ACG", 1) == 9
+    assert t.count_neighbors(b"ACG", 3) == 63
+    assert t.has_neighbor(b"ACG", 1)
+    assert not t.has_neighbor(b"ACG", 0)
+    assert t.has_neighbor(b"ACGA", 1)
+    assert not t.has_neighbor(b"ACGAA", 4)
+    assert t.count_neighbors(b"NCG", 0, equiv={b"N": b"ACGT"}) == 3
+    assert t.count_neighbors(b"NCG", 1, equiv={b"N": b"ACGT"}) == 3 + 3 * 4 * 2
+    with pytest.raises(ValueError):
+        t.count_neighbors(b"ACG", -1)
+
+def test_neighbors_kernels():
+    # maxhd 1 without equiv uses a dedicated kernel, which should find the
+    # same neighbors as the generic search (used with equiv)
+    t = Trie()
+    keys = ["".join(p) for n in range(1, 6) for p in product("ACGT",
+        repeat=n)][::3]
+    for key in keys:
+        t[b(key)] = key
+    for key in keys[::7]:
+        for maxhd in (1, 2, 3):
+            found = list(t.neighbors(b(key), maxhd))
+            assert len(found) == len(set(found))
+            assert sorted(found) == sorted(t.neighbors(b(key), maxhd,
+                equiv={}))
+            assert sorted(found) == sorted((sum(a != b for a, b in
+                zip(key, other)), other, other) for other in keys
+                if len(other) == len(key) and other != key and
+                sum(a != b for a, b in zip(key, other)) <= maxhd)
+
+def test_pairs_engines():
+    t = Trie()
+    for n in range(1, 6):
+        for key in list(product("ACGT", repeat=n))[::3]:
+            t[b("".join(key))] = n
+    t[b"AC\x00T"] = 0
+    t[b"AC\x01T"] = 0
+    for keylen in range(1, 7):
+        expected = norm_pairs(t.pairs(keylen, 1))
+        assert norm_pairs(t.pairs(keylen, 1, engine="trie")) == expected
+        found = list(t.pairs(keylen, 1, engine="masked"))
+        assert norm_pairs(found) == expected
+        assert all(p[2] == t[b(p[1])] and p[4] == t[b(p[3])]
+            for p in found)
+    assert (1, "AC\x00T", "AC\x01T") in norm_pairs(t.pairs(4, 1,
+        engine="masked"))
+
+    # the masked engine does not mark nodes, so it can run next to pairs()
+    i1 = t.pairs(3, 1, engine="trie")
+    i2 = t.pairs(3, 1, engine="masked")
+    next(i1)
+    next(i2)
+
+    with pytest.raises(ValueError):
+        t.pairs(3, 2, engine="masked")
+    with pytest.raises(ValueError):
+        t.pairs(3, 1, equiv={b"N": b"ACGT"}, engine="masked")
+    with pytest.raises(ValueError):
+        t.pairs(3, 1, engine="bogus")
+
+def test_query_planner():
+    random.seed(3)
+    t = Trie()
+    keys = set(random_keys(300, 12))
+    for key in keys:
+        t[b(key)] = key
+    t[b"ACGT"] = 0
+
+    plan = t.explain("neighbors", 12, 2)
+    assert plan["keys"] == len(keys)
+    assert plan["alphabet"] == 4
+    assert sorted(plan["costs"]) == ["frontier", "scan", "split", "trie"]
+    assert plan["engine"] in plan["costs"]
+    assert sorted(t.explain("pairs", 12, 1)["costs"]) == \
+            ["masked", "scan", "split", "trie"]
+    assert "masked" not in t.explain("pairs", 12, 1, equiv={})["costs"]
+    t[b"ACGTACGTACGT"] = 1
+    assert t.explain("pairs", 12, 2)["keys"] == len(keys) + 1
+    del t[b"ACGTACGTACGT"]
+    assert t.explain("pairs", 12, 2)["keys"] == len(keys)
+
+    # all engines find the same neighbors and pairs
+    equiv = {b"N": b"ACGT", b"A": b"AG"}
+    for key in list(keys)[:20]:
+        for maxhd in (1, 3, 6):
+            expected = sorted(t.neighbors(b(key), maxhd, engine="trie"))
+            assert sorted(t.neighbors(b(key), maxhd, engine="scan")) == \
+                    expected
+            assert sorted(t.neighbors(b(key), maxhd)) == expected
+            assert sorted(t.neighbors(b(key), maxhd, equiv=equiv,
+                engine="scan")) == sorted(t.neighbors(b(key), maxhd,
+                    equiv=equiv, engine="trie"))
+    for maxhd in (1, 4):
+        expected = norm_pairs(t.pairs(12, maxhd, engine="trie"))
+        assert norm_pairs(t.pairs(12, maxhd, engine="scan")) == expected
+        assert norm_pairs(t.pairs(12, maxhd)) == expected
+    assert norm_pairs(t.pairs(12, 1, engine="masked")) == \
+            norm_pairs(t.pairs(12, 1))
+
+    # a scan pays off once the keys have been copied for it, and the copy is
+    # dropped when keys change
+    assert t.explain("neighbors", 12, 10)["engine"] == "scan"
+    t[b"ACGTACGTACGT"] = 1
+    assert t.explain("neighbors", 12, 1)["engine"] != "scan"
+    key = next(iter(keys))
+    assert (sum(a != c for a, c in zip(key, "ACGTACGTACGT")),
+            "ACGTACGTACGT", 1) in list(t.neighbors(b(key), 12,
+                engine="scan"))
+
+    # searching breadth-first only pays off once the trie outgrows the cache
+    # and there are enough candidates at each depth
+    for maxhd in (1, 2, 3):
+        assert t.explain("neighbors", 12, maxhd)["engine"] != "frontier"
+    u = Trie()
+    for j, key in enumerate(random_keys(30000, 12)):
+        u[b(key)] = j
+    assert u.explain("neighbors", 12, 1)["engine"] == "trie"
+    assert u.explain("neighbors", 12, 3)["engine"] == "frontier"
+
+    with pytest.raises(ValueError):
+        t.explain("prefixes", 12, 1)
+    with pytest.raises(ValueError):
+        t.explain("pairs", 12, 0)
+    with pytest.raises(ValueError):
+        t.neighbors(b"ACGT", 1, engine="masked")
+    with pytest.raises(ValueError):
+        t.neighbors(b"ACGT", 1, engine="bogus")
+    with pytest.raises(ValueError):
+        t.pairs(12, 1, equiv={}, engine="masked")
+
+def test_neighbors_frontier():
+    random.seed(98)
+    t = Trie()
+    keys = set(random_keys(400, 6, "ACGTN") + random_keys(400, 10, "ACGTN"))
+    for i, key in enumerate(keys):
+        t[b(key)] = i
+    equiv = {b"N": b"ACGT"}
+
+    # the breadth-first search finds what the depth-first search finds
+    for layout in ("inserted", "relayout"):
+        if layout == "relayout":
+            t.relayout()
+        for key in list(keys)[:30]:
+            for maxhd in (1, 2, 4):
+                assert sorted(t.neighbors(b(key), maxhd,
+                    engine="frontier")) == sorted(t.neighbors(b(key), maxhd,
+                        engine="trie"))
+                assert sorted(t.neighbors(b(key), maxhd, equiv=equiv,
+                    engine="frontier")) == sorted(t.neighbors(b(key), maxhd,
+                        equiv=equiv, engine="trie"))
+
+    # levels are expanded in batches as results are asked for
+    u = Trie()
+    for i, chars in enumerate(product("ACGT", repeat=7)):
+        u[b("".join(chars))] = i
+    it = u.neighbors(b"ACGTACG", 7, engine="frontier")
+    assert next(it)[0] >= 1
+    assert len(list(it)) == 4 ** 7 - 2
+    assert sorted(u.neighbors(b"ACGTACG", 5, equiv={b"A": b"AC"},
+        engine="frontier")) == sorted(u.neighbors(b"ACGTACG", 5,
+            equiv={b"A": b"AC"}, engine="trie"))
+
+    it = t.neighbors(b(key), 3, engine="frontier")
+    t[b"ACGTACG"] = -1
+    with pytest.raises(RuntimeError):
+        next(it)
+    with pytest.raises(ValueError):
+        t.pairs(6, 1, engine="frontier")
+
+def test_split_engine():
+    random.seed(99)
+    t = Trie()
+    keys = set(key for length in (1, 7, 20)
+            for key in random_keys(300, length, "ACGTN"))
+    for i, key in enumerate(keys):
+        t[b(key)] = i
+    equiv = {b"N": b"ACGT"}
+
+    # searching the halves apart finds the same keys as searching the trie
+    for key in list(keys)[:30]:
+        for maxhd in (1, 2, 5, 9):
+            for eq in (None, equiv):
+                assert sorted(t.neighbors(b(key), maxhd, equiv=eq,
+                    engine="split")) == sorted(t.neighbors(b(key), maxhd,
+                        equiv=eq, engine="trie"))
+    for keylen in (1, 7, 20):
+        for maxhd in (1, 4):
+            assert norm_pairs(t.pairs(keylen, maxhd, engine="split"),
+                    values=True) == norm_pairs(t.pairs(keylen, maxhd,
+                        engine="scan"), values=True)
+    assert norm_pairs(t.pairs(7, 2, equiv=equiv, engine="split"),
+            values=True) == norm_pairs(t.pairs(7, 2, equiv=equiv,
+                engine="scan"), values=True)
+
+    # the indexes are dropped when keys change
+    key = next(k for k in keys if len(k) == 20)
+    new = key[:10] + "".join("A" if c != "A" else "C" for c in key[10:13]) \
+            + key[13:]
+    t[b(new)] = -1
+    assert (3, new, -1) in list(t.neighbors(b(key), 3, engine="split"))